@@ -1,5 +1,6 @@
 #include <chrono>
 #include "camera_grab.h"
+#include "logger.h"
 
 
 
@@ -8,13 +9,13 @@ cv::VideoCapture InitWebCam(bool &valid_cam, int Horizontal_Res, int Vertical_Re
     cv::VideoCapture capture(0);
     if (!capture.isOpened())
     {
-        printf("Error: Could not open the webcam.\n");
+        LOG_ERROR("Error: Could not open the webcam.");
         valid_cam = false;
         return capture;
     }
     else
     {
-        printf("Webcam open successful \n");
+        LOG_INFO("Webcam open successful");
         valid_cam = true;
         capture.set(cv::CAP_PROP_FRAME_WIDTH, Horizontal_Res);
         capture.set(cv::CAP_PROP_FRAME_HEIGHT, Vertical_Res);
@@ -90,7 +91,7 @@ int get_camera_frame(cv::VideoCapture &capture, cv::Mat &gray_frame_local, cv::M
             cv::resize(Main_Frame, Main_Frame, cv::Size(screen_width, screen_height));
             Main_Frame_Masked = Main_Frame(roi).clone(); // Create Masked frame for motion detect  Masked Size BW
 
-            std::cout << "nonZeroCount_12 " << nonZeroCount_12 << " nonZeroCount_34 " << nonZeroCount_23 << std::endl;
+            LOG_DEBUG("nonZeroCount_12 {} nonZeroCount_34 {}", nonZeroCount_12, nonZeroCount_23);
         }
 
         else if (loop_count == 4)
@@ -123,12 +124,13 @@ int get_camera_frame(cv::VideoCapture &capture, cv::Mat &gray_frame_local, cv::M
             if ((nonZeroCount_12 > Motion_Thresh) && (nonZeroCount_23 > Motion_Thresh))
             {
                 Image_Status = 1;
-                std::cout << "nonZeroCount_12 " << nonZeroCount_12 << " nonZeroCount_34 " << nonZeroCount_23 << std::endl;
+                LOG_DEBUG("nonZeroCount_12 {} nonZeroCount_34 {}", nonZeroCount_12, nonZeroCount_23);
             }
             else
                 Image_Status = 0;
 
-            gray_frame_local = Main_Frame.clone();
+            // into the caller's frame, which is sent as it is
+            Main_Frame.copyTo(gray_frame_local);
         }
 
         // timing measure
@@ -16,6 +16,9 @@
 #include <opencv2/opencv.hpp>
 
 #include "comms.h"
+#include "live_stats.h"
+#include "logger.h"
+#include "frame_clock.h"
 
 #include "camera_grab.h"
 #include "file_io.h"
@@ -29,7 +32,8 @@ void usage()
     cout << "Each server is described by both a port_number and an ip_address," << endl;
     cout << "so the count of port_numbers must mach the count of ip_addresses," << endl;
     cout << "which are paired by their order in the command line." << endl;
-    cout << "If both MRR_Pi_Client_2 and MRR_Pi_server_2 are on the same machine, use 127.0.0.1 as the ip address." << endl;
+    cout << "If both MRR_Pi_Client_2 and MRR_Pi_server_2 are on the same machine, use 127.0.0.1 as the ip address," << endl;
+    cout << "or shm:name to pass frames through shared memory (the server is then started with -i shm:name; the port is ignored)." << endl;
     cout << "Repeat_count defaults to 0 (loop forever), it is the total number of image files to send to each server, repeatedly picking from the 5 images in the 'raw' folder." << endl;
     cout << "Default fps is 30" << endl;
     cout << endl;
@@ -37,19 +41,28 @@ void usage()
     cout << "sample command line (server is running on default port on localhost): ./MRR_Pi_client_2" << endl;
     cout << "sample command line (specify port and ip_address): ./MRR_Pi_client_2 -i 127.0.0.1 -p 5569" << endl;
     cout << "sample command line (two servers specified): ./MRR_Pi_client_2 -i 127.0.0.1 -p 5569 -i 127.0.0.1 -p 5570" << endl;
+    cout << "sample command line (server on this machine, over shared memory): ./MRR_Pi_client_2 -i shm:bench -p 5569" << endl;
     cout << endl;
 }
 
 class CommPlus : public Comm
 {
 public:
-    SD blocking_sd;
+    LatencyHistogram blocking_times;
 };
 
+// set from the parameters before the clients connect
+static int frame_width = 0;
+static int frame_height = 0;
+
 // used to create the subclass CommPlus instead of the default Comm class
 Comm *comm_factory()
 {
-    return new CommPlus();
+    Comm *comm = new CommPlus();
+    // carried in v2 headers, so the server doesn't have to assume the frame
+    // size; a shared-memory link sizes its slots by it as it connects
+    comm->set_frame_format(frame_width, frame_height, MessageData::GRAY8);
+    return comm;
 }
 
 int Display_Test_Images(cv::Mat &Image_1, cv::Mat &Image_2)
@@ -100,7 +113,7 @@ std::string readFileToString(const std::string &filename)
     std::ifstream inputFile(filename);
     if (!inputFile.is_open())
     {
-        std::cerr << "Error opening file" << std::endl;
+        LOG_ERROR("Error opening file");
         return "";
     }
 
@@ -130,7 +143,7 @@ std::deque<std::string> readFileToDeque(const std::string &filename)
     std::ifstream inputFile(filename);
     if (!inputFile.is_open())
     {
-        std::cerr << "Error opening file" << std::endl;
+        LOG_ERROR("Error opening file");
         return {};
     }
 
@@ -213,7 +226,6 @@ int main(int argc, char *argv[])
 
     bool camera_good;
     auto loopStartTime = std::chrono::steady_clock::now();
-    auto loopEndTime = std::chrono::steady_clock::now();
     auto ProcessStartTime = std::chrono::steady_clock::now();
     auto ProcessEndTime = std::chrono::steady_clock::now();
     std::chrono::duration<double> ProcessTime = ProcessEndTime - ProcessStartTime;
@@ -229,6 +241,8 @@ int main(int argc, char *argv[])
     Pi_Parameters_Main Pi_Params;
 
     readParametersFromFile("client_params.txt", Client_Params);
+    frame_width = Client_Params.Screen_H_Size;
+    frame_height = Client_Params.Screen_V_Size;
 
     readPiParametersFromFile("pi_addresses.txt", Pi_Params);
 
@@ -241,8 +255,15 @@ int main(int argc, char *argv[])
     std::string imageFile = "../../images/image.jpg"; // Path to your image file
     cv::Mat img = loadImage(imageFile);
 
-    uchar gray_frame_raw[Client_Params.Screen_H_Size * Client_Params.Screen_V_Size];
-    cv::Mat gray_frame(Client_Params.Screen_V_Size, Client_Params.Screen_H_Size, CV_8UC1, gray_frame_raw);   // Create an empty cv::Mat with the desired dimensions
+    // frames come from the pool from here on: the camera writes each into a
+    // pooled frame (next_gray_frame) that is then sent without copying
+    size_t frame_size = static_cast<size_t>(Client_Params.Screen_H_Size) * Client_Params.Screen_V_Size;
+    FramePool::instance().configure(frame_size, Client_Params.Frame_Pool_Blocks, Client_Params.Huge_Pages_Enable != 0);
+    FrameBuffer next_capture = FrameBuffer::allocate(frame_size);
+    cv::Mat next_gray_frame(Client_Params.Screen_V_Size, Client_Params.Screen_H_Size, CV_8UC1, next_capture.writable_data());
+    // the latest capture, for the sequencer and the test display
+    FrameBuffer gray_frame_pixels;
+    cv::Mat gray_frame(Client_Params.Screen_V_Size, Client_Params.Screen_H_Size, CV_8UC1, cv::Scalar(0));   // Create an empty cv::Mat with the desired dimensions
     cv::Mat frame_Abs_Diff(Client_Params.Motion_Window_V_Size, Client_Params.Motion_Window_H_Size, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
     std::vector<cv::Mat> Mats_5;
 
@@ -250,8 +271,8 @@ int main(int argc, char *argv[])
 
     cv::namedWindow("Test Webcam Feed", cv::WINDOW_AUTOSIZE);
 
-    std::cout << " HERR " << getNextFileNameRaw("../raw/") << std::endl;
-    std::cout << " HERR " << getNextFileNameTif("../tif/") << std::endl;
+    LOG_INFO(" HERR {}", getNextFileNameRaw("../raw/"));
+    LOG_INFO(" HERR {}", getNextFileNameTif("../tif/"));
 
     /***************************  MY CODE  DONE  ********************************/
 
@@ -281,7 +302,7 @@ int main(int argc, char *argv[])
 
     for (int i = 0; i < 13; i++)
     {
-        std::cout << "argc : " << argv_file[i] << endl;
+        LOG_INFO("argc : {}", argv_file[i]);
     }
 
     // exit(0);
@@ -297,20 +318,73 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    // frames go out once over multicast to every server that joined the
+    // group; the TCP links carry references to them and stay the fallback
+    MulticastSender multicast_sender;
+    bool multicast_open = Client_Params.Multicast_Enable != 0 &&
+                          multicast_sender.open(Client_Params.Multicast_Group, to_string(Client_Params.Multicast_Port), Client_Params.Multicast_Interface);
+
     for (auto comm : comms)
     {
+        if (multicast_open)
+        {
+            comm->set_multicast(&multicast_sender);
+        }
+        // lossless frame compression, if the server agrees to it
+        comm->set_compression(Client_Params.Compression_Enable != 0, Client_Params.Screen_H_Size);
+        // and only the tiles that changed since the last frame sent
+        comm->set_delta(Client_Params.Delta_Enable != 0, Client_Params.Screen_H_Size, Client_Params.Delta_Tile_Size);
+        // servers hold each frame until the DISPLAY_NOW after it
+        comm->set_staged(Client_Params.Staged_Enable != 0);
+        // paced by the servers' ACKs, so a slow link doesn't build a queue
+        comm->set_flow_control(Client_Params.Ack_Enable != 0, static_cast<size_t>(Client_Params.Ack_Window_KB) * 1024);
         comm->send_start_timer();
     }
 
-    SD blocking_sd;
-    SD loop_sd;
+    LatencyHistogram blocking_times;
+    LatencyHistogram loop_intervals;
     long late_count = 0;
+
+    // read with mrr_stat client
+    LiveStats live_stats;
+    live_stats.open("client");
+    int stat_loops = live_stats.add("loops");
+    int stat_loop_p50 = live_stats.add("loop_p50_us", STAT_GAUGE);
+    int stat_loop_p99 = live_stats.add("loop_p99_us", STAT_GAUGE);
+    int stat_connections = live_stats.add("connections", STAT_GAUGE);
+    int stat_send_queue = live_stats.add("send_queue", STAT_GAUGE);
+    int stat_bytes_out = live_stats.add("bytes_out");
+    int stat_messages_out = live_stats.add("messages_out");
+    int stat_sends_dropped = live_stats.add("sends_dropped");
+    int stat_superseded = live_stats.add("images_superseded");
+    int stat_frame_allocations = live_stats.add("frame_allocations");
+    int stat_pool_in_use = live_stats.add("pool_in_use", STAT_GAUGE);
+    int stat_pool_exhausted = live_stats.add("pool_exhausted");
+    int stat_wake_jitter_p50 = live_stats.add("wake_jitter_p50_us", STAT_GAUGE);
+    int stat_wake_jitter_p99 = live_stats.add("wake_jitter_p99_us", STAT_GAUGE);
+    int stat_frame_overruns = live_stats.add("frame_overruns");
+    int stat_cpu = live_stats.add("cpu_percent", STAT_GAUGE);
+    // and for each server, in the order of the command line
+    vector<int> stat_link_round_trip, stat_link_round_trip_p99, stat_link_in_flight, stat_link_window_waits;
+    for (size_t i = 0; i < comms.size(); i++)
+    {
+        string link = "link" + to_string(i) + "_";
+        stat_link_round_trip.push_back(live_stats.add(link + "rtt_us", STAT_GAUGE));
+        stat_link_round_trip_p99.push_back(live_stats.add(link + "rtt_p99_us", STAT_GAUGE));
+        stat_link_in_flight.push_back(live_stats.add(link + "in_flight_bytes", STAT_GAUGE));
+        stat_link_window_waits.push_back(live_stats.add(link + "window_waits"));
+    }
     auto begin = SteadyClock::now();
     long unack_count = 0;
 
-    ostringstream string_stream_X;
-    string_stream_X.write(reinterpret_cast<const char *>(gray_frame.data), gray_frame.total() * gray_frame.elemSize());
-    deque<string> images_to_send_4 = {string_stream_X.str(), string_stream_X.str(), string_stream_X.str(), string_stream_X.str(), string_stream_X.str()};
+    // frames are reference counted, so the same capture is shared by the deque and every comm without copying
+    FrameBuffer blank_frame = FrameBuffer::copy_of(gray_frame.data, gray_frame.total() * gray_frame.elemSize());
+    // the test image sent instead of the camera's half the time, read once
+    cv::Mat image_read = cv::imread("../tif/000106.tif", cv::IMREAD_UNCHANGED);
+    FrameBuffer test_frame = FrameBuffer::copy_of(image_read.data, image_read.total() * image_read.elemSize());
+    deque<FrameBuffer> images_to_send_4 = {blank_frame, blank_frame, blank_frame, blank_frame, blank_frame};
+    // when each of them was captured, so the servers can tell how old a frame is
+    deque<SteadyClock::time_point> capture_times_4(5, SteadyClock::now());
     deque<string> names_to_send_4;
 
     string sending_info;
@@ -327,6 +401,15 @@ int main(int argc, char *argv[])
     // cout << names_to_send_4[2] << " size "  << names_to_send_4.size() <<  endl ;
     // exit(0);
 
+    // a frame every 1/30th, on deadlines that don't drift: sleeps rather
+    // than spinning the whole frame, which took a core
+    FrameClock frame_clock(std::chrono::duration_cast<SteadyClock::duration>(std::chrono::duration<double>(1.0 / 30)),
+                           std::chrono::microseconds(Client_Params.Frame_Spin_us));
+    // the process's CPU time (every thread), sampled each second
+    std::clock_t last_cpu = std::clock();
+    auto last_cpu_time = SteadyClock::now();
+    frame_clock.start();
+
     // for (long loop_count = 0; loop_count < ; loop_count++)
     while (true)
     {
@@ -345,43 +428,53 @@ int main(int argc, char *argv[])
 
 
         Image_Status = get_camera_frame(cap,
-                                        gray_frame,
+                                        next_gray_frame,
                                         frame_Abs_Diff,
                                         Client_Params.Cycle_Time,
                                         Client_Params.Motion_Window_H_Position,
                                         Client_Params.Motion_Window_V_Position,
                                         Client_Params.Noise_Threshold,
                                         Client_Params.Motion_Threshold);
+        auto capture_time = SteadyClock::now();
 
         Image_Motion = (Image_Status == 1);
         New_Frame = (Image_Status >= 0);
 
+        // the capture becomes the latest frame, and the next goes into another
+        if (New_Frame)
+        {
+            gray_frame_pixels = std::move(next_capture);
+            gray_frame = next_gray_frame;
+            next_capture = FrameBuffer::allocate(frame_size);
+            next_gray_frame = cv::Mat(Client_Params.Screen_V_Size, Client_Params.Screen_H_Size, CV_8UC1, next_capture.writable_data());
+        }
+
         // sets the timing of the images presented and stores the image if it moved
         Sequencer(Image_Motion, gray_frame);
 
-        ostringstream string_stream;
-
         // store all the images ready to send
         if (Image_Status >= 0)
         {
+            FrameBuffer captured_frame;
 
             randomValue = std::rand() % 100;
             if (randomValue < 50)
             {
-                //  convert binary mage to string image
-                string_stream.write(reinterpret_cast<const char *>(gray_frame.data), gray_frame.total() * gray_frame.elemSize());
+                //  the camera wrote straight into a shareable frame
+                captured_frame = gray_frame_pixels;
             }
             else
             {
-                cv::Mat image_read = cv::imread("../tif/000106.tif", cv::IMREAD_UNCHANGED);
-                string_stream.write(reinterpret_cast<const char *>(image_read.data), image_read.total() * image_read.elemSize());
+                captured_frame = test_frame;
             }
 
             // put the latest into a a deque so the most recent is always 1st
-            images_to_send_4.push_front(string_stream.str());
+            images_to_send_4.push_front(captured_frame);
+            capture_times_4.push_front(capture_time);
             if (images_to_send_4.size() > 5)
             {
                 images_to_send_4.resize(5);
+                capture_times_4.resize(5);
             }
 
             // for test viewing
@@ -398,9 +491,18 @@ int main(int argc, char *argv[])
             int ix = 0;
             for (auto &comm : comms)
             {
-                string image_data = images_to_send_4[ix]; // = images_to_send_2.front();
-                string send_name = names_to_send_4[ix];   // = names_to_send_2.front();
-                comm->send_image(send_name, image_data);
+                const FrameBuffer &image_data = images_to_send_4[ix]; // = images_to_send_2.front();
+                const string &send_name = names_to_send_4[ix];        // = names_to_send_2.front();
+                comm->send_image(send_name, image_data, capture_times_4[ix]);
+                ix++;
+            }
+
+            // then commit them, far enough ahead for the slowest link to have its frame by then
+            auto present_at = SteadyClock::now() + std::chrono::milliseconds(Client_Params.Present_Lead_ms);
+            ix = 0;
+            for (auto &comm : comms)
+            {
+                comm->send_display_now(names_to_send_4[ix], present_at);
                 ix++;
             }
         }
@@ -411,14 +513,12 @@ int main(int argc, char *argv[])
 
         // if(true)
         if (ProcessTime.count() > .005)
-            std::cout << "ProcessTime: " << ProcessTime.count() << std::endl;
+            LOG_DEBUG("ProcessTime: {}", ProcessTime.count());
 
         // sets the timing of a frame  1/30th
-        loopEndTime = std::chrono::steady_clock::now();
-        std::chrono::duration<double> elapsed_seconds = loopEndTime - loopStartTime;
-        while (elapsed_seconds.count() < .0333333)
-            elapsed_seconds = std::chrono::steady_clock::now() - loopStartTime;
+        frame_clock.wait_next();
         loopStartTime = std::chrono::steady_clock::now();
+        loop_intervals.record_interval(loopStartTime);
 
 
         imshow(windowName, sliders_img);
@@ -431,6 +531,54 @@ int main(int argc, char *argv[])
 
 
         loop_count++;
+        if (loop_count % 300 == 0)
+            LOG_INFO("{}", loop_intervals.summary("client loop"));
+
+        // summed over the servers
+        CommStats client_stats;
+        size_t link = 0;
+        for (auto comm : comms)
+        {
+            CommStats comm_stats = comm->stats();
+            live_stats.set(stat_link_round_trip[link], static_cast<int64_t>(comm_stats.round_trip * 1e6));
+            live_stats.set(stat_link_round_trip_p99[link], static_cast<int64_t>(comm->round_trip_histogram().percentile(99) * 1e6));
+            live_stats.set(stat_link_in_flight[link], comm_stats.in_flight_bytes);
+            live_stats.set(stat_link_window_waits[link], comm_stats.window_waits);
+            link++;
+            client_stats.connections += comm_stats.connections;
+            client_stats.send_queue += comm_stats.send_queue;
+            client_stats.bytes_out += comm_stats.bytes_out;
+            client_stats.messages_out += comm_stats.messages_out;
+            client_stats.sends_dropped += comm_stats.sends_dropped;
+            client_stats.images_superseded += comm_stats.images_superseded;
+        }
+        live_stats.set(stat_loops, loop_count);
+        live_stats.set(stat_loop_p50, static_cast<int64_t>(loop_intervals.percentile(50) * 1e6));
+        live_stats.set(stat_loop_p99, static_cast<int64_t>(loop_intervals.percentile(99) * 1e6));
+        live_stats.set(stat_connections, client_stats.connections);
+        live_stats.set(stat_send_queue, client_stats.send_queue);
+        live_stats.set(stat_bytes_out, client_stats.bytes_out);
+        live_stats.set(stat_messages_out, client_stats.messages_out);
+        live_stats.set(stat_sends_dropped, client_stats.sends_dropped);
+        live_stats.set(stat_superseded, client_stats.images_superseded);
+        live_stats.set(stat_frame_allocations, FramePool::frame_allocations());
+        live_stats.set(stat_pool_in_use, FramePool::instance().in_use());
+        live_stats.set(stat_pool_exhausted, FramePool::instance().exhausted());
+        live_stats.set(stat_wake_jitter_p50, static_cast<int64_t>(frame_clock.wake_jitter().percentile(50) * 1e6));
+        live_stats.set(stat_wake_jitter_p99, static_cast<int64_t>(frame_clock.wake_jitter().percentile(99) * 1e6));
+        live_stats.set(stat_frame_overruns, frame_clock.overruns());
+        if (loop_count % 30 == 0)
+        {
+            std::clock_t cpu = std::clock();
+            double seconds = std::chrono::duration<double>(loopStartTime - last_cpu_time).count();
+            if (seconds > 0)
+            {
+                live_stats.set(stat_cpu, static_cast<int64_t>(100.0 * (cpu - last_cpu) / CLOCKS_PER_SEC / seconds));
+            }
+            last_cpu = cpu;
+            last_cpu_time = loopStartTime;
+        }
+        live_stats.publish();
     }
 
     // give the server time to process the last sends before the connection is dropped
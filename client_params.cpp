@@ -70,6 +70,62 @@ void readParametersFromFile(const std::string &filename, Client_Parameters_Main
         {
             params.Motion_Threshold = std::stoi(value); // Convert string to integer
         }
+        else if (name == "Compression_Enable")
+        {
+            params.Compression_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Delta_Enable")
+        {
+            params.Delta_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Delta_Tile_Size")
+        {
+            params.Delta_Tile_Size = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Multicast_Enable")
+        {
+            params.Multicast_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Multicast_Group")
+        {
+            params.Multicast_Group = value;
+        }
+        else if (name == "Multicast_Port")
+        {
+            params.Multicast_Port = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Multicast_Interface")
+        {
+            params.Multicast_Interface = value;
+        }
+        else if (name == "Staged_Enable")
+        {
+            params.Staged_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Present_Lead_ms")
+        {
+            params.Present_Lead_ms = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Ack_Enable")
+        {
+            params.Ack_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Ack_Window_KB")
+        {
+            params.Ack_Window_KB = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Frame_Pool_Blocks")
+        {
+            params.Frame_Pool_Blocks = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Huge_Pages_Enable")
+        {
+            params.Huge_Pages_Enable = std::stoi(value); // Convert string to integer
+        }
+        else if (name == "Frame_Spin_us")
+        {
+            params.Frame_Spin_us = std::stoi(value); // Convert string to integer
+        }
 
 
         params.Motion_Window_H_Size = (params.Screen_H_Size * params.Motion_Window_H_Size_Multiplier) / 100;
@@ -90,6 +146,14 @@ void readParametersFromFile(const std::string &filename, Client_Parameters_Main
     std::cout << "Parameter 8: " << params.Cycle_Time << std::endl;
     std::cout << "Parameter 9: " << params.Noise_Threshold << std::endl;    
     std::cout << "Parameter 10: " << params.Motion_Threshold << std::endl;        
+    std::cout << "Parameter 11: " << params.Compression_Enable << std::endl;
+    std::cout << "Parameter 12: " << params.Delta_Enable << std::endl;
+    std::cout << "Parameter 13: " << params.Delta_Tile_Size << std::endl;
+    std::cout << "Parameter 14: " << params.Multicast_Enable << " " << params.Multicast_Group << ":" << params.Multicast_Port << std::endl;
+    std::cout << "Parameter 15: " << params.Staged_Enable << " lead " << params.Present_Lead_ms << "ms" << std::endl;
+    std::cout << "Parameter 16: " << params.Ack_Enable << " window " << params.Ack_Window_KB << "KB" << std::endl;
+    std::cout << "Parameter 17: " << params.Frame_Pool_Blocks << " blocks huge pages " << params.Huge_Pages_Enable << std::endl;
+    std::cout << "Parameter 18: " << params.Frame_Spin_us << "us spin" << std::endl;
 };
 
 
@@ -20,10 +20,44 @@ struct Client_Parameters_Main
     int Noise_Threshold;
     int Motion_Threshold;
 
+    int Compression_Enable;
+    int Delta_Enable;
+    int Delta_Tile_Size;
+
+    int Multicast_Enable;
+    std::string Multicast_Group;
+    int Multicast_Port;
+    std::string Multicast_Interface;
+
+    // stage frames on the servers and commit them together with DISPLAY_NOW,
+    // to be shown Present_Lead_ms after they are sent
+    int Staged_Enable;
+    int Present_Lead_ms;
+
+    // servers ACK each frame, and at most Ack_Window_KB of frames are
+    // unacknowledged on a link; newer frames replace one held back
+    int Ack_Enable;
+    int Ack_Window_KB;
+
+    // frames are taken from a pool of Frame_Pool_Blocks screen sized blocks,
+    // in huge pages if Huge_Pages_Enable (see FramePool)
+    int Frame_Pool_Blocks;
+    int Huge_Pages_Enable;
+
+    // the loop sleeps until this long before each frame's deadline, then
+    // spins the rest of the way (see FrameClock); 0 only sleeps
+    int Frame_Spin_us;
+
     // Constructor to initialize default values
     Client_Parameters_Main() : Cam_H_Size(800), Cam_V_Size(600),
                                Screen_H_Size(1024), Screen_V_Size(768),
-                               Motion_Window_H_Size_Multiplier(75), Motion_Window_V_Size_Multiplier(75), Cycle_Time(1.2), Noise_Threshold(5), Motion_Threshold(5000) {}
+                               Motion_Window_H_Size_Multiplier(75), Motion_Window_V_Size_Multiplier(75), Cycle_Time(1.2), Noise_Threshold(5), Motion_Threshold(5000),
+                               Compression_Enable(1), Delta_Enable(1), Delta_Tile_Size(16),
+                               Multicast_Enable(0), Multicast_Group("239.255.42.1"), Multicast_Port(5600), Multicast_Interface(""),
+                               Staged_Enable(1), Present_Lead_ms(70),
+                               Ack_Enable(1), Ack_Window_KB(1024),
+                               Frame_Pool_Blocks(32), Huge_Pages_Enable(0),
+                               Frame_Spin_us(200) {}
 
     int Motion_Window_H_Size = (Screen_H_Size * Motion_Window_H_Size_Multiplier) / 100;
     int Motion_Window_V_Size = (Screen_V_Size * Motion_Window_V_Size_Multiplier) / 100;
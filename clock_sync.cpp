@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+
+#include "clock_sync.h"
+
+constexpr int ClockSync::window;
+constexpr int ClockSync::min_exchanges;
+
+// an exchange is fitted if its round trip is within this of the quickest
+static const int64_t round_trip_slack_ns = 20000;
+// the drift is only fitted over at least this much time, and no more than
+// a crystal could plausibly be off
+static const int64_t min_drift_span_ns = 2000000000;
+static const double max_drift = 500e-6;
+
+static int64_t nanoseconds_of(const ClockSync::TimePoint & time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+void ClockSync::add(int64_t t1, int64_t t2, int64_t t3, int64_t t4) {
+    int64_t round_trip = (t4 - t1) - (t3 - t2);
+    if (round_trip < 0) {
+        // the remote answered before it was asked: not a real exchange
+        return;
+    }
+    lock_guard<mutex> guard(this->exchange_mutex);
+    Exchange & exchange = exchanges[next_exchange];
+    exchange.local_ns = t1 + (t4 - t1) / 2;
+    exchange.offset_ns = ((t2 - t1) + (t3 - t4)) / 2;
+    exchange.round_trip_ns = round_trip;
+    next_exchange = (next_exchange + 1) % window;
+    exchange_count += 1;
+    fit();
+}
+
+void ClockSync::reset() {
+    lock_guard<mutex> guard(this->exchange_mutex);
+    next_exchange = 0;
+    exchange_count = 0;
+    reference_ns = 0;
+    offset_ns = 0;
+    drift = 0;
+    round_trip_ns = 0;
+    dispersion_ns = 0;
+}
+
+void ClockSync::fit() {
+    int count = static_cast<int>(min<long>(exchange_count, window));
+    int quickest = 0;
+    int newest = (next_exchange + window - 1) % window;
+    for (int i = 1; i < count; i++) {
+        if (exchanges[i].round_trip_ns < exchanges[quickest].round_trip_ns) {
+            quickest = i;
+        }
+    }
+    round_trip_ns = exchanges[quickest].round_trip_ns;
+    int64_t limit = round_trip_ns + round_trip_ns / 2 + round_trip_slack_ns;
+
+    // least squares over the quick exchanges, about the newest one so the
+    // sums stay small
+    int64_t reference = exchanges[newest].local_ns;
+    double n = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+    int64_t earliest = reference;
+    for (int i = 0; i < count; i++) {
+        if (exchanges[i].round_trip_ns > limit) {
+            continue;
+        }
+        double x = static_cast<double>(exchanges[i].local_ns - reference);
+        double y = static_cast<double>(exchanges[i].offset_ns - exchanges[quickest].offset_ns);
+        n += 1;
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+        earliest = min(earliest, exchanges[i].local_ns);
+    }
+
+    double slope = 0;
+    double variance = n * sum_xx - sum_x * sum_x;
+    if (n >= min_exchanges && reference - earliest >= min_drift_span_ns && variance > 0) {
+        slope = (n * sum_xy - sum_x * sum_y) / variance;
+        if (fabs(slope) > max_drift) {
+            slope = 0;
+        }
+    }
+    // with no drift fitted this is the mean offset of the quick exchanges
+    double intercept = (sum_y - slope * sum_x) / n;
+
+    double residuals = 0;
+    for (int i = 0; i < count; i++) {
+        if (exchanges[i].round_trip_ns > limit) {
+            continue;
+        }
+        double x = static_cast<double>(exchanges[i].local_ns - reference);
+        double y = static_cast<double>(exchanges[i].offset_ns - exchanges[quickest].offset_ns);
+        double residual = y - (intercept + slope * x);
+        residuals += residual * residual;
+    }
+
+    reference_ns = reference;
+    offset_ns = exchanges[quickest].offset_ns + llround(intercept);
+    drift = slope;
+    dispersion_ns = llround(sqrt(residuals / n));
+}
+
+bool ClockSync::synchronized() const {
+    lock_guard<mutex> guard(this->exchange_mutex);
+    return exchange_count >= min_exchanges;
+}
+
+ClockSync::Estimate ClockSync::estimate() const {
+    lock_guard<mutex> guard(this->exchange_mutex);
+    Estimate estimate;
+    estimate.synchronized = exchange_count >= min_exchanges;
+    estimate.exchanges = exchange_count;
+    int64_t now = nanoseconds_of(std::chrono::steady_clock::now());
+    estimate.offset_ns = to_remote_ns(now) - now;
+    estimate.drift_ppm = drift * 1e6;
+    estimate.round_trip_ns = round_trip_ns;
+    estimate.dispersion_ns = dispersion_ns;
+    return estimate;
+}
+
+int64_t ClockSync::to_remote_ns(int64_t local_ns) const {
+    return local_ns + offset_ns + llround(drift * static_cast<double>(local_ns - reference_ns));
+}
+
+int64_t ClockSync::to_remote(const TimePoint & local) const {
+    lock_guard<mutex> guard(this->exchange_mutex);
+    return to_remote_ns(nanoseconds_of(local));
+}
+
+ClockSync::TimePoint ClockSync::to_local(int64_t remote_ns) const {
+    lock_guard<mutex> guard(this->exchange_mutex);
+    // the drift term is tiny, so one step of refining is exact to the ns
+    int64_t local_ns = remote_ns - offset_ns;
+    local_ns = remote_ns - offset_ns - llround(drift * static_cast<double>(local_ns - reference_ns));
+    return TimePoint(std::chrono::duration_cast<TimePoint::duration>(std::chrono::nanoseconds(local_ns)));
+}
+
+ClockSync::TimePoint ClockSync::next_boundary(const TimePoint & after, const std::chrono::nanoseconds & period) const {
+    int64_t remote_ns = to_remote(after);
+    int64_t period_ns = max<int64_t>(period.count(), 1);
+    int64_t boundary = (remote_ns / period_ns + 1) * period_ns;
+    return to_local(boundary);
+}
@@ -0,0 +1,80 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+using namespace std;
+
+// a remote SteadyClock measured NTP-style: each exchange is a ping sent
+// at t1 (local clock), received at t2 and answered at t3 (remote clock),
+// and the answer received at t4. its offset is ((t2 - t1) + (t3 - t4)) / 2,
+// exact when the two directions take as long. the quickest exchanges of
+// the last 'window' are fitted with a line, giving the offset now and how
+// fast the clocks drift apart; slow ones (queued behind a frame) are left
+// out. added to on the reactor thread, read from any.
+class ClockSync {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    static constexpr int window = 32;
+    // exchanges before the estimate is used
+    static constexpr int min_exchanges = 4;
+
+    struct Estimate {
+        bool synchronized = false;
+        long exchanges = 0;
+        // remote minus local, now
+        int64_t offset_ns = 0;
+        // how much faster the remote clock runs, in parts per million
+        double drift_ppm = 0;
+        // the quickest round trip in the window; half of it bounds the
+        // offset error when the directions are asymmetric
+        int64_t round_trip_ns = 0;
+        // rms distance of the exchanges fitted from the line
+        int64_t dispersion_ns = 0;
+    };
+
+    ClockSync() = default;
+    ClockSync(const ClockSync &) = delete;
+    ClockSync & operator=(const ClockSync &) = delete;
+
+    // t1 and t4 on this clock, t2 and t3 on the remote one, in nanoseconds
+    void add(int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+    void reset();
+
+    bool synchronized() const;
+    Estimate estimate() const;
+    // nanoseconds of the remote clock at 'local'
+    int64_t to_remote(const TimePoint & local) const;
+    TimePoint to_local(int64_t remote_ns) const;
+    // the first multiple of 'period' on the remote clock after 'after', on
+    // this clock: every display locked to the same remote switches together
+    TimePoint next_boundary(const TimePoint & after, const std::chrono::nanoseconds & period) const;
+
+private:
+    struct Exchange {
+        // local midpoint of the exchange, its offset and round trip
+        int64_t local_ns;
+        int64_t offset_ns;
+        int64_t round_trip_ns;
+    };
+
+    // refits the line (with exchange_mutex held)
+    void fit();
+    int64_t to_remote_ns(int64_t local_ns) const;
+
+    mutable mutex exchange_mutex;
+    Exchange exchanges[window] = {};
+    int next_exchange = 0;
+    long exchange_count = 0;
+    // the line: offset_ns at local reference_ns, changing by drift per ns
+    int64_t reference_ns = 0;
+    int64_t offset_ns = 0;
+    double drift = 0;
+    int64_t round_trip_ns = 0;
+    int64_t dispersion_ns = 0;
+};
+
+#endif //CLOCK_SYNC_H
@@ -0,0 +1,101 @@
+// measures frame_codec on the captured frames:
+//   ./MRR_Pi_codec_bench [directory (default ../tif/)] [repetitions (default 10)]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <string.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "frame_codec.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock SteadyClock;
+typedef std::chrono::duration<double> Seconds;
+
+int main(int argc, char *argv[])
+{
+    string directory = argc > 1 ? argv[1] : "../tif/";
+    int repetitions = argc > 2 ? stoi(argv[2]) : 10;
+
+    vector<cv::String> file_names;
+    cv::glob(directory + "*.tif", file_names, false);
+    if (file_names.empty())
+    {
+        cerr << "no .tif files in " << directory << endl;
+        return -1;
+    }
+
+    size_t total_raw = 0;
+    size_t total_encoded = 0;
+    double total_encode_seconds = 0;
+    double total_decode_seconds = 0;
+
+    for (const auto &file_name : file_names)
+    {
+        cv::Mat image = cv::imread(file_name, cv::IMREAD_GRAYSCALE);
+        if (image.empty())
+        {
+            cerr << "could not read " << file_name << endl;
+            continue;
+        }
+        if (!image.isContinuous())
+        {
+            image = image.clone();
+        }
+        const char *data = reinterpret_cast<const char *>(image.data);
+        size_t size = image.total();
+
+        FrameBuffer encoded;
+        FrameBuffer decoded;
+        auto begin = SteadyClock::now();
+        for (int i = 0; i < repetitions; i++)
+        {
+            encode_frame(data, size, image.cols, encoded);
+        }
+        Seconds encode_seconds = SteadyClock::now() - begin;
+
+        if (encoded.empty())
+        {
+            cout << file_name << " " << image.cols << "x" << image.rows << " does not compress" << endl;
+            continue;
+        }
+
+        begin = SteadyClock::now();
+        for (int i = 0; i < repetitions; i++)
+        {
+            decode_frame(encoded.data(), encoded.size(), size, decoded);
+        }
+        Seconds decode_seconds = SteadyClock::now() - begin;
+
+        if (decoded.size() != size || memcmp(decoded.data(), data, size) != 0)
+        {
+            cerr << file_name << " did not round trip" << endl;
+            return -1;
+        }
+
+        double megabytes = size * repetitions / 1e6;
+        cout << file_name << " " << image.cols << "x" << image.rows
+             << " ratio:" << static_cast<double>(size) / encoded.size()
+             << " encode:" << megabytes / encode_seconds.count() << "MB/s"
+             << " decode:" << megabytes / decode_seconds.count() << "MB/s" << endl;
+
+        total_raw += size;
+        total_encoded += encoded.size();
+        total_encode_seconds += encode_seconds.count();
+        total_decode_seconds += decode_seconds.count();
+    }
+
+    if (total_encoded > 0)
+    {
+        double megabytes = total_raw * static_cast<double>(repetitions) / 1e6;
+        cout << "total ratio:" << static_cast<double>(total_raw) / total_encoded
+             << " encode:" << megabytes / total_encode_seconds << "MB/s"
+             << " decode:" << megabytes / total_decode_seconds << "MB/s" << endl;
+    }
+
+    return 0;
+}
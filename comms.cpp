@@ -9,6 +9,11 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <limits.h>
 #endif
 
 #include <stdio.h>
@@ -20,12 +25,16 @@
 #include <fcntl.h>
 #include <streambuf>
 #include <fstream>
+#include <sstream>
 
 #include <regex>
 #include <algorithm>
 #include <cmath>
+#include <random>
 
 #include "comms.h"
+#include "frame_codec.h"
+#include "logger.h"
 
 using namespace std;
 
@@ -33,7 +42,57 @@ using namespace std;
 #define ssize_t SSIZE_T 
 #endif
 
-int const MessageData::header_size = 6;  // 1 for type, 1 for name length, 4 for image length
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// small messages queued together are written with one syscall until
+// their payloads reach this size or the batch holds this many messages
+static const size_t max_batch_messages = 32;
+static const size_t max_batch_payload = 64 * 1024;
+
+// a full frame goes out at least this often, so a receiver that missed a
+// frame (dropped when its queue was full) gets back in step
+static const int delta_key_interval = 30;
+
+// the most a compressed frame decodes to when its header doesn't give the
+// frame size (a v1 header): a 4K frame in BGR with room to spare
+static const size_t max_decoded_size = 64 * 1024 * 1024;
+
+// a client tries an unreachable server again after this long, doubling
+// each time up to the maximum; the jitter keeps the displays of an
+// installation from retrying in lockstep
+static const Seconds reconnect_min_backoff(0.25);
+static const Seconds reconnect_max_backoff(8.0);
+static const double reconnect_jitter = 0.25;
+// a connect attempt to a host that doesn't answer is given up after this
+static const int connect_timeout_ms = 2000;
+// start_clients waits this long for every server before returning
+static const Seconds connect_grace(3.0);
+
+// a server pings a client this often until its clock is known, then
+// less often to follow the drift
+static const Seconds clock_ping_acquire_interval(0.25);
+static const Seconds clock_ping_interval(1.0);
+
+// a shared-memory client that hasn't asked for its slot size this long
+// after connecting is dropped
+static const Seconds shm_request_timeout(1.0);
+
+// with flow control, a frame unacknowledged this long is taken as lost, so
+// a server that stopped acknowledging can't hold the link back for good
+static const Seconds ack_timeout(2.0);
+
+// when this process started, for the time to the first frame
+static const SteadyClock::time_point process_start = SteadyClock::now();
+
+constexpr int MessageData::header_size;
+constexpr int MessageData::header_size_v2;
+constexpr unsigned char MessageData::v2_marker;
+constexpr int MessageData::max_header_size;
+constexpr unsigned char MessageData::compressed_flag;
+constexpr unsigned char MessageData::delta_flag;
+constexpr unsigned char MessageData::reference_flag;
 string const Comm::default_port("5569");
 
 string load_image(const string & raw_filename) {
@@ -43,10 +102,56 @@ string load_image(const string & raw_filename) {
     return string_stream.str();
 }
 
-string MessageData::serialize_header() const {
+template <typename T>
+static void append_value(string & out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static T read_value(const char * in) {
+    T value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+string MessageData::serialize_header(int version) const {
     string header;
     
-    header.push_back(static_cast<char>(this->message_type));
+    unsigned char flags = 0;
+    if (this->compressed) {
+        flags |= compressed_flag;
+    }
+    if (this->delta) {
+        flags |= delta_flag;
+    }
+    if (this->reference) {
+        flags |= reference_flag;
+    }
+
+    if (version >= 2) {
+        header.reserve(header_size_v2 + this->image_name.size());
+        header.push_back(static_cast<char>(v2_marker));
+        header.push_back(2);
+        header.push_back(static_cast<char>(this->message_type));
+        header.push_back(static_cast<char>(flags));
+        auto image_name_length = static_cast<uint16_t>(min<size_t>(this->image_name.size(), UINT16_MAX));
+        append_value<uint16_t>(header, image_name_length);
+        append_value<uint32_t>(header, static_cast<uint32_t>(this->image_data.size()));
+        append_value<uint32_t>(header, static_cast<uint32_t>(this->sequence));
+        // a DISPLAY_NOW or clock message is stamped as it goes out, which lets the receiver relate the clocks
+        bool stamped = this->message_type == DISPLAY_NOW || this->message_type == CLOCK_PING || this->message_type == CLOCK_PONG;
+        SteadyClock::time_point stamp = stamped ? SteadyClock::now() : this->capture_time;
+        append_value<int64_t>(header, std::chrono::duration_cast<std::chrono::nanoseconds>(stamp.time_since_epoch()).count());
+        append_value<uint16_t>(header, this->width);
+        append_value<uint16_t>(header, this->height);
+        append_value<uint32_t>(header, this->stride);
+        header.push_back(static_cast<char>(this->pixel_format));
+        header.push_back(0);
+        header.append(this->image_name, 0, image_name_length);
+        return header;
+    }
+
+    header.push_back(static_cast<char>(static_cast<unsigned char>(this->message_type) | flags));
     
     auto image_name_length = this->image_name.size();
     if (image_name_length > 255) {
@@ -58,7 +163,7 @@ string MessageData::serialize_header() const {
     header.append(reinterpret_cast<char *>(&image_size), sizeof(image_size));
     
     if (image_name_length != 0) {
-        header.append(image_name);
+        header.append(image_name, 0, image_name_length);
     }
     
     // cout << "header: sz:" << header.size() << " type:" << static_cast<int>(header[0]) << endl;
@@ -74,77 +179,316 @@ MessageData::MessageData(MessageType message_type, const string & image_name) {
     this->image_name = image_name;
 }
 
-MessageData::MessageData(MessageType message_type, const string & image_name, const string & image_data) {
+MessageData::MessageData(MessageType message_type, const string & image_name, const FrameBuffer & image_data) {
     this->message_type = message_type;
     this->image_name = image_name;
     this->image_data = image_data;
 }
 
-MessageData::MessageData(MessageType message_type, int name_length, long image_length, string & buffer) {
-    this->message_type = message_type;
-    if (name_length > 0) {
-        this->image_name.append(&buffer[header_size], name_length);
+int MessageData::header_size_for(char first_byte) {
+    return static_cast<unsigned char>(first_byte) == v2_marker ? header_size_v2 : header_size;
+}
+
+MessageData * MessageData::from_header(const char * header, bool allocate_payload) {
+    const unsigned char all_flags = compressed_flag | delta_flag | reference_flag;
+    bool v2 = static_cast<unsigned char>(header[0]) == v2_marker;
+    unsigned char type_byte = static_cast<unsigned char>(header[v2 ? 2 : 0]);
+    unsigned char flags = v2 ? static_cast<unsigned char>(header[3]) : type_byte;
+    MessageType message_type = static_cast<MessageType>(type_byte & ~all_flags);
+    size_t name_length = v2 ? read_value<uint16_t>(header + 4) : static_cast<unsigned char>(header[1]);
+    uint32_t image_length = read_value<uint32_t>(header + (v2 ? 6 : 2));
+
+    auto message_data = new MessageData(message_type);
+    message_data->compressed = (flags & compressed_flag) != 0;
+    message_data->delta = (flags & delta_flag) != 0;
+    message_data->reference = (flags & reference_flag) != 0;
+    if (v2) {
+        message_data->sequence = read_value<uint32_t>(header + 10);
+        message_data->capture_time = SteadyClock::time_point(std::chrono::duration_cast<SteadyClock::duration>(
+            std::chrono::nanoseconds(read_value<int64_t>(header + 14))));
+        message_data->width = read_value<uint16_t>(header + 22);
+        message_data->height = read_value<uint16_t>(header + 24);
+        message_data->stride = read_value<uint32_t>(header + 26);
+        message_data->pixel_format = static_cast<PixelFormat>(header[30]);
     }
-    if (image_length > 0) {
-        this->image_data.append(&buffer[header_size + name_length], image_length);
+    message_data->image_name.resize(name_length);
+    if (allocate_payload) {
+        message_data->image_data = FrameBuffer::allocate(image_length);
     }
+    return message_data;
 }
 
-MessageData * MessageData::deserialize(string & buffer, MessageState message_state) {
-    if (buffer.size() < MessageData::header_size) {
-        return nullptr;
-    }
-    
-    MessageType message_type = static_cast<MessageType>(buffer[0]);
-    int name_length = static_cast<int>(buffer[1]);
-    uint32_t image_length = *(reinterpret_cast<uint32_t *>(&buffer[2]));
-    
-    if (message_state == MessageState::STARTED) {
-        cout << "got buffer mt:" << message_type << " nl:" << name_length << " il:" << image_length << endl;
+void SendCompletion::done_one() {
+    lock_guard<mutex> guard(this->completion_mutex);
+    remaining -= 1;
+    completion_cv.notify_all();
+}
+
+void SendCompletion::wait() {
+    unique_lock<mutex> lock(this->completion_mutex);
+    completion_cv.wait(lock, [&] { return remaining <= 0; });
+}
+
+// capabilities travel as space separated words in a HELLO's image_name
+static bool has_capability(const string & capabilities, const string & capability) {
+    istringstream words(capabilities);
+    string word;
+    while (words >> word) {
+        if (word == capability) {
+            return true;
+        }
     }
-    
-    if (buffer.size() < name_length + image_length + header_size) {
-        return nullptr;
+    return false;
+}
+
+// each connection owns its MessageData; the payload it points at is shared
+static void release_message(MessageData * message_data) {
+    if (message_data->completion) {
+        message_data->completion->done_one();
     }
-    
-    auto message_data = new MessageData(message_type, name_length, image_length, buffer);
-    buffer.erase(0, name_length + image_length + header_size);
-    
-    return message_data;
+    // cout << "comm deleting message data " << message_data->message_type << endl;
+    delete message_data;
+}
+
+Connection::~Connection() {
+    release_pending();
+    delete receiving;
 }
 
 void Connection::stop() {
     keep_going_flag = false;
+}
+
+bool Connection::send(MessageData * message_data) {
+    if (!keep_going_flag) {
+        return false;
+    }
+    message_data->sequence = next_sequence++;
+    if (!overflowing && send_values.push(message_data)) {
+        return true;
+    }
+
+    // once something waits in the overflow, everything after it does too
+    lock_guard<mutex> guard(this->overflow_mutex);
+    send_overflow.push_back(message_data);
+    overflowing = true;
+    control_overflows += 1;
+    if (control_overflows % 100 == 1) {
+        LOG_WARN("send queue full, {} control messages waiting overflows:{}", send_overflow.size(), control_overflows);
+    }
+    return true;
+}
+
+void Connection::send_image(MessageData * image) {
+    image->sequence = next_sequence++;
+    lock_guard<mutex> guard(this->image_mutex);
+    pending_image = image;
+}
+
+MessageData * Connection::withdraw_image() {
+    lock_guard<mutex> guard(this->image_mutex);
+    MessageData * image = pending_image;
+    pending_image = nullptr;
+    return image;
+}
+
+size_t Connection::queue_depth() {
+    size_t depth = send_values.size() + (next_control ? 1 : 0);
+    {
+        lock_guard<mutex> guard(this->overflow_mutex);
+        depth += send_overflow.size();
+    }
+    lock_guard<mutex> guard(this->image_mutex);
+    return depth + (pending_image ? 1 : 0);
+}
+
+bool Connection::pop_control(MessageData *& message_data) {
+    if (send_values.pop(message_data)) {
+        return true;
+    }
+    if (!overflowing) {
+        return false;
+    }
+
+    // the ring is drained; refill it from the overflow, in order
+    lock_guard<mutex> guard(this->overflow_mutex);
+    while (!send_overflow.empty() && send_values.push(send_overflow.front())) {
+        send_overflow.pop_front();
+    }
+    if (send_overflow.empty()) {
+        overflowing = false;
+    }
+    return send_values.pop(message_data);
+}
+
+void Connection::release_pending() {
+    for (MessageData * message_data : sending) {
+        release_message(message_data);
+    }
+    sending.clear();
+
+    MessageData * message_data;
+    while (pop_control(message_data)) {
+        release_message(message_data);
+    }
+    if (next_control) {
+        release_message(next_control);
+        next_control = nullptr;
+    }
+    if (MessageData * image = withdraw_image()) {
+        release_message(image);
+    }
+}
+
+constexpr int ClockOffsetEstimate::window;
+
+void ClockOffsetEstimate::add(int64_t sample_ns) {
+    if (samples == window) {
+        previous_min = current_min;
+        current_min = INT64_MAX;
+        samples = 0;
+    }
+    current_min = min(current_min, sample_ns);
+    samples += 1;
+}
 
-    if (send_thread) {
-        send_thread->join();
-        delete send_thread;
-        send_thread = nullptr;
+bool ClockOffsetEstimate::known() const {
+    return current_min != INT64_MAX || previous_min != INT64_MAX;
+}
+
+int64_t ClockOffsetEstimate::offset_ns() const {
+    return min(current_min, previous_min);
+}
+
+void ClockOffsetEstimate::reset() {
+    current_min = INT64_MAX;
+    previous_min = INT64_MAX;
+    samples = 0;
+}
+
+void Connection::reset() {
+    release_pending();
+    delete receiving;
+    receiving = nullptr;
+    header_received = 0;
+    name_received = 0;
+    data_received = 0;
+    shm.reset();
+    compression = false;
+    delta = false;
+    multicast = false;
+    staged = false;
+    clock_offset.reset();
+    clock = false;
+    clock_sync.reset();
+    ack = false;
+    in_flight.clear();
+    in_flight_bytes = 0;
+    round_trip_ns = 0;
+    window_blocked = false;
+    protocol_version = 1;
+    {
+        lock_guard<mutex> guard(this->delta_mutex);
+        delta_reference = FrameBuffer();
+        delta_reference_index = 0;
+        images_sent = 0;
+        last_frame_id = 0;
+        frames_since_key = 0;
     }
-    if (receive_thread) {
-        receive_thread->join();
-        delete receive_thread;
-        receive_thread = nullptr;
+    {
+        lock_guard<mutex> guard(this->image_mutex);
+        sent_reference = FrameBuffer();
+        sent_reference_index = 0;
+    }
+    images_received = 0;
+    received_frames = make_shared<ReceivedFrames>();
+    want_writable = false;
+    wake_pending = false;
+}
+
+// a shared-memory link is registered twice, its socket and its doorbell
+static void reactor_remove(Connection * connection) {
+    Reactor::instance().remove(connection->sock_fd, connection);
+    if (connection->shm) {
+        Reactor::instance().remove(connection->shm->doorbell_fd(), connection);
     }
 }
 
-void Connection::send(MessageData * message_data) {
-    lock_guard<mutex> guard(this->send_values_mutex);
-    send_values.emplace_back(message_data);
+void Connection::handle_events(uint32_t events) {
+    comm->handle_events(this, events);
+}
+
+void Connection::handle_wake() {
+    wake_pending = false;
+    comm->send_ready(this);
 }
 
 MessageData* Connection::next_send() {
-    lock_guard<mutex> guard(this->send_values_mutex);
-    if (send_values.empty()) {
-        return nullptr;
+    if (next_control == nullptr && !pop_control(next_control)) {
+        next_control = nullptr;
     }
 
-    MessageData* message_data = send_values.front();
-    send_values.pop_front();
+    {
+        lock_guard<mutex> guard(this->image_mutex);
+        if (pending_image && (next_control == nullptr || pending_image->sequence < next_control->sequence)) {
+            if (!window_open(pending_image->image_data.size())) {
+                // waits for an ACK, replaced by any newer frame meanwhile;
+                // the messages queued after it wait too, to stay in order
+                if (!window_blocked) {
+                    window_blocked = true;
+                    window_waits += 1;
+                }
+                return nullptr;
+            }
+            window_blocked = false;
+            // from here on the image can't be replaced; the remote will hold it
+            MessageData * image = pending_image;
+            pending_image = nullptr;
+            sent_reference = std::move(image->raw_frame);
+            sent_reference_index = image->image_index;
+            if (ack) {
+                in_flight.push_back({static_cast<uint32_t>(image->sequence), image->image_data.size(), SteadyClock::now()});
+                in_flight_bytes += static_cast<long long>(image->image_data.size());
+            }
+            return image;
+        }
+    }
 
+    MessageData * message_data = next_control;
+    next_control = nullptr;
     return message_data;
 };
 
+bool Connection::window_open(size_t bytes) {
+    if (!ack || in_flight.empty()) {
+        return true;
+    }
+    if (SteadyClock::now() - in_flight.front().sent > ack_timeout) {
+        LOG_WARN("no ACK for {} frames in {}s, sending again", in_flight.size(), ack_timeout.count());
+        in_flight.clear();
+        in_flight_bytes = 0;
+        return true;
+    }
+    return in_flight_bytes + static_cast<long long>(bytes) <= static_cast<long long>(comm->ack_window.load());
+}
+
+void Connection::next_send_batch(vector<MessageData *> & batch, size_t max_messages, size_t max_payload_bytes) {
+    size_t depth = queue_depth();
+    if (depth > max_queue_depth) {
+        max_queue_depth = depth;
+    }
+
+    size_t payload_bytes = 0;
+    while (batch.size() < max_messages && payload_bytes < max_payload_bytes) {
+        MessageData * message_data = next_send();
+        if (message_data == nullptr) {
+            break;
+        }
+        payload_bytes += message_data->image_data.size();
+        batch.push_back(message_data);
+    }
+}
+
 void *get_in_addr(struct sockaddr *sa)
 {
     if (sa->sa_family == AF_INET) {
@@ -191,28 +535,73 @@ int cross_poll(pollfd* ufds, unsigned int nfds, int timeout) {
 #endif
 }
 
+// gives up on a host that doesn't answer after timeout_ms rather than the
+// kernel's minutes, so a display that is switched off is retried sooner
+static int connect_with_timeout(SOCKET sock_fd, const sockaddr * addr, socklen_t addr_length, int timeout_ms) {
+    if (!set_socket_blocking_enabled(sock_fd, false)) {
+        return -1;
+    }
+
+    int result = ::connect(sock_fd, addr, addr_length);
+    if (result == -1 && errno == EINPROGRESS) {
+        pollfd poll_fd;
+        poll_fd.fd = sock_fd;
+        poll_fd.events = POLLOUT;
+        poll_fd.revents = 0;
+        result = cross_poll(&poll_fd, 1, timeout_ms);
+        if (result == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (result < 0) {
+            return -1;
+        }
+
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            errno = error;
+            return -1;
+        }
+        result = 0;
+    }
+
+    set_socket_blocking_enabled(sock_fd, true);
+    return result;
+}
+
 void Waiter::wait() {
     unique_lock<mutex> lock(this->cv_mtx);
-    this->cv.wait(lock);
+    this->cv.wait(lock, [&] { return this->pending > 0; });
+    this->pending = 0;
 }
 
 cv_status Waiter::wait_for(const Seconds & rel_time) {
     unique_lock<mutex> lock(this->cv_mtx);
-    return this->cv.wait_for(lock, rel_time);
+    if (!this->cv.wait_for(lock, rel_time, [&] { return this->pending > 0; })) {
+        return cv_status::timeout;
+    }
+    this->pending = 0;
+    return cv_status::no_timeout;
 }
 
 void Waiter::notify() {
     unique_lock<mutex> lock(this->cv_mtx);
+    this->pending += 1;
     this->cv.notify_all();
 }
 
 Comm::Comm() {
+    local_connection.comm = this;
+    clock_timer.comm = this;
+    received_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
 #ifdef _WINDOWS
     WSADATA wsa_data;
     // Initialize Winsock
     int result = WSAStartup(MAKEWORD(2, 2), &wsa_data);
     if (result != 0) {
-        cerr << "WSAStartup failed:" << result << endl;
+        LOG_ERROR("WSAStartup failed:{}", result);
     }
 #endif
 }
@@ -222,7 +611,19 @@ Comm::~Comm() {
     WSACleanup();
 #endif
 
+    disconnect();
     close_all();
+
+    if (MulticastReceiver * receiver = multicast_receiver.exchange(nullptr)) {
+        Reactor::instance().remove(receiver->fd(), receiver);
+        delete receiver;
+    }
+
+    MessageData * message_data;
+    while (received_values.pop(message_data)) {
+        delete message_data;
+    }
+    ::close(received_fd);
 }
 
 list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFactory comm_factory) {
@@ -240,7 +641,7 @@ list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFa
     }
     
     if (port_numbers.size() != ip_addresses.size()) {
-        cout << "the count of port_numbers (" << port_numbers.size() << ") does not match the number of ip_addresses (" << ip_addresses.size() << ")" << endl;
+        LOG_ERROR("the count of port_numbers ({}) does not match the number of ip_addresses ({})", port_numbers.size(), ip_addresses.size());
     }
     
     if (port_numbers.size() == 0) {
@@ -260,45 +661,41 @@ list<Comm *> Comm::start_clients(Waiter * waiter, int argc, char* argv[], CommFa
         ip_it++;
     }
     
-    bool all_connected = false;
-    while (!all_connected) {
-        all_connected = true;
-        for (auto & comm : comms) {
-            if (comm->connect_result() == ConnectError::PENDING) {
-                all_connected = false;
-                break;
-            }
-        }
-        if (!all_connected) {
-            this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-    }
-    
+    // the connects run in parallel; one display that is down doesn't keep
+    // the others from starting, it keeps retrying in the background
+    auto deadline = SteadyClock::now() + chrono::duration_cast<SteadyClock::duration>(connect_grace);
+    long connected = 0;
     for (auto comm : comms) {
-        if (comm->connect_result() != ConnectError::SUCCESS) {
-            for (auto del_comm : comms) {
-                delete del_comm;
-            }
-            comms.clear();
-            break;
+        if (comm->wait_connected(deadline)) {
+            connected += 1;
+        }
+        else {
+            LOG_WARN("no answer yet from {}:{}, retrying in the background", comm->ip(), comm->port());
         }
     }
+    Seconds seconds = SteadyClock::now() - process_start;
+    LOG_INFO("connected to {} of {} servers {}s after start", connected, comms.size(), seconds.count());
     
     return comms;
 }
 
 Comm * Comm::start_server(Waiter * waiter, int argc, char* argv[], CommFactory comm_factory) {
     string port_number(Comm::default_port);
+    // only a "shm:name" address means anything to a server
+    string address;
     
     for (int i = 1; i < argc - 1; i++) {
         if (strcmp(argv[i],"-p") == 0) {
             port_number = argv[i+1];
         }
+        else if (strcmp(argv[i],"-i") == 0) {
+            address = argv[i+1];
+        }
     }
     
     Comm * comm = comm_factory ? comm_factory() : new Comm();
     comm->set_waiter(waiter);
-    comm->connect(Comm::Role::SERVER, "", port_number);
+    comm->connect(Comm::Role::SERVER, address, port_number);
     
     while (comm->connect_result() == ConnectError::PENDING) {
         this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -315,21 +712,70 @@ Comm * Comm::start_server(Waiter * waiter, int argc, char* argv[], CommFactory c
 void Comm::set_connect_error(ConnectError a_connect_error) {
     lock_guard<mutex> guard(this->connect_result_mutex);
     this->connect_error = a_connect_error;
+    this->connect_cv.notify_all();
+}
+
+bool Comm::wait_connected(const SteadyClock::time_point & deadline) {
+    unique_lock<mutex> lock(this->connect_result_mutex);
+    return this->connect_cv.wait_until(lock, deadline, [&] { return this->connect_error == ConnectError::SUCCESS; });
 }
 
 void Comm::sendAndReceive(Connection * remote_connection) {
-    local_connection.send_thread = new thread(&Comm::execute_send, this, remote_connection);
-    local_connection.receive_thread = new thread(&Comm::execute_receive, this, remote_connection);
+    remote_connection->comm = this;
+    set_socket_blocking_enabled(remote_connection->sock_fd, false);
+    if (remote_connection->shm) {
+        // nothing more is read from the socket; messages ring the doorbell
+        Reactor::instance().add(remote_connection->sock_fd, EPOLLRDHUP, remote_connection);
+        Reactor::instance().add(remote_connection->shm->doorbell_fd(), EPOLLIN, remote_connection);
+        remote_connection->received_frames->copy_reference = true;
+        remote_connection->max_payload = remote_connection->shm->slot_payload();
+    }
+    else {
+        Reactor::instance().add(remote_connection->sock_fd, EPOLLIN, remote_connection);
+        remote_connection->max_payload = 0;
+    }
+
+    // anything queued before the socket was ready
+    if (!remote_connection->wake_pending.exchange(true)) {
+        Reactor::instance().wake(remote_connection);
+    }
 }
 
 bool Comm::create_socket(const string & ip_address, const string & port, SOCKET & sock_fd) {
+    if (!shm_name.empty()) {
+        if (this->role == Role::SERVER) {
+            sock_fd = ShmChannel::listen_socket(shm_name);
+            return sock_fd >= 0;
+        }
+
+        sock_fd = ShmChannel::connect_socket(shm_name);
+        if (sock_fd >= 0) {
+            // slots for the largest frame, raw
+            size_t frame_bytes = static_cast<size_t>(frame_width.load()) * frame_height.load() *
+                                 (frame_format == MessageData::BGR24 ? 3 : 1);
+            local_connection.shm = ShmChannel::accept(sock_fd, frame_bytes);
+            if (local_connection.shm) {
+                return true;
+            }
+            cross_close(sock_fd);
+            sock_fd = -1;
+        }
+        set_connect_error(FAILED_TO_CONNECT);
+        return false;
+    }
+
     if (this->role == Role::SERVER) {
         sock_fd = socket(AF_INET, SOCK_STREAM, 0);
         if (sock_fd < 0) {
-            cout << "opening socket" << endl;
+            LOG_ERROR("opening socket failed {}", strerror(errno));
             return false;
         }
 
+        // a restarted server can listen again while its clients' old
+        // connections are still in TIME_WAIT, so they reconnect right away
+        int reuse = 1;
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+
         sockaddr_in socket_addr;
         memset(&socket_addr, 0, sizeof(socket_addr));
         socket_addr.sin_family = AF_INET;
@@ -338,11 +784,11 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
 
         if (::bind(sock_fd, (struct sockaddr*) &socket_addr, (int) sizeof(socket_addr)) == -1) {
             cross_close(sock_fd);
-            cerr << "server bind failed (possibly the port is in use) or " << gai_strerror(errno) << endl;
+            LOG_ERROR("server bind failed (possibly the port is in use) or {}", gai_strerror(errno));
             return false;
         }
 
-        cout << "server listening at localhost:" << port << endl;
+        LOG_INFO("server listening at localhost:{}", port);
         return true;
     }
     else {
@@ -354,7 +800,7 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
         int addrinfo_result;
         addrinfo* servinfo;
         if ((addrinfo_result = getaddrinfo(ip_address.c_str(), port.c_str(), &hints, &servinfo)) != 0) {
-            cerr << "getaddrinfo: " << gai_strerror(addrinfo_result) << endl;
+            LOG_ERROR("getaddrinfo: {}", gai_strerror(addrinfo_result));
             set_connect_error(ADDR_INFO_ERROR);
             return false;
         }
@@ -362,16 +808,16 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
         // loop through all the results and bind (server) or connect (client) to the first we can
         addrinfo* p;
         for (p = servinfo; p != nullptr; p = p->ai_next) {
-            cout << "family:" << p->ai_family << " type:" << p->ai_socktype << " protocol:" << p->ai_protocol << " addr:" << p->ai_addr << endl;
+            LOG_DEBUG("family:{} type:{} protocol:{} addr:{}", p->ai_family, p->ai_socktype, p->ai_protocol, p->ai_addr);
             if ((sock_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-                cout << "unable to create socket, try another candidate" << endl;
+                LOG_DEBUG("unable to create socket, try another candidate");
                 continue;
             }
 
-            int connectResult = ::connect(sock_fd, p->ai_addr, (int) p->ai_addrlen);
+            int connectResult = connect_with_timeout(sock_fd, p->ai_addr, p->ai_addrlen, connect_timeout_ms);
             if (connectResult == -1) {
                 cross_close(sock_fd);
-                cerr << "connection attempt failed " << gai_strerror(errno) << endl;
+                LOG_WARN("connection attempt failed {}", strerror(errno));
                 continue;
             }
 
@@ -381,11 +827,11 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
         if (p == nullptr) {
             freeaddrinfo(servinfo); // all done with this structure
             if (role == Role::CLIENT) {
-                cerr << "client: failed to connect" << endl;
+                LOG_WARN("client: failed to connect");
                 set_connect_error(FAILED_TO_CONNECT);
             }
             else {
-                cerr << "server: failed to bind" << endl;
+                LOG_ERROR("server: failed to bind");
                 set_connect_error(FAILED_TO_BIND);
             }
             return false;
@@ -393,7 +839,7 @@ bool Comm::create_socket(const string & ip_address, const string & port, SOCKET
 
         char info_buffer[INET6_ADDRSTRLEN];
         inet_ntop(p->ai_family, get_in_addr((struct sockaddr*)p->ai_addr), info_buffer, sizeof info_buffer);
-        cout << "client: connecting to " << info_buffer << endl;
+        LOG_INFO("client: connecting to {}", info_buffer);
 
         freeaddrinfo(servinfo); // all done with this structure
         return true;
@@ -416,6 +862,44 @@ const string & Comm::port() const {
     return this->ip_port;
 }
 
+CommStats Comm::stats() {
+    CommStats stats;
+    stats.bytes_in = total_bytes_in.load(memory_order_relaxed);
+    stats.bytes_out = total_bytes_out.load(memory_order_relaxed);
+    stats.messages_in = total_messages_in.load(memory_order_relaxed);
+    stats.messages_out = total_messages_out.load(memory_order_relaxed);
+    stats.received_queue = static_cast<long>(received_values.size());
+    stats.received_drops = received_drops.load(memory_order_relaxed);
+    stats.sends_dropped = sends_dropped.load(memory_order_relaxed);
+
+    auto add_connection = [&](Connection * connection) {
+        stats.connections += 1;
+        stats.send_queue += static_cast<long>(connection->queue_depth());
+        stats.images_superseded += connection->images_superseded.load(memory_order_relaxed);
+        stats.in_flight_bytes += connection->in_flight_bytes.load(memory_order_relaxed);
+        stats.round_trip = max(stats.round_trip, connection->round_trip_ns.load(memory_order_relaxed) / 1e9);
+        stats.window_waits += connection->window_waits.load(memory_order_relaxed);
+    };
+    if (is_server()) {
+        lock_guard<mutex> guard(this->remote_connections_mutex);
+        for (Connection * connection : remote_connections) {
+            add_connection(connection);
+        }
+    }
+    else if (local_connection.keep_going_flag) {
+        add_connection(&local_connection);
+    }
+    return stats;
+}
+
+const LatencyHistogram & Comm::display_now_histogram() const {
+    return display_now_intervals;
+}
+
+const LatencyHistogram & Comm::round_trip_histogram() const {
+    return ack_round_trips;
+}
+
 bool Comm::allow_new_connection(const sockaddr_storage& sin_addr, socklen_t sin_size) {
     // only allow one connection at a time
     lock_guard<mutex> guard(this->remote_connections_mutex);
@@ -434,6 +918,8 @@ Comm::RemoteConnectionResult Comm::init_remote_connection(Connection* remote_con
 
     remote_connection->local = false;
     remote_connection->sock_fd = candidate_fd;
+    connected_at = SteadyClock::now();
+    frame_since_connect = false;
     add_connection(remote_connection);
     set_connect_error(ConnectError::SUCCESS);
     sendAndReceive(remote_connection);
@@ -446,280 +932,735 @@ void Comm::execute_connect(Role role, const string & ip_address, const string &
 
     this->role = role;
 
+    if (!is_server()) {
+        maintain_link(ip_address, port);
+        LOG_INFO("exited connect thread");
+        return;
+    }
+
     if (!create_socket(ip_address, port, local_connection.sock_fd)) {
         set_connect_error(CREATE_SOCKET_FAILURE);
         local_connection.keep_going_flag = false;
         return;
     }
 
-    if (is_server()) {
-        bool blocking_result = set_socket_blocking_enabled(local_connection.sock_fd, false);
-        if (!blocking_result) {
-            set_connect_error(BLOCKING_FAILURE);
-            local_connection.keep_going_flag = false;
-            return;
-        }
+    bool blocking_result = set_socket_blocking_enabled(local_connection.sock_fd, false);
+    if (!blocking_result) {
+        set_connect_error(BLOCKING_FAILURE);
+        local_connection.keep_going_flag = false;
+        return;
     }
 
     if (local_connection.keep_going_flag) {
-        if (is_server()) {
-            int backlog = 2;  // how many pending connections queue will hold
-            // listen seems to be non-blocking
-            if (listen(local_connection.sock_fd, backlog) == -1) {
-                cout << "listen failure" << endl;
-                set_connect_error(LISTEN_FAILURE);
-                local_connection.keep_going_flag = false;
-                return;
-            }
-
-            // at this point there's nothing connected yet
-            
-            while (local_connection.keep_going_flag) {
-                struct sockaddr_storage client_addr; // connector's address information
-                socklen_t sin_size = sizeof client_addr;
-                SOCKET candidate_fd = accept(local_connection.sock_fd, (struct sockaddr*)&client_addr, &sin_size);
-                if (candidate_fd == -1) {
-                    // cerr << "server accept failed or no connection attempt" << endl;
-                    this_thread::sleep_for(std::chrono::microseconds(100));
-                    continue;
-                }
-
-                char client_info_buffer[INET6_ADDRSTRLEN];
-                inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr*)&client_addr), client_info_buffer, sizeof client_info_buffer);
-                cout << "server: got new connection from " << client_info_buffer << endl;
-
-                if (!allow_new_connection(client_addr, sin_size)) {
-                    cout << "Only one connection allowed at a time; closing new connection." << endl;
-                    cross_close(candidate_fd);
-                    continue;
-                }
+        int backlog = 2;  // how many pending connections queue will hold
+        // listen seems to be non-blocking
+        if (listen(local_connection.sock_fd, backlog) == -1) {
+            LOG_ERROR("listen failure");
+            set_connect_error(LISTEN_FAILURE);
+            local_connection.keep_going_flag = false;
+            return;
+        }
 
-                Connection * remote_connection = new Connection;
-                RemoteConnectionResult result = init_remote_connection(remote_connection, candidate_fd);
-                switch (result) {
-                case FAIL:
-                    delete remote_connection;
-                    return;
-                case CONTINUE:
-                    delete remote_connection;
-                    continue;
-                case OK:
-                    got_new_connection(client_addr, sin_size);
-                    break;
-                }   
-            }
+        // at this point there's nothing connected yet; the reactor
+        // accepts connections as they arrive
+        local_connection.comm = this;
+        Reactor::instance().add(local_connection.sock_fd, EPOLLIN, &local_connection);
+
+        // and pings the clients that answer clock pings
+        clock_timer.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (clock_timer.timer_fd >= 0) {
+            auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_ping_acquire_interval).count();
+            itimerspec timer = {};
+            timer.it_interval.tv_sec = interval / 1000000000;
+            timer.it_interval.tv_nsec = interval % 1000000000;
+            timer.it_value = timer.it_interval;
+            timerfd_settime(clock_timer.timer_fd, 0, &timer, nullptr);
+            Reactor::instance().add(clock_timer.timer_fd, EPOLLIN, &clock_timer);
         }
         else {
-            sendAndReceive(&local_connection);
-            set_connect_error(ConnectError::SUCCESS);
+            LOG_WARN("server: no clock timer {}, clients' clocks won't be measured", strerror(errno));
         }
     }
 
-    cout << "exited connect thread" << endl;
+    LOG_INFO("exited connect thread");
 }
 
-ConnectError Comm::send_one(Connection * connection, MessageData * message_data) {
-    pollfd ufds[1];
-    ufds[0].fd = connection->sock_fd;
-    ufds[0].events = POLLOUT;
-    
-    int poll_result = cross_poll(ufds, 1, 500);
-    if (poll_result == -1) {
-        set_connect_error(SEND_POLL_ERROR);
-        connection->keep_going_flag = false;
-        cerr << "send poll error" << endl;
-        return SEND_POLL_ERROR;
-    }
-
-    if (poll_result == 0) {
-        // possibly means socket is already busy sending?
-        return SEND_TIMEOUT;
-    }
-   
-    const string header = message_data->serialize_header();
-    auto header_size = header.size();
-    auto image_size = message_data->image_data.size();
-    long sent = 0;
-    switch (role) {
-        case Role::SERVER:
-        case Role::CLIENT:
-            auto begin = SteadyClock::now();
-            sent = ::send(connection->sock_fd, header.data(), header_size, 0);
-            if (message_data->image_data.size() > 0) {
-                sent += ::send(connection->sock_fd, message_data->image_data.data(), image_size, 0);
+void Comm::maintain_link(const string & ip_address, const string & port) {
+    minstd_rand jitter_random(static_cast<unsigned>(SteadyClock::now().time_since_epoch().count()));
+    uniform_real_distribution<double> jitter(1.0 - reconnect_jitter, 1.0 + reconnect_jitter);
+    Seconds backoff = reconnect_min_backoff;
+
+    while (!stopping) {
+        connect_attempts += 1;
+        SOCKET sock_fd = -1;
+        // clears the shm channel of the last link before create_socket maps a new one
+        local_connection.reset();
+        if (create_socket(ip_address, port, sock_fd)) {
+            Seconds since_start = SteadyClock::now() - process_start;
+            LOG_INFO("{} to {}:{} {}s after start, attempt {} dropped while down:{}",
+                     reconnects > 0 ? "reconnected" : "connected", ip_address, port, since_start.count(),
+                     connect_attempts, sends_dropped.load());
+            connected_at = SteadyClock::now();
+            frame_since_connect = false;
+            resend_latest = true;
+            {
+                lock_guard<mutex> guard(this->connect_result_mutex);
+                latest_wanted = false;
+                resend_wanted = 0;
             }
-            Seconds seconds = (SteadyClock::now() - begin);
-            cout << "sent h:" << header_size << " ty:" << static_cast<int>(header[0]) << " i:" << image_size << " t:" << seconds.count() << "s" << endl;
-            break;
-    }
-    if (--message_data->use_count <= 0) {
-        // cout << "comm deleting message data " << message_data->message_type << endl;
-        if (message_data->auto_delete) {
-            delete message_data;
+            local_connection.sock_fd = sock_fd;
+            local_connection.keep_going_flag = true;
+            sendAndReceive(&local_connection);
+            set_connect_error(ConnectError::SUCCESS);
+            send_hello();
+            backoff = reconnect_min_backoff;
+
+            {
+                // connection_lost() or disconnect() ends the link; meanwhile
+                // this thread sends what the reactor asks to be sent again
+                unique_lock<mutex> lock(this->connect_result_mutex);
+                while (true) {
+                    this->connect_cv.wait(lock, [&] {
+                        return stopping || this->connect_error != ConnectError::SUCCESS || latest_wanted || resend_wanted != 0;
+                    });
+                    if (stopping || this->connect_error != ConnectError::SUCCESS) {
+                        break;
+                    }
+                    bool latest = latest_wanted;
+                    uint32_t frame_id = resend_wanted;
+                    string name = resend_wanted_name;
+                    latest_wanted = false;
+                    resend_wanted = 0;
+                    lock.unlock();
+                    send_again(&local_connection, latest, frame_id, name);
+                    lock.lock();
+                }
+            }
+            // waits for a callback in progress, so the reactor is done with the connection
+            reactor_remove(&local_connection);
+            local_connection.stop();
+            cross_close(local_connection.sock_fd);
+            local_connection.sock_fd = -1;
+            local_connection.release_pending();
+            if (stopping) {
+                break;
+            }
+            reconnects += 1;
+            connect_attempts = 0;
+            LOG_WARN("lost {}:{}, reconnecting", ip_address, port);
         }
-    }
 
-    if (sent != header_size + image_size) {
-        set_connect_error(SEND_COUNT_FAILURE);
-        connection->keep_going_flag = false;
-        cerr << "send count failure sent:" << sent << " hs:" << header_size << " is:" << image_size << endl;
-        return SEND_COUNT_FAILURE;
+        Seconds delay = backoff * jitter(jitter_random);
+        backoff = min(backoff * 2, reconnect_max_backoff);
+        unique_lock<mutex> lock(this->connect_result_mutex);
+        this->connect_cv.wait_for(lock, delay, [&] { return stopping.load(); });
     }
-    
-    return ConnectError::SUCCESS;
 }
 
-void Comm::execute_send(Connection * remote_connection) {
-    while (true) {
-        while (MessageData * message_data = remote_connection->next_send()) {
-            ConnectError result = send_one(remote_connection, message_data);
-            if (result == ConnectError::SUCCESS) {
-                continue;
-            }
-            
-            long counter = 0;
-            while (result == SEND_TIMEOUT && counter < 100) {
-                result = send_one(remote_connection, message_data);
-                counter += 1;
-                this_thread::sleep_for(std::chrono::microseconds(10));
-            }
-            
-            if (result == ConnectError::SUCCESS) {
-                continue;
-            }
-            
-            break;
-        }
+void Comm::report_first_frame(const char * direction) {
+    if (frame_since_connect.exchange(true)) {
+        return;
+    }
+    auto now = SteadyClock::now();
+    Seconds since_start = now - process_start;
+    Seconds since_connect = now - connected_at;
+    LOG_INFO("first frame {} {}:{} {}s after start, {}s after connecting",
+             direction, ip_address, ip_port, since_start.count(), since_connect.count());
+}
 
-        if (!remote_connection->keep_going_flag) {
-            break;
-        }
+void Comm::handle_events(Connection * connection, uint32_t events) {
+    if (is_server() && connection == &local_connection) {
+        accept_connections();
+        return;
+    }
 
-        this_thread::sleep_for(std::chrono::microseconds(10));
+    if (connection->shm) {
+        shm_ready(connection, events);
+        return;
     }
 
-    cout << "exited send thread" << endl;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        receive_ready(connection);
+    }
+    if ((events & EPOLLOUT) && connection->keep_going_flag) {
+        send_ready(connection);
+    }
 }
 
-void Comm::execute_receive(Connection * remote_connection) {
-    pollfd ufds[1];
-    ufds[0].fd = remote_connection->sock_fd;
-    ufds[0].events = POLLIN;
-    char buffer[512];
-    long counter = 0;
-    
-    SD sd;
-
-    while (true) {
-        int poll_result = cross_poll(ufds, 1, 500);
-        if (poll_result == -1) {
-            set_connect_error(RECEIVE_POLL_ERROR);
-            remote_connection->keep_going_flag = false;
-            cerr << "receive poll error" << endl;
-            break;
+void Comm::accept_connections() {
+    while (local_connection.keep_going_flag) {
+        struct sockaddr_storage client_addr; // connector's address information
+        socklen_t sin_size = sizeof client_addr;
+        // a shared-memory client's request is read as it arrives, never waited for
+        SOCKET candidate_fd = accept4(local_connection.sock_fd, (struct sockaddr*)&client_addr, &sin_size,
+                                      shm_name.empty() ? 0 : SOCK_NONBLOCK);
+        if (candidate_fd == -1) {
+            // no more pending connection attempts
+            return;
         }
 
-        if (poll_result == 0) {
-            counter += 1;
-            // cout << "receive timeout " << counter << endl;
+        if (!shm_name.empty()) {
+            LOG_INFO("server: got new connection on shm:{}", shm_name);
         }
         else {
-            if (ufds[0].events & POLLIN) {
-                counter = 0;
-                long received_count = 0;
-                switch (this->role) {
-                    case Role::SERVER:
-                    case Role::CLIENT:
-                        received_count = recv(remote_connection->sock_fd, buffer, sizeof(buffer), 0);
-                        break;
-                }
-                if (received_count <= 0) {
-                    cerr << "remote disconnected while looking for incoming" << endl;
-                    set_connect_error(SERVER_DISCONNECTED);
-                    if (is_server()) {
-                        cross_close(remote_connection->sock_fd);
-                        lock_guard<mutex> guard(this->remote_connections_mutex);
-                        this->remote_connections.remove(remote_connection);
-                        this->deleted_remote_connections.emplace_back(remote_connection);
-                    }
-  
-                    remote_connection->keep_going_flag = false;
-                    break;
-                }
-
-                remote_connection->received_so_far.append(buffer, received_count);
-                if (message_state == MessageState::WAITING) {
-                    message_state = MessageState::WAITING_FOR_HEADER;
-                    receive_begin = SteadyClock::now();
-                }
-                
-                if (remote_connection->received_so_far.size() >= MessageData::header_size) {
-                    switch (message_state) {
-                        case MessageState::WAITING:
-                        case MessageState::WAITING_FOR_HEADER:
-                            message_state = MessageState::STARTED;
-                            // cout << "started" << endl;
-                            break;
-                        case MessageState::STARTED:
-                            message_state = MessageState::ONGOING;
-                            // cout << "ongoing" << endl;
-                            break;
-                        case MessageState::ONGOING:
-                            break;
-                    }
-                }
+            char client_info_buffer[INET6_ADDRSTRLEN];
+            inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr*)&client_addr), client_info_buffer, sizeof client_info_buffer);
+            LOG_INFO("server: got new connection from {}", client_info_buffer);
+        }
 
-                // cout << "so far:" << received_so_far << endl;
-                while (MessageData * message_data = MessageData::deserialize(remote_connection->received_so_far, message_state)) {
-
-                    Seconds seconds = SteadyClock::now() - this->receive_begin;
-                    cout << "receive i:" << message_data->image_data.size() << " t:" << seconds.count() << "s" << endl;
-                    
-                    if (message_data->message_type == MessageData::MessageType::DISPLAY_NOW) {
-                        sd.increment(SteadyClock::now());
-                        if (sd.count % 30 == 0) {
-                            std::ofstream out("server_dn_counter.txt");
-                            sd.dump(out, "DISPLAY_NOW");
-                        }
-                    }
-                    message_state = MessageState::WAITING;
-                    {
-                        // lock within tight scope
-                        lock_guard<mutex> guard(this->received_values_mutex);
-                        received_values.emplace_back(message_data);
-                    }
-                    
-                    if (waiter) {
-                        waiter->notify();
-                    }
-                }
-            }
+        if (!allow_new_connection(client_addr, sin_size)) {
+            LOG_WARN("Only one connection allowed at a time; closing new connection.");
+            cross_close(candidate_fd);
+            continue;
         }
 
-        if (!remote_connection->keep_going_flag) {
-            break;
+        if (!shm_name.empty()) {
+            start_shm_handshake(candidate_fd, client_addr, sin_size);
+            continue;
+        }
+        if (!accept_remote_connection(new Connection, candidate_fd, client_addr, sin_size)) {
+            return;
         }
     }
-
-    cout << "exited receive thread" << endl;
 }
 
-bool Comm::connect(Role pending_role, const string & ip_address, const string & port) {
-    if (connect_thread != nullptr) {
+bool Comm::accept_remote_connection(Connection * remote_connection, SOCKET candidate_fd,
+                                    const sockaddr_storage & client_addr, socklen_t sin_size) {
+    RemoteConnectionResult result = init_remote_connection(remote_connection, candidate_fd);
+    switch (result) {
+    case FAIL:
+        delete remote_connection;
+        Reactor::instance().remove(local_connection.sock_fd, &local_connection);
         return false;
+    case CONTINUE:
+        delete remote_connection;
+        break;
+    case OK:
+        got_new_connection(client_addr, sin_size);
+        break;
     }
+    return true;
+}
 
-    this->ip_address = (pending_role == Role::CLIENT ? ip_address : "localhost");
-    this->ip_port = port;
+void Comm::start_shm_handshake(SOCKET candidate_fd, const sockaddr_storage & client_addr, socklen_t sin_size) {
+    auto handshake = new ShmHandshake;
+    handshake->comm = this;
+    handshake->sock_fd = candidate_fd;
+    handshake->client_addr = client_addr;
+    handshake->sin_size = sin_size;
+    handshake->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(shm_request_timeout).count();
+    itimerspec timer = {};
+    timer.it_value.tv_sec = timeout / 1000000000;
+    timer.it_value.tv_nsec = timeout % 1000000000;
+    if (handshake->timer_fd < 0 || timerfd_settime(handshake->timer_fd, 0, &timer, nullptr) < 0) {
+        LOG_ERROR("shm: no handshake timer {}", strerror(errno));
+        if (handshake->timer_fd >= 0) {
+            ::close(handshake->timer_fd);
+        }
+        cross_close(candidate_fd);
+        delete handshake;
+        return;
+    }
 
-    cout << "attempting to connect to " << this->ip_address << ":" << port << " as " << (pending_role == Role::CLIENT ? "client" : "server") << endl;
+    {
+        lock_guard<mutex> guard(this->shm_handshakes_mutex);
+        shm_handshakes.push_back(handshake);
+    }
+    Reactor::instance().add(handshake->sock_fd, EPOLLIN | EPOLLRDHUP, handshake);
+    Reactor::instance().add(handshake->timer_fd, EPOLLIN, handshake);
+}
 
-    // this->role isn't set until the execute_connect thread runs
-    connect_thread = new thread(&Comm::execute_connect, this, pending_role, this->ip_address, this->ip_port);
-    return true;
+void ShmHandshake::handle_events(uint32_t events) {
+    comm->shm_handshake_ready(this);
 }
 
-ConnectError Comm::connect_result() {
+void Comm::shm_handshake_ready(ShmHandshake * handshake) {
+    int result = handshake->request.read(handshake->sock_fd);
+    uint64_t expirations;
+    if (result == 0 && ::read(handshake->timer_fd, &expirations, sizeof(expirations)) > 0) {
+        LOG_WARN("shm: client didn't ask for a slot size in {}s, dropped", shm_request_timeout.count());
+        result = -1;
+    }
+    if (result == 0) {
+        return;
+    }
+
+    {
+        // disconnect() may have taken it already, and closes it once this returns
+        lock_guard<mutex> guard(this->shm_handshakes_mutex);
+        auto found = std::find(shm_handshakes.begin(), shm_handshakes.end(), handshake);
+        if (found == shm_handshakes.end()) {
+            return;
+        }
+        shm_handshakes.erase(found);
+    }
+    Reactor::instance().remove(handshake->sock_fd, handshake);
+    Reactor::instance().remove(handshake->timer_fd, handshake);
+    ::close(handshake->timer_fd);
+    SOCKET candidate_fd = handshake->sock_fd;
+    size_t payload = handshake->request.payload();
+    sockaddr_storage client_addr = handshake->client_addr;
+    socklen_t sin_size = handshake->sin_size;
+    delete handshake;
+
+    if (result < 0 || !local_connection.keep_going_flag) {
+        cross_close(candidate_fd);
+        return;
+    }
+    if (!allow_new_connection(client_addr, sin_size)) {
+        LOG_WARN("Only one connection allowed at a time; closing new connection.");
+        cross_close(candidate_fd);
+        return;
+    }
+
+    Connection * remote_connection = new Connection;
+    remote_connection->shm = ShmChannel::offer(candidate_fd, payload);
+    if (!remote_connection->shm) {
+        cross_close(candidate_fd);
+        delete remote_connection;
+        return;
+    }
+    accept_remote_connection(remote_connection, candidate_fd, client_addr, sin_size);
+}
+
+void Comm::close_shm_handshakes() {
+    list<ShmHandshake *> handshakes;
+    {
+        lock_guard<mutex> guard(this->shm_handshakes_mutex);
+        handshakes.swap(shm_handshakes);
+    }
+    for (ShmHandshake * handshake : handshakes) {
+        // waits for a callback in progress
+        Reactor::instance().remove(handshake->sock_fd, handshake);
+        Reactor::instance().remove(handshake->timer_fd, handshake);
+        ::close(handshake->timer_fd);
+        cross_close(handshake->sock_fd);
+        delete handshake;
+    }
+}
+
+void Comm::connection_lost(Connection * remote_connection) {
+    reactor_remove(remote_connection);
+    remote_connection->stop();
+    remote_connection->release_pending();
+    set_connect_error(SERVER_DISCONNECTED);
+
+    if (is_server()) {
+        cross_close(remote_connection->sock_fd);
+        remote_connection->sock_fd = -1;
+        lock_guard<mutex> guard(this->remote_connections_mutex);
+        this->remote_connections.remove(remote_connection);
+        this->deleted_remote_connections.emplace_back(remote_connection);
+    }
+}
+
+void Comm::release_sent(MessageData * message_data) {
+    release_message(message_data);
+}
+
+bool Comm::start_batch(Connection * connection) {
+    connection->sending.clear();
+    connection->next_send_batch(connection->sending, max_batch_messages, max_batch_payload);
+    if (connection->sending.empty()) {
+        return false;
+    }
+
+    size_t count = connection->sending.size();
+    connection->sending_headers.resize(count);
+    connection->sending_iov.clear();
+    connection->sending_iov_index = 0;
+    connection->sending_bytes = 0;
+    connection->send_syscalls_in_batch = 0;
+    for (size_t i = 0; i < count; i++) {
+        MessageData * message_data = connection->sending[i];
+        string & header = connection->sending_headers[i];
+        header = message_data->serialize_header(connection->protocol_version);
+        connection->sending_iov.push_back({&header[0], header.size()});
+        if (!message_data->image_data.empty()) {
+            connection->sending_iov.push_back({const_cast<char *>(message_data->image_data.data()), message_data->image_data.size()});
+        }
+    }
+    connection->batch_begin = SteadyClock::now();
+    return true;
+}
+
+ConnectError Comm::write_batch(Connection * connection) {
+    vector<iovec> & iov = connection->sending_iov;
+    while (connection->sending_iov_index < iov.size()) {
+        size_t & iov_index = connection->sending_iov_index;
+        msghdr message_header;
+        memset(&message_header, 0, sizeof(message_header));
+        message_header.msg_iov = &iov[iov_index];
+        message_header.msg_iovlen = min(iov.size() - iov_index, static_cast<size_t>(IOV_MAX));
+
+        ssize_t written = ::sendmsg(connection->sock_fd, &message_header, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the socket buffer is full (slow link); resume when writable
+                return SEND_TIMEOUT;
+            }
+            LOG_ERROR("send failure sent:{} {}", connection->sending_bytes, strerror(errno));
+            return SEND_COUNT_FAILURE;
+        }
+        connection->send_syscalls += 1;
+        connection->send_syscalls_in_batch += 1;
+        connection->sending_bytes += written;
+        connection->bytes_sent += written;
+        total_bytes_out.fetch_add(written, memory_order_relaxed);
+
+        // skip the fully written buffers and trim the partially written one
+        size_t remaining = static_cast<size_t>(written);
+        while (iov_index < iov.size() && remaining >= iov[iov_index].iov_len) {
+            remaining -= iov[iov_index].iov_len;
+            iov_index += 1;
+        }
+        if (remaining > 0) {
+            iov[iov_index].iov_base = static_cast<char *>(iov[iov_index].iov_base) + remaining;
+            iov[iov_index].iov_len -= remaining;
+        }
+    }
+
+    return ConnectError::SUCCESS;
+}
+
+void Comm::finish_batch(Connection * connection) {
+    size_t count = connection->sending.size();
+    connection->messages_sent += count;
+    total_messages_out.fetch_add(count, memory_order_relaxed);
+    Seconds seconds = (SteadyClock::now() - connection->batch_begin);
+    long syscalls = max(connection->send_syscalls_in_batch, 1L);
+    LOG_DEBUG("sent m:{} ty:{} b:{} calls:{} b/call:{} avg b/call:{} q:{} max q:{} superseded:{} t:{}s",
+              count, connection->sending[0]->message_type, connection->sending_bytes,
+              syscalls, connection->sending_bytes / syscalls, connection->bytes_sent / max(connection->send_syscalls, 1L),
+              connection->queue_depth(), connection->max_queue_depth, connection->images_superseded.load(), seconds.count());
+
+    for (MessageData * message_data : connection->sending) {
+        if (message_data->message_type == MessageData::MessageType::IMAGE) {
+            report_first_frame("sent to");
+        }
+        release_sent(message_data);
+    }
+    connection->sending.clear();
+}
+
+void Comm::send_ready(Connection * connection) {
+    if (!connection->keep_going_flag || connection->sock_fd < 0) {
+        return;
+    }
+
+    if (connection->shm) {
+        shm_send_ready(connection);
+        return;
+    }
+
+    while (true) {
+        if (connection->sending.empty() && !start_batch(connection)) {
+            break;
+        }
+
+        ConnectError result = write_batch(connection);
+        if (result == ConnectError::SUCCESS) {
+            finish_batch(connection);
+            continue;
+        }
+        if (result == SEND_TIMEOUT) {
+            if (!connection->want_writable) {
+                connection->want_writable = true;
+                Reactor::instance().modify(connection->sock_fd, EPOLLIN | EPOLLOUT, connection);
+            }
+            return;
+        }
+
+        connection_lost(connection);
+        return;
+    }
+
+    if (connection->want_writable) {
+        connection->want_writable = false;
+        Reactor::instance().modify(connection->sock_fd, EPOLLIN, connection);
+    }
+}
+
+long Comm::receive_some(Connection * remote_connection, MessageData *& completed) {
+    completed = nullptr;
+
+    // pick where the next bytes belong: the header, then the name and
+    // payload of the message it announced, each sized once from the header
+    char * destination;
+    size_t remaining;
+    MessageData * receiving = remote_connection->receiving;
+    // a v1 header is read first; its first byte tells whether it is v2 and longer
+    size_t header_length = remote_connection->header_received == 0 ? MessageData::header_size :
+                           MessageData::header_size_for(remote_connection->header_buffer[0]);
+    if (receiving == nullptr) {
+        destination = remote_connection->header_buffer + remote_connection->header_received;
+        remaining = header_length - remote_connection->header_received;
+    }
+    else if (remote_connection->name_received < receiving->image_name.size()) {
+        destination = &receiving->image_name[remote_connection->name_received];
+        remaining = receiving->image_name.size() - remote_connection->name_received;
+    }
+    else {
+        destination = receiving->image_data.writable_data() + remote_connection->data_received;
+        remaining = receiving->image_data.size() - remote_connection->data_received;
+    }
+
+    long received_count = 0;
+    switch (this->role) {
+        case Role::SERVER:
+        case Role::CLIENT:
+            received_count = recv(remote_connection->sock_fd, destination, remaining, MSG_DONTWAIT);
+            break;
+    }
+    if (received_count <= 0) {
+        return received_count;
+    }
+    total_bytes_in.fetch_add(received_count, memory_order_relaxed);
+
+    if (receiving == nullptr) {
+        if (message_state == MessageState::WAITING) {
+            message_state = MessageState::WAITING_FOR_HEADER;
+            receive_begin = SteadyClock::now();
+        }
+        remote_connection->header_received += received_count;
+        header_length = MessageData::header_size_for(remote_connection->header_buffer[0]);
+        if (remote_connection->header_received < header_length) {
+            return received_count;
+        }
+
+        receiving = MessageData::from_header(remote_connection->header_buffer);
+        remote_connection->receiving = receiving;
+        remote_connection->header_received = 0;
+        remote_connection->name_received = 0;
+        remote_connection->data_received = 0;
+        message_state = MessageState::STARTED;
+        LOG_DEBUG("got buffer mt:{} nl:{} il:{}", receiving->message_type, receiving->image_name.size(), receiving->image_data.size());
+    }
+    else if (remote_connection->name_received < receiving->image_name.size()) {
+        remote_connection->name_received += received_count;
+    }
+    else {
+        remote_connection->data_received += received_count;
+        message_state = MessageState::ONGOING;
+    }
+
+    if (remote_connection->name_received == receiving->image_name.size() &&
+        remote_connection->data_received == receiving->image_data.size()) {
+        completed = receiving;
+        remote_connection->receiving = nullptr;
+        message_state = MessageState::WAITING;
+    }
+
+    return received_count;
+}
+
+void Comm::receive_ready(Connection * remote_connection) {
+    // drain everything the socket has before waiting again
+    while (remote_connection->keep_going_flag) {
+        MessageData * message_data = nullptr;
+        long received_count = receive_some(remote_connection, message_data);
+        if (received_count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        if (received_count <= 0) {
+            LOG_WARN("remote disconnected while looking for incoming");
+            connection_lost(remote_connection);
+            break;
+        }
+        if (message_data == nullptr) {
+            continue;
+        }
+
+        Seconds seconds = SteadyClock::now() - this->receive_begin;
+        LOG_DEBUG("receive i:{} t:{}s", message_data->image_data.size(), seconds.count());
+        message_received(remote_connection, message_data);
+    }
+}
+
+void Comm::message_received(Connection * remote_connection, MessageData * message_data) {
+    total_messages_in.fetch_add(1, memory_order_relaxed);
+    if (message_data->message_type == MessageData::MessageType::HELLO) {
+        handle_hello(remote_connection, message_data);
+        return;
+    }
+
+    if (message_data->message_type == MessageData::MessageType::RESEND) {
+        handle_resend(remote_connection, message_data);
+        return;
+    }
+
+    if (message_data->message_type == MessageData::MessageType::CLOCK_PING ||
+        message_data->message_type == MessageData::MessageType::CLOCK_PONG) {
+        handle_clock(remote_connection, message_data);
+        return;
+    }
+
+    if (message_data->message_type == MessageData::MessageType::ACK && remote_connection->ack &&
+        message_data->image_data.size() == sizeof(uint32_t)) {
+        handle_image_ack(remote_connection, message_data);
+        return;
+    }
+
+    // an IMAGE is acknowledged once it's queued for the application, so a
+    // frame dropped here (an unresolved reference, a full queue) never is
+    bool ack_image = false;
+    uint64_t image_sequence = message_data->sequence;
+    if (message_data->message_type == MessageData::MessageType::IMAGE) {
+        report_first_frame("received on");
+        message_data->staged = remote_connection->staged;
+        message_data->image_index = remote_connection->images_received++;
+        // only a link that sends deltas needs the last frame kept
+        if (remote_connection->delta) {
+            message_data->received_frames = remote_connection->received_frames;
+        }
+        if (message_data->reference && !resolve_reference(remote_connection, message_data)) {
+            delete message_data;
+            return;
+        }
+        ack_image = remote_connection->ack;
+    }
+
+    if (message_data->message_type == MessageData::MessageType::DISPLAY_NOW) {
+        // published with the other stats (see display_now_histogram)
+        auto now = SteadyClock::now();
+        display_now_intervals.record_interval(now);
+        if (message_data->capture_time != SteadyClock::time_point()) {
+            remote_connection->clock_offset.add((now - message_data->capture_time).count());
+        }
+        // the sender's time to present at, moved onto this clock: by the
+        // measured clock if there is one, else the estimate from the headers
+        if (message_data->image_data.size() == sizeof(int64_t)) {
+            int64_t present_at = read_value<int64_t>(message_data->image_data.data());
+            if (present_at != 0 && remote_connection->clock_sync.synchronized()) {
+                message_data->present_at = remote_connection->clock_sync.to_local(present_at);
+            }
+            else if (present_at != 0 && remote_connection->clock_offset.known()) {
+                message_data->present_at = SteadyClock::time_point(std::chrono::duration_cast<SteadyClock::duration>(
+                    std::chrono::nanoseconds(present_at + remote_connection->clock_offset.offset_ns())));
+            }
+        }
+    }
+    if (!received_values.push(message_data)) {
+        // the application isn't keeping up; drop rather than stall the reactor
+        long drops = ++received_drops;
+        LOG_WARN("receive queue full, dropped ty:{} drops:{}", message_data->message_type, drops);
+        delete message_data;
+        return;
+    }
+    if (ack_image) {
+        send_image_ack(remote_connection, image_sequence);
+    }
+    uint64_t one = 1;
+    if (::write(received_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("receive signal failed {}", strerror(errno));
+    }
+
+    if (waiter) {
+        waiter->notify();
+    }
+}
+
+void Comm::shm_ready(Connection * remote_connection, uint32_t events) {
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        LOG_WARN("remote disconnected from shm:{}", shm_name);
+        connection_lost(remote_connection);
+        return;
+    }
+
+    ShmChannel & channel = *remote_connection->shm;
+    channel.clear_doorbell();
+    string header;
+    FrameBuffer payload;
+    while (remote_connection->keep_going_flag && channel.read(header, payload)) {
+        size_t header_length = header.empty() ? 0 : MessageData::header_size_for(header[0]);
+        if (header_length == 0 || header.size() < header_length) {
+            LOG_WARN("shm: dropped message without a header");
+            continue;
+        }
+        MessageData * message_data = MessageData::from_header(header.data(), false);
+        if (header.size() != header_length + message_data->image_name.size()) {
+            LOG_WARN("shm: dropped message with a truncated name");
+            delete message_data;
+            continue;
+        }
+        message_data->image_name.assign(header, header_length, message_data->image_name.size());
+        message_data->image_data = std::move(payload);
+        total_bytes_in.fetch_add(header.size() + message_data->image_data.size(), memory_order_relaxed);
+        message_received(remote_connection, message_data);
+    }
+
+    // the doorbell also rings when the remote frees a slot we're waiting for
+    shm_send_ready(remote_connection);
+}
+
+void Comm::shm_send_ready(Connection * connection) {
+    ShmChannel & channel = *connection->shm;
+    bool written = false;
+    while (connection->keep_going_flag) {
+        if (connection->sending.empty()) {
+            MessageData * message_data = connection->next_send();
+            if (message_data == nullptr) {
+                break;
+            }
+            connection->sending.push_back(message_data);
+        }
+
+        MessageData * message_data = connection->sending.front();
+        string header = message_data->serialize_header(connection->protocol_version);
+        if (message_data->image_data.size() > channel.slot_payload() || header.size() > channel.slot_header()) {
+            LOG_WARN("shm: message {}+{} larger than a slot, dropped ty:{}", header.size(), message_data->image_data.size(), message_data->message_type);
+            release_sent(message_data);
+            connection->sending.clear();
+            continue;
+        }
+        if (!channel.write(header, message_data->image_data)) {
+            // the remote holds every slot; its doorbell brings us back here
+            break;
+        }
+        written = true;
+        if (message_data->message_type == MessageData::MessageType::IMAGE) {
+            report_first_frame("sent to");
+        }
+        connection->messages_sent += 1;
+        connection->bytes_sent += message_data->image_data.size();
+        total_messages_out.fetch_add(1, memory_order_relaxed);
+        total_bytes_out.fetch_add(header.size() + message_data->image_data.size(), memory_order_relaxed);
+        release_sent(message_data);
+        connection->sending.clear();
+    }
+
+    if (written) {
+        channel.notify_peer();
+    }
+}
+
+bool Comm::connect(Role pending_role, const string & ip_address, const string & port) {
+    if (connect_thread != nullptr) {
+        return false;
+    }
+
+    // an empty name if the address isn't "shm:name"
+    this->shm_name.clear();
+    ShmChannel::parse_address(ip_address, this->shm_name);
+    this->ip_address = (pending_role == Role::CLIENT || !shm_name.empty() ? ip_address : "localhost");
+    this->ip_port = port;
+
+    LOG_INFO("attempting to connect to {}:{} as {}", this->ip_address, port, pending_role == Role::CLIENT ? "client" : "server");
+
+    this->role = pending_role;
+    if (pending_role == Role::CLIENT) {
+        // sends are dropped until the link is up
+        local_connection.keep_going_flag = false;
+    }
+    connect_thread = new thread(&Comm::execute_connect, this, pending_role, this->ip_address, this->ip_port);
+    return true;
+}
+
+ConnectError Comm::connect_result() {
     lock_guard<mutex> guard(this->connect_result_mutex);
     return connect_error;
 }
@@ -729,94 +1670,493 @@ void Comm::disconnect() {
         return;
     }
 
-    cout << "disconnecting" << endl;
+    LOG_INFO("disconnecting");
 
     this->local_connection.keep_going_flag = false;
+    {
+        // ends a client's link, or its wait before connecting again
+        lock_guard<mutex> guard(this->connect_result_mutex);
+        stopping = true;
+        this->connect_cv.notify_all();
+    }
 
     connect_thread->join();
     delete connect_thread;
     connect_thread = nullptr;
+    reactor_remove(&local_connection);
     local_connection.stop();
+    if (clock_timer.timer_fd >= 0) {
+        Reactor::instance().remove(clock_timer.timer_fd, &clock_timer);
+        ::close(clock_timer.timer_fd);
+        clock_timer.timer_fd = -1;
+    }
 
     if (is_server()) {
+        close_shm_handshakes();
         close_all();
     }
 
-    cross_close(this->local_connection.sock_fd);
+    if (local_connection.sock_fd >= 0) {
+        cross_close(this->local_connection.sock_fd);
+        local_connection.sock_fd = -1;
+    }
 }
 
 void Comm::close_one(Connection* remote_connection) {
+    reactor_remove(remote_connection);
     remote_connection->stop();
     if (remote_connection->sock_fd >= 0) {
 #ifdef USING_SSL
         remote_connection->close_ssl();
 #endif
         cross_close(remote_connection->sock_fd);
-        delete remote_connection;
     }
+    delete remote_connection;
 }
 
 void Comm::close_all() {
-    lock_guard<mutex> guard(this->remote_connections_mutex);
-    for (Connection * remote_connection: this->remote_connections) {
-        close_one(remote_connection);
+    list<Connection *> to_close;
+    {
+        // closing waits on the reactor, which may itself need this lock
+        lock_guard<mutex> guard(this->remote_connections_mutex);
+        to_close.swap(remote_connections);
+        to_close.splice(to_close.end(), deleted_remote_connections);
     }
-    for (Connection* remote_connection : this->deleted_remote_connections) {
+    for (Connection * remote_connection : to_close) {
         close_one(remote_connection);
     }
-
-    remote_connections.clear();
-    deleted_remote_connections.clear();
 }
 
 ConnectError Comm::send(MessageData * message_data, BlockType block) {
-    bool result = false;
+    // frames are encoded here, on the caller's thread; images without their
+    // own geometry get this Comm's
+    bool is_frame = message_data->message_type == MessageData::MessageType::IMAGE && !message_data->compressed && !message_data->delta;
+    if (is_frame && message_data->width == 0 && frame_format != MessageData::UNKNOWN_FORMAT) {
+        message_data->width = static_cast<uint16_t>(frame_width.load());
+        message_data->height = static_cast<uint16_t>(frame_height.load());
+        message_data->pixel_format = static_cast<MessageData::PixelFormat>(frame_format.load());
+        message_data->stride = message_data->width * (message_data->pixel_format == MessageData::BGR24 ? 3 : 1);
+    }
+
+    SendCompletion completion;
+    vector<Connection *> connections;
+    unique_lock<mutex> latest_guard(this->latest_image_mutex, defer_lock);
     if (is_server()) {
         lock_guard<mutex> guard(this->remote_connections_mutex);
-        message_data->use_count = static_cast<int>(this->remote_connections.size());
-        for (Connection* remote_connection : this->remote_connections) {
-            if (block == BLOCKING) {
-                auto result = this->send_one(remote_connection, message_data);
-                if (result != ConnectError::SUCCESS) {
-                    return result;
+        connections.assign(this->remote_connections.begin(), this->remote_connections.end());
+    }
+    else {
+        if (is_frame) {
+            // what a server that comes back is sent first; held until the
+            // frame is queued so that resend and this frame keep their order
+            latest_guard.lock();
+            latest_image.reset(new MessageData(*message_data));
+        }
+        if (!local_connection.keep_going_flag) {
+            // the link is down and being retried; nothing waits for it
+            long dropped = ++sends_dropped;
+            if (dropped % 100 == 1) {
+                LOG_WARN("{}:{} down, dropped ty:{} dropped:{}", ip_address, ip_port, message_data->message_type, dropped);
+            }
+            delete message_data;
+            return SERVER_DISCONNECTED;
+        }
+        connections.push_back(&this->local_connection);
+    }
+
+    if (connections.empty()) {
+        delete message_data;
+        return ConnectError::SUCCESS;
+    }
+
+    if (block == BLOCKING) {
+        completion.remaining = static_cast<int>(connections.size());
+        message_data->completion = &completion;
+    }
+
+    // every connection but the last gets a copy of the header fields; the
+    // payload is shared between them
+    vector<MessageData *> per_connection;
+    for (size_t i = 1; i < connections.size(); i++) {
+        per_connection.push_back(new MessageData(*message_data));
+    }
+    per_connection.push_back(message_data);
+
+    FrameBuffer encoded;
+    bool encode_tried = false;
+
+    ConnectError result = ConnectError::SUCCESS;
+    for (size_t i = 0; i < connections.size(); i++) {
+        Connection * connection = connections[i];
+        bool queued = false;
+        if (is_frame) {
+            queued = queue_image(connection, per_connection[i], encoded, encode_tried);
+        }
+        else {
+            queued = connection->keep_going_flag && connection->send(per_connection[i]);
+        }
+        if (!queued) {
+            // a frame too large for the link is dropped and counted, the
+            // link staying up
+            if (!connection->keep_going_flag) {
+                LOG_WARN("link down, dropped ty:{}", per_connection[i]->message_type);
+                result = SERVER_DISCONNECTED;
+            }
+            release_message(per_connection[i]);
+            continue;
+        }
+        // the reactor thread does the writing
+        if (!connection->wake_pending.exchange(true)) {
+            Reactor::instance().wake(connection);
+        }
+    }
+
+    if (latest_guard.owns_lock()) {
+        latest_guard.unlock();
+    }
+    if (block == BLOCKING) {
+        completion.wait();
+    }
+
+    return result;
+}
+
+bool Comm::queue_image(Connection * connection, MessageData * message_data, FrameBuffer & encoded, bool & encode_tried,
+                       bool resend, uint32_t resend_of) {
+    lock_guard<mutex> guard(connection->delta_mutex);
+    if (!connection->keep_going_flag) {
+        return false;
+    }
+
+    if (resend) {
+        // an older frame again must not take the place of a newer one
+        bool newer_waiting;
+        {
+            lock_guard<mutex> image_guard(connection->image_mutex);
+            newer_waiting = connection->pending_image != nullptr;
+        }
+        if (newer_waiting || (resend_of != 0 && connection->last_frame_id != resend_of)) {
+            LOG_DEBUG("resend of {} dropped, a newer frame is queued or sent", message_data->image_name);
+            return false;
+        }
+    }
+    // latest wins: a frame still waiting for a slow link is replaced rather
+    // than queued behind, and the remote then holds the last frame taken
+    // for writing, which this one is encoded against
+    else if (MessageData * superseded = connection->withdraw_image()) {
+        {
+            lock_guard<mutex> image_guard(connection->image_mutex);
+            connection->delta_reference = connection->sent_reference;
+            connection->delta_reference_index = connection->sent_reference_index;
+        }
+        connection->images_sent = superseded->image_index;
+        if (superseded->delta) {
+            connection->frames_since_key -= 1;
+        }
+        connection->images_superseded += 1;
+        LOG_DEBUG("superseded {} superseded:{}", superseded->image_name, connection->images_superseded.load());
+        release_message(superseded);
+    }
+
+    FrameBuffer frame = message_data->image_data;
+    MulticastSender * sender = multicast_sender;
+    if (!resend) {
+        connection->last_frame_id = 0;
+    }
+    if (!resend && sender && connection->multicast) {
+        // the frame goes out once for every server, however many Comms
+        // send it; this connection only gets its ids
+        uint32_t frame_id;
+        if (!sender->find(frame, frame_id)) {
+            if (compression_offered && !encode_tried) {
+                encode_tried = true;
+                encode_frame(frame.data(), frame.size(), frame_width, encoded);
+            }
+            bool compressed = compression_offered && !encoded.empty();
+            frame_id = sender->publish(frame, compressed ? encoded : frame, compressed);
+        }
+        if (frame_id != 0) {
+            FrameBuffer ids = FrameBuffer::allocate(2 * sizeof(uint32_t));
+            uint32_t sender_id = sender->sender_id();
+            memcpy(ids.writable_data(), &sender_id, sizeof(sender_id));
+            memcpy(ids.writable_data() + sizeof(sender_id), &frame_id, sizeof(frame_id));
+            message_data->image_data = ids;
+            message_data->reference = true;
+            connection->last_frame_id = frame_id;
+        }
+    }
+
+    const FrameBuffer & reference = connection->delta_reference;
+    if (!resend && !message_data->reference && connection->delta && connection->frames_since_key < delta_key_interval &&
+        !reference.empty() && reference.size() == frame.size()) {
+        FrameBuffer delta;
+        if (encode_delta(frame.data(), reference.data(), frame.size(), frame_width, delta_tile_size,
+                         connection->delta_reference_index, delta)) {
+            message_data->image_data = delta;
+            message_data->delta = true;
+        }
+    }
+    if (!message_data->delta && !message_data->reference && connection->compression) {
+        if (!encode_tried) {
+            encode_tried = true;
+            auto begin = SteadyClock::now();
+            if (encode_frame(frame.data(), frame.size(), frame_width, encoded)) {
+                Seconds seconds = SteadyClock::now() - begin;
+                LOG_DEBUG("compressed i:{} -> {} t:{}s", frame.size(), encoded.size(), seconds.count());
+            }
+        }
+        if (!encoded.empty()) {
+            message_data->image_data = encoded;
+            message_data->compressed = true;
+        }
+    }
+
+    size_t outgoing_size = message_data->image_data.size();
+    size_t max_payload = connection->max_payload.load();
+    if (max_payload != 0 && outgoing_size > max_payload) {
+        long too_large = ++connection->images_too_large;
+        if (too_large % 100 == 1) {
+            LOG_WARN("frame {} of {} bytes larger than the link's {}, dropped dropped:{}", message_data->image_name,
+                     outgoing_size, max_payload, too_large);
+        }
+        return false;
+    }
+    bool delta = message_data->delta;
+    bool multicast = message_data->reference;
+    message_data->raw_frame = frame;
+    message_data->image_index = connection->images_sent;
+    connection->send_image(message_data);
+
+    // the remote will hold this frame once it has read the message
+    connection->delta_reference = frame;
+    connection->delta_reference_index = connection->images_sent++;
+    connection->image_bytes_saved += static_cast<long long>(frame.size()) - static_cast<long long>(outgoing_size);
+    if (delta) {
+        connection->frames_since_key += 1;
+        connection->delta_frames += 1;
+        LOG_DEBUG("delta i:{} -> {} saved:{} delta/full:{}/{}", frame.size(), outgoing_size,
+                  connection->image_bytes_saved, connection->delta_frames, connection->full_frames);
+    }
+    else if (multicast) {
+        connection->frames_since_key = 0;
+        connection->multicast_frames += 1;
+    }
+    else {
+        connection->frames_since_key = 0;
+        connection->full_frames += 1;
+    }
+    return true;
+}
+
+bool Comm::resolve_reference(Connection * remote_connection, MessageData * message_data) {
+    uint32_t sender_id = 0;
+    uint32_t frame_id = 0;
+    if (message_data->image_data.size() == 2 * sizeof(uint32_t)) {
+        memcpy(&sender_id, message_data->image_data.data(), sizeof(sender_id));
+        memcpy(&frame_id, message_data->image_data.data() + sizeof(sender_id), sizeof(frame_id));
+    }
+
+    FrameBuffer payload;
+    bool compressed = false;
+    MulticastReceiver * receiver = multicast_receiver;
+    if (receiver && receiver->find(sender_id, frame_id, payload, compressed)) {
+        message_data->image_data = payload;
+        message_data->compressed = compressed;
+        message_data->reference = false;
+        return true;
+    }
+
+    multicast_misses += 1;
+    LOG_WARN("multicast frame {} missing for {}, asking again misses:{}", frame_id, message_data->image_name, multicast_misses);
+    auto resend = new MessageData(MessageData::MessageType::RESEND, message_data->image_name, message_data->image_data);
+    if (remote_connection->send(resend)) {
+        send_ready(remote_connection);
+    }
+    else {
+        release_message(resend);
+    }
+    return false;
+}
+
+void Comm::handle_resend(Connection * remote_connection, MessageData * message_data) {
+    uint32_t frame_id = 0;
+    if (message_data->image_data.size() == 2 * sizeof(uint32_t)) {
+        memcpy(&frame_id, message_data->image_data.data() + sizeof(uint32_t), sizeof(frame_id));
+    }
+    if (is_server() || multicast_sender == nullptr || frame_id == 0) {
+        LOG_WARN("resend of {} frame {} no longer possible", message_data->image_name, frame_id);
+        delete message_data;
+        return;
+    }
+
+    {
+        // only the last frame given the link is sent again, so only the
+        // latest request is kept
+        lock_guard<mutex> guard(this->connect_result_mutex);
+        resend_wanted = frame_id;
+        resend_wanted_name = message_data->image_name;
+        this->connect_cv.notify_all();
+    }
+    delete message_data;
+}
+
+void Comm::send_again(Connection * connection, bool latest, uint32_t frame_id, const string & name) {
+    bool queued = false;
+    if (latest) {
+        // a server that just came (back) up gets the last frame now, unless
+        // a newer one is already on its way
+        lock_guard<mutex> latest_guard(this->latest_image_mutex);
+        bool nothing_sent;
+        {
+            lock_guard<mutex> guard(connection->delta_mutex);
+            nothing_sent = connection->images_sent == 0;
+        }
+        if (nothing_sent && latest_image) {
+            auto image = new MessageData(*latest_image);
+            LOG_INFO("sending the last frame {} again", image->image_name);
+            string image_name = image->image_name;
+            FrameBuffer encoded;
+            bool encode_tried = false;
+            if (queue_image(connection, image, encoded, encode_tried, true)) {
+                queued = true;
+                // and commits it, as no DISPLAY_NOW sent before will
+                if (connection->staged) {
+                    auto display_now = new MessageData(MessageData::MessageType::DISPLAY_NOW, image_name);
+                    if (!connection->send(display_now)) {
+                        release_message(display_now);
+                    }
                 }
             }
             else {
-                remote_connection->send(message_data);
+                release_message(image);
             }
         }
     }
-    else {
-        message_data->use_count = 1;
-        if (block == BLOCKING) {
-            this->send_one(&this->local_connection, message_data);
+
+    MulticastSender * sender = multicast_sender;
+    if (frame_id != 0 && sender) {
+        FrameBuffer frame = sender->published(frame_id);
+        if (frame.empty()) {
+            LOG_WARN("resend of {} frame {} no longer possible", name, frame_id);
         }
         else {
-            this->local_connection.send(message_data);
+            LOG_INFO("resending {} frame {} over tcp", name, frame_id);
+            auto image = new MessageData(MessageData::MessageType::IMAGE, name, frame);
+            FrameBuffer encoded;
+            bool encode_tried = false;
+            if (queue_image(connection, image, encoded, encode_tried, true, frame_id)) {
+                queued = true;
+            }
+            else {
+                release_message(image);
+            }
         }
     }
-    
-    return ConnectError::SUCCESS;
+
+    // the reactor thread does the writing
+    if (queued && !connection->wake_pending.exchange(true)) {
+        Reactor::instance().wake(connection);
+    }
 }
 
 MessageData * Comm::next_received() {
-    lock_guard<mutex> guard(this->received_values_mutex);
-    if (received_values.empty()) {
-        return nullptr;
+    MessageData * message_data;
+    while (received_values.pop(message_data)) {
+        // decoded here, on the application's thread, so the reactor only moves bytes
+        bool decoded = message_data->compressed || message_data->delta;
+        if (message_data->compressed) {
+            // no larger than the header says the frame is
+            size_t max_size = max_decoded_size;
+            if (message_data->width != 0 && message_data->height != 0) {
+                max_size = std::min(max_size, static_cast<size_t>(message_data->stride) * message_data->height);
+            }
+            FrameBuffer decoded;
+            if (!decode_frame(message_data->image_data.data(), message_data->image_data.size(), max_size, decoded)) {
+                LOG_WARN("dropped undecodable frame {} il:{}", message_data->image_name, message_data->image_data.size());
+                delete message_data;
+                continue;
+            }
+            message_data->image_data = decoded;
+            message_data->compressed = false;
+        }
+
+        shared_ptr<ReceivedFrames> received_frames = message_data->received_frames;
+        if (message_data->message_type == MessageData::MessageType::IMAGE && received_frames) {
+            lock_guard<mutex> guard(received_frames->frames_mutex);
+            if (message_data->delta) {
+                FrameBuffer rebuilt;
+                if (!apply_delta(message_data->image_data.data(), message_data->image_data.size(),
+                                 received_frames->reference, received_frames->reference_index, rebuilt)) {
+                    // made against a frame that never arrived; wait for the next full frame
+                    LOG_WARN("dropped delta frame {} without its reference", message_data->image_name);
+                    delete message_data;
+                    continue;
+                }
+                message_data->image_data = rebuilt;
+                message_data->delta = false;
+            }
+            // a payload still in a shared-memory slot would keep that slot,
+            // and every message queued behind it, from the sender
+            received_frames->reference = received_frames->copy_reference && !decoded ?
+                FrameBuffer::copy_of(message_data->image_data.data(), message_data->image_data.size()) : message_data->image_data;
+            received_frames->reference_index = message_data->image_index;
+        }
+
+        return message_data;
     }
 
-    MessageData * message_data = this->received_values.front();
-    this->received_values.pop_front();
+    return nullptr;
+}
 
-    return message_data;
+MessageData * Comm::next_received_wait(const SteadyClock::time_point & deadline) {
+    while (true) {
+        if (MessageData * message_data = next_received()) {
+            return message_data;
+        }
+
+        auto now = SteadyClock::now();
+        if (now >= deadline) {
+            return nullptr;
+        }
+
+        // the eventfd counts pushes, so one that lands between the pop above
+        // and this wait still wakes it
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+        timespec timeout;
+        timeout.tv_sec = remaining / 1000000000;
+        timeout.tv_nsec = remaining % 1000000000;
+        pollfd ufds[1];
+        ufds[0].fd = received_fd;
+        ufds[0].events = POLLIN;
+        if (ppoll(ufds, 1, &timeout, nullptr) > 0) {
+            uint64_t count;
+            if (::read(received_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                LOG_ERROR("receive wait failed {}", strerror(errno));
+            }
+        }
+    }
 }
 
-void Comm::send_display_now(const string & image_name) {
-    this->send(new MessageData(MessageData::MessageType::DISPLAY_NOW, image_name));
+void Comm::send_display_now(const string & image_name, const SteadyClock::time_point & present_at) {
+    // a server that doesn't stage frames has already shown them
+    if (!is_server() && !local_connection.staged) {
+        return;
+    }
+    int64_t present_at_ns = present_at == SteadyClock::time_point() ? 0 :
+        std::chrono::duration_cast<std::chrono::nanoseconds>(present_at.time_since_epoch()).count();
+    string payload;
+    append_value<int64_t>(payload, present_at_ns);
+    this->send(new MessageData(MessageData::MessageType::DISPLAY_NOW, image_name, FrameBuffer::copy_of(payload)));
+}
+
+void Comm::send_image(const string & image_name, const FrameBuffer & image_data, const SteadyClock::time_point & capture_time) {
+    auto message_data = new MessageData(MessageData::MessageType::IMAGE, image_name, image_data);
+    message_data->capture_time = capture_time == SteadyClock::time_point() ? SteadyClock::now() : capture_time;
+    this->send(message_data);
 }
 
 void Comm::send_image(const string & image_name, const string & image_data) {
-    this->send(new MessageData(MessageData::MessageType::IMAGE, image_name, image_data));
+    this->send_image(image_name, FrameBuffer::copy_of(image_data));
 }
 
 void Comm::send_start_timer() {
@@ -827,85 +2167,409 @@ void Comm::send_ack(const string &image_name) {
     this->send(new MessageData(MessageData::MessageType::ACK, image_name));
 }
 
-void Comm::set_waiter(Waiter *waiter) {
-    this->waiter = waiter;
+void Comm::set_compression(bool enable, int frame_width) {
+    compression_offered = enable;
+    compression_accepted = enable;
+    if (frame_width > 0) {
+        this->frame_width = frame_width;
+    }
+    if (!is_server() && connect_result() == ConnectError::SUCCESS) {
+        send_hello();
+    }
 }
 
-double SD::increment(const SteadyClock::time_point & current, const SteadyClock::time_point & previous) {
-    Seconds one_unit = current - previous;
-    return this->increment(one_unit);
+void Comm::set_delta(bool enable, int frame_width, int tile_size) {
+    delta_offered = enable;
+    delta_accepted = enable;
+    if (frame_width > 0) {
+        this->frame_width = frame_width;
+    }
+    if (tile_size > 0) {
+        delta_tile_size = tile_size;
+    }
+    if (!is_server() && connect_result() == ConnectError::SUCCESS) {
+        send_hello();
+    }
 }
 
-double SD::increment(const SteadyClock::time_point & current) {
-    Seconds one_frame = current - this->last;
-    auto result = this->increment(one_frame);
-    this->last = current;
-    return result;
+void Comm::set_flow_control(bool enable, size_t window_bytes) {
+    ack_offered = enable;
+    ack_window = window_bytes;
+    if (!is_server() && connect_result() == ConnectError::SUCCESS) {
+        send_hello();
+    }
 }
-    
-double SD::increment(const Seconds & seconds) {
-    double seconds_d = seconds.count();
-    this->count += 1;
-    // https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Welford's_online_algorithm
-    // there is some floating point error, but since the subtractions compare
-    // same order-of-magnitude values, it makes a decent estimate
-    if (this->count == SD::warm_up) {
-        // initial value (let some initial frames go by for stabilization)
-        this->mean = seconds_d;
-        this->sum_squares = 0;
-    }
-    else if (this->count > SD::warm_up) {
-        auto new_count = this->count - SD::warm_up + 1;
-        auto d1 = seconds_d - this->mean;
-        auto new_mean = this->mean + (d1 / new_count);
-        auto d2 = seconds_d - new_mean;
-        auto new_sum_squares = this->sum_squares + (d1 * d2);
-        {
-            lock_guard<mutex> guard(this->sd_mutex);
-            // push the sd
-            this->sd_q.push_back(sqrt(new_sum_squares / new_count));
+
+void Comm::set_staged(bool enable) {
+    staged_offered = enable;
+    if (!is_server() && connect_result() == ConnectError::SUCCESS) {
+        send_hello();
+    }
+}
+
+void Comm::set_frame_format(int width, int height, MessageData::PixelFormat pixel_format) {
+    frame_width = width;
+    frame_height = height;
+    frame_format = pixel_format;
+}
+
+void Comm::set_multicast(MulticastSender * sender) {
+    multicast_sender = sender;
+    if (!is_server() && connect_result() == ConnectError::SUCCESS) {
+        send_hello();
+    }
+}
+
+bool Comm::join_multicast(const string & group, const string & port, const string & interface_address) {
+    if (multicast_receiver) {
+        return false;
+    }
+    auto receiver = new MulticastReceiver();
+    if (!receiver->open(group, port, interface_address) ||
+        !Reactor::instance().add(receiver->fd(), EPOLLIN, receiver)) {
+        delete receiver;
+        return false;
+    }
+    multicast_receiver = receiver;
+    return true;
+}
+
+void Comm::send_hello() {
+    // an empty HELLO withdraws an earlier offer; v2 headers and answering
+    // clock pings are always offered
+    string capabilities = "v2 clock ";
+    if (compression_offered) {
+        capabilities += "compress ";
+    }
+    if (delta_offered) {
+        capabilities += "delta ";
+    }
+    if (multicast_sender) {
+        capabilities += "multicast ";
+    }
+    if (staged_offered) {
+        capabilities += "staged ";
+    }
+    if (ack_offered) {
+        capabilities += "ack ";
+    }
+    this->send(new MessageData(MessageData::MessageType::HELLO, capabilities));
+}
+
+void Comm::handle_hello(Connection * remote_connection, MessageData * message_data) {
+    const string & capabilities = message_data->image_name;
+    if (is_server()) {
+        // answer with the subset of the offer this side supports
+        string accepted;
+        bool compression = compression_accepted && has_capability(capabilities, "compress");
+        if (compression) {
+            accepted += "compress ";
+        }
+        bool delta = delta_accepted && has_capability(capabilities, "delta");
+        if (delta) {
+            accepted += "delta ";
+        }
+        // a frame sent by multicast resolves only if this server joined the group
+        bool multicast = multicast_receiver && has_capability(capabilities, "multicast");
+        if (multicast) {
+            accepted += "multicast ";
+        }
+        bool v2 = has_capability(capabilities, "v2");
+        if (v2) {
+            accepted += "v2 ";
+        }
+        // up to the application's render loop, which takes commits from a Display
+        bool staged = has_capability(capabilities, "staged");
+        if (staged) {
+            accepted += "staged ";
+        }
+        remote_connection->compression = compression;
+        remote_connection->delta = delta;
+        remote_connection->multicast = multicast;
+        // the clock messages are stamped in v2 headers
+        bool clock = v2 && has_capability(capabilities, "clock");
+        if (clock) {
+            accepted += "clock ";
+        }
+        remote_connection->staged = staged;
+        remote_connection->protocol_version = v2 ? 2 : 1;
+        if (clock && !remote_connection->clock) {
+            remote_connection->next_clock_ping = SteadyClock::now();
+        }
+        remote_connection->clock = clock;
+        // acknowledged by sequence, which only v2 headers carry
+        bool ack = ack_accepted && v2 && has_capability(capabilities, "ack");
+        if (ack) {
+            accepted += "ack ";
+        }
+        remote_connection->ack = ack;
+        LOG_INFO("hello offered:'{}' accepted:'{}'", capabilities, accepted);
+
+        auto reply = new MessageData(MessageData::MessageType::HELLO, accepted);
+        if (remote_connection->send(reply)) {
+            send_ready(remote_connection);
+        }
+        else {
+            release_message(reply);
         }
-        this->mean = new_mean;
-        this->sum_squares = new_sum_squares;
     }
-    return seconds_d;
+    else {
+        remote_connection->compression = has_capability(capabilities, "compress");
+        remote_connection->delta = has_capability(capabilities, "delta");
+        remote_connection->multicast = has_capability(capabilities, "multicast");
+        remote_connection->staged = has_capability(capabilities, "staged");
+        remote_connection->clock = has_capability(capabilities, "clock");
+        remote_connection->ack = has_capability(capabilities, "ack");
+        remote_connection->protocol_version = has_capability(capabilities, "v2") ? 2 : 1;
+        LOG_INFO("hello accepted:'{}'", capabilities);
+
+        // the first answer on a new link: the link thread sends the last
+        // frame again
+        if (resend_latest.exchange(false)) {
+            lock_guard<mutex> guard(this->connect_result_mutex);
+            latest_wanted = true;
+            this->connect_cv.notify_all();
+        }
+    }
+    delete message_data;
 }
 
-void SD::dump(ofstream & out, const string & label) {
-    lock_guard<mutex> guard(this->sd_mutex);
-    out << label << ": " << this->count << " - " << SD::warm_up << endl;
-    out << "mean: " << this->mean << endl;
-    out << "sd:   ";
-    while (!this->sd_q.empty()) {
-        auto sd = this->sd_q.front();
-        this->sd_q.pop_front();
-        out << sd << " ";
+void ClockTimer::handle_events(uint32_t events) {
+    uint64_t expirations;
+    if (::read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("clock timer read failed {}", strerror(errno));
     }
-    out << endl;
+    comm->send_clock_pings();
 }
 
-void Display::queue_image_for_display(MessageData * message_data) {
+void Comm::send_clock_pings() {
+    auto now = SteadyClock::now();
+    vector<Connection *> due;
+    {
+        // sending can lose a connection, which takes this lock; the reactor
+        // thread is in this callback, so none is deleted meanwhile
+        lock_guard<mutex> guard(this->remote_connections_mutex);
+        for (Connection * connection : remote_connections) {
+            if (connection->clock && connection->keep_going_flag && now >= connection->next_clock_ping) {
+                due.push_back(connection);
+            }
+        }
+    }
+    for (Connection * connection : due) {
+        Seconds interval = connection->clock_sync.synchronized() ? clock_ping_interval : clock_ping_acquire_interval;
+        connection->next_clock_ping = now + std::chrono::duration_cast<SteadyClock::duration>(interval);
+        auto ping = new MessageData(MessageData::MessageType::CLOCK_PING);
+        if (connection->send(ping)) {
+            send_ready(connection);
+        }
+        else {
+            release_message(ping);
+        }
+    }
+}
+
+void Comm::handle_clock(Connection * remote_connection, MessageData * message_data) {
+    auto now = SteadyClock::now();
+    auto nanoseconds = [](const SteadyClock::time_point & time) -> int64_t {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    };
+
+    if (message_data->message_type == MessageData::MessageType::CLOCK_PING) {
+        // answered right away; the answer's header is stamped as it goes out
+        string payload;
+        append_value<int64_t>(payload, nanoseconds(message_data->capture_time));
+        append_value<int64_t>(payload, nanoseconds(now));
+        auto pong = new MessageData(MessageData::MessageType::CLOCK_PONG, "", FrameBuffer::copy_of(payload));
+        if (remote_connection->send(pong)) {
+            send_ready(remote_connection);
+        }
+        else {
+            release_message(pong);
+        }
+    }
+    else if (is_server() && message_data->image_data.size() == 2 * sizeof(int64_t) &&
+             message_data->capture_time != SteadyClock::time_point()) {
+        ClockSync & clock_sync = remote_connection->clock_sync;
+        bool was_synchronized = clock_sync.synchronized();
+        clock_sync.add(read_value<int64_t>(message_data->image_data.data()),
+                       read_value<int64_t>(message_data->image_data.data() + sizeof(int64_t)),
+                       nanoseconds(message_data->capture_time), nanoseconds(now));
+        ClockSync::Estimate estimate = clock_sync.estimate();
+        if (estimate.synchronized && (!was_synchronized || estimate.exchanges % 60 == 0)) {
+            LOG_INFO("client clock on {}: offset:{}us drift:{}ppm round trip:{}us dispersion:{}us exchanges:{}",
+                     ip_port, estimate.offset_ns / 1000, estimate.drift_ppm,
+                     estimate.round_trip_ns / 1000, estimate.dispersion_ns / 1000, estimate.exchanges);
+        }
+    }
+    delete message_data;
+}
+
+void Comm::send_image_ack(Connection * remote_connection, uint64_t sequence) {
+    string payload;
+    append_value<uint32_t>(payload, static_cast<uint32_t>(sequence));
+    auto ack = new MessageData(MessageData::MessageType::ACK, "", FrameBuffer::copy_of(payload));
+    if (remote_connection->send(ack)) {
+        send_ready(remote_connection);
+    }
+    else {
+        release_message(ack);
+    }
+}
+
+void Comm::handle_image_ack(Connection * remote_connection, MessageData * message_data) {
+    uint32_t sequence = read_value<uint32_t>(message_data->image_data.data());
+    delete message_data;
+
+    auto now = SteadyClock::now();
+    auto & in_flight = remote_connection->in_flight;
+    // everything up to the frame acknowledged has arrived (TCP keeps them in order)
+    while (!in_flight.empty() && static_cast<int32_t>(sequence - in_flight.front().sequence) >= 0) {
+        const Connection::InFlight & frame = in_flight.front();
+        if (frame.sequence == sequence) {
+            ack_round_trips.record(now, frame.sent);
+            int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(now - frame.sent).count();
+            int64_t smoothed = remote_connection->round_trip_ns;
+            remote_connection->round_trip_ns = smoothed == 0 ? sample : smoothed + (sample - smoothed) / 8;
+        }
+        remote_connection->in_flight_bytes -= static_cast<long long>(frame.bytes);
+        in_flight.pop_front();
+    }
+    LOG_DEBUG("ack seq:{} in flight:{} b:{} rtt:{}us", sequence, in_flight.size(),
+              remote_connection->in_flight_bytes.load(), remote_connection->round_trip_ns.load() / 1000);
+    // a frame held back for the window can go now
+    send_ready(remote_connection);
+}
+
+ClockSync::Estimate Comm::clock_estimate() {
+    lock_guard<mutex> guard(this->remote_connections_mutex);
+    for (Connection * connection : remote_connections) {
+        if (connection->clock) {
+            return connection->clock_sync.estimate();
+        }
+    }
+    return ClockSync::Estimate();
+}
+
+bool Comm::next_frame_boundary(const SteadyClock::time_point & after, const SteadyClock::duration & period,
+                               SteadyClock::time_point & boundary) {
+    lock_guard<mutex> guard(this->remote_connections_mutex);
+    for (Connection * connection : remote_connections) {
+        if (connection->clock && connection->clock_sync.synchronized()) {
+            boundary = connection->clock_sync.next_boundary(after, period);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Comm::set_waiter(Waiter *waiter) {
+    this->waiter = waiter;
+}
+
+constexpr size_t Display::max_staged;
+
+Display::~Display() {
+    for (MessageData * image : staged) {
+        delete image;
+    }
+    for (Presentation & presentation : committed) {
+        delete presentation.image;
+    }
+}
+
+void Display::stage(MessageData * image) {
     lock_guard<mutex> guard(this->queues_mutex);
-    pending_images[message_data->image_name] = message_data;
-    pending_q_count += 1;
-    // cout << "+pending_q " << message_data->image_name << " qlen:" << pending_images.size() << endl;
+    staged.push_back(image);
+    staged_total += 1;
+    if (staged.size() > max_staged) {
+        delete staged.front();
+        staged.pop_front();
+        superseded += 1;
+    }
 }
 
-void Display::dump(ofstream & out) {
+bool Display::commit(const SteadyClock::time_point & present_at, const string & image_name) {
+    {
+        lock_guard<mutex> guard(this->queues_mutex);
+        if (staged.empty()) {
+            commit_misses += 1;
+            LOG_WARN("display: nothing staged to commit for {} misses:{}", image_name, commit_misses.load());
+            return false;
+        }
+        Presentation presentation;
+        presentation.image = staged.back();
+        presentation.present_at = present_at;
+        presentation.committed_at = SteadyClock::now();
+        staged.pop_back();
+        for (MessageData * older : staged) {
+            delete older;
+            superseded += 1;
+        }
+        staged.clear();
+        committed.push_back(presentation);
+        commits += 1;
+    }
+    commit_cv.notify_all();
+    return true;
+}
+
+bool Display::take_due(const SteadyClock::time_point & boundary, Presentation & presentation) {
     lock_guard<mutex> guard(this->queues_mutex);
-    out << "displayed: " << this->display_count << endl
-    << "all_display_q: " << this->display_q_count << endl
-    << "all_pending_q: " << this->pending_q_count << endl
-    << "still_pending: " << this->pending_images.size() << endl
-    << "still_display: " << this->images_to_display.size() << endl
-    << "not_found: " << this->name_not_found_count << endl;
+    bool taken = false;
+    while (!committed.empty() && committed.front().present_at <= boundary) {
+        if (taken) {
+            delete presentation.image;
+            skipped += 1;
+        }
+        presentation = committed.front();
+        committed.pop_front();
+        taken = true;
+    }
+    return taken;
+}
+
+void Display::presented(const Presentation & presentation, const SteadyClock::time_point & shown) {
+    presented_count += 1;
+    commit_to_photon.record(shown, presentation.committed_at);
+    if (presentation.present_at != SteadyClock::time_point()) {
+        present_error.record(shown, presentation.present_at);
+        Seconds lateness = shown - presentation.present_at;
+        if (lateness > frame_period) {
+            late += 1;
+            LOG_WARN("display: {} shown {}s after its time late:{}", presentation.image->image_name, lateness.count(), late.load());
+        }
+    }
 }
 
-void Display::image_should_be_displayed(string image_name) {
+void Display::set_frame_period(Seconds frame_period) {
+    this->frame_period = frame_period;
+}
+
+size_t Display::staged_count() {
     lock_guard<mutex> guard(this->queues_mutex);
-    images_to_display.push_back(image_name);
-    // cout << "+to_display_q " << image_name << " qlen:" << images_to_display.size() << endl;
-    display_q_count += 1;
+    return staged.size();
+}
+
+void Display::dump(ostream & out) {
+    out << "staged: " << staged_total << endl
+        << "superseded: " << superseded << endl
+        << "commits: " << commits << endl
+        << "commit_misses: " << commit_misses << endl
+        << "skipped: " << skipped << endl
+        << "presented: " << presented_count << endl
+        << "late: " << late << endl;
+    commit_to_photon.dump(out, "commit to photon");
+    present_error.dump(out, "after present time");
+    fwrite_intervals.dump(out, "fwrite interval");
+    display_times.dump(out, "display");
+}
+
+void Display::stop() {
+    {
+        lock_guard<mutex> guard(this->queues_mutex);
+        keep_going = false;
+    }
+    commit_cv.notify_all();
 }
 
 void Display::set_display_function(DisplayFunction display_function) {
@@ -913,39 +2577,35 @@ void Display::set_display_function(DisplayFunction display_function) {
 }
 
 void Display::execute_display() {
-    this->fwrite_sd.last = SteadyClock::now();
+    this->fwrite_intervals.mark(SteadyClock::now());
+    unique_lock<mutex> lock(this->queues_mutex);
     while (keep_going) {
-        MessageData * to_display = nullptr;
-        {
-            lock_guard<mutex> guard(this->queues_mutex);
-            if (!images_to_display.empty()) {
-                string image_name = this->images_to_display.front();
-                this->images_to_display.pop_front();
-                try {
-                    pending_images.at(image_name);
-                    to_display = pending_images[image_name];
-                    pending_images.erase(image_name);
-                    // cout << "+display " << image_name << " pqlen:" << pending_images.size() << " tdqlen:" << images_to_display.size() << endl;
-                }
-                catch (const out_of_range &e) {
-                    cout << image_name << " not in pending queue " << e.what() << endl;
-                    name_not_found_count += 1;
-                }
-            }
+        // sleeps until the next commit is due rather than polling
+        if (committed.empty()) {
+            commit_cv.wait(lock);
+            continue;
+        }
+        SteadyClock::time_point due = committed.front().present_at;
+        if (due > SteadyClock::now()) {
+            commit_cv.wait_until(lock, due);
+            continue;
         }
-        if (to_display) {
-            display_count += 1;
+        lock.unlock();
+
+        Presentation presentation;
+        if (take_due(SteadyClock::now(), presentation)) {
             auto begin = SteadyClock::now();
             if (this->display_function) {
-                this->display_function(to_display->image_data);
+                this->display_function(presentation.image->image_data);
             }
             auto current = SteadyClock::now();
-            auto one_frame = this->fwrite_sd.increment(current);
+            auto one_frame = this->fwrite_intervals.record_interval(current);
+            this->display_times.record(current, begin);
+            presented(presentation, current);
             Seconds elapsed = current - begin;
-            cout << "+fwrite:" << to_display->image_name << " elapsed:" << elapsed.count() << "s 1f:" << one_frame << endl;
-            delete to_display;
+            LOG_DEBUG("+fwrite:{} elapsed:{}s 1f:{}", presentation.image->image_name, elapsed.count(), one_frame);
+            delete presentation.image;
         }
-        
-        this_thread::sleep_for(std::chrono::microseconds(1));
+        lock.lock();
     }
 }
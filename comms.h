@@ -24,6 +24,17 @@ typedef int SOCKET;
 #include <chrono>
 #include <map>
 #include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sys/uio.h>
+
+#include "reactor.h"
+#include "ring_queue.h"
+#include "frame_buffer.h"
+#include "multicast.h"
+#include "shm_transport.h"
+#include "latency_histogram.h"
+#include "clock_sync.h"
 
 using namespace std;
 
@@ -47,6 +58,7 @@ enum ConnectError {
     CONNECTION_FAILURE,
     CREATE_SOCKET_FAILURE,
     SEND_TIMEOUT,
+    QUEUE_FULL,
 };
 
 enum MessageState {
@@ -56,60 +68,338 @@ enum MessageState {
     ONGOING
 };
 
+// lets a BLOCKING send wait until every connection has written its message
+struct SendCompletion {
+    mutex completion_mutex;
+    condition_variable completion_cv;
+    int remaining = 0;
+
+    void done_one();
+    void wait();
+};
+
+// the last frame received on one connection, which the next delta from
+// that connection is applied to (on the application thread)
+struct ReceivedFrames {
+    mutex frames_mutex;
+    FrameBuffer reference;
+    uint32_t reference_index = 0;
+    // set for a shared-memory link, whose payloads sit in slots the sender
+    // needs back: the reference kept is then a copy
+    bool copy_reference = false;
+};
+
 struct MessageData {
-    static const int header_size;
+    static constexpr int header_size = 6;  // 1 for type, 1 for name length, 4 for image length
+    // protocol v2: marker(1) + version(1) + type(1) + flags(1) + name length(2) +
+    // image length(4) + sequence(4) + capture time(8) + width(2) + height(2) +
+    // stride(4) + pixel format(1) + reserved(1); a v1 type byte is never the marker
+    static constexpr int header_size_v2 = 32;
+    static constexpr unsigned char v2_marker = 0x1f;
+    static constexpr int max_header_size = header_size_v2;
+    // set in the type byte when image_data holds an encode_frame() stream
+    static constexpr unsigned char compressed_flag = 0x80;
+    // set in the type byte when image_data holds an encode_delta() stream
+    static constexpr unsigned char delta_flag = 0x40;
+    // set in the type byte when image_data holds the sender and frame ids
+    // of a frame that was sent over multicast
+    static constexpr unsigned char reference_flag = 0x20;
     
     enum MessageType {
         NONE,
+        // commits the newest IMAGE staged before it (see Display); its
+        // payload, if any, is when to present it: int64 nanoseconds of the
+        // sender's SteadyClock, zero for the next frame boundary
         DISPLAY_NOW,
         IMAGE,
         START_TIMER,
-        ACK
+        // from the application, or on an "ack" link from Comm itself: the
+        // server acknowledging each IMAGE as it arrives, its payload the
+        // IMAGE's sequence (uint32), which the client paces its frames by
+        ACK,
+        // capability exchange, handled inside Comm; image_name holds the
+        // space separated capabilities offered (client) or accepted (server)
+        HELLO,
+        // asks the client to send a multicast frame again over TCP; the
+        // payload holds the reference that couldn't be resolved
+        RESEND,
+        // clock exchange, handled inside Comm (see ClockSync): the server
+        // pings, the client answers with the ping's time and its arrival
+        // (two int64 ns); each is stamped in its v2 header as it goes out
+        CLOCK_PING,
+        CLOCK_PONG
+    };
+
+    enum PixelFormat : uint8_t {
+        UNKNOWN_FORMAT,
+        GRAY8,
+        BGR24
     };
     
     MessageType message_type;
     string image_name;
-    string image_data;
-    std::atomic<int> use_count;
-    bool auto_delete = true;
+    // shared, never copied: a frame sent to several connections is queued
+    // as one small MessageData per connection around the same FrameBuffer
+    FrameBuffer image_data;
+    bool compressed = false;
+    bool delta = false;
+    bool reference = false;
+    SendCompletion * completion = nullptr;
+    // IMAGE messages are numbered per connection: by the sender as they are
+    // queued, by the receiver in arrival order, which is the same order
+    uint32_t image_index = 0;
+    // sending side: orders queued messages, and an IMAGE keeps the frame it
+    // was encoded from, which the remote holds once it has been sent
+    uint64_t sequence = 0;
+    FrameBuffer raw_frame;
+    shared_ptr<ReceivedFrames> received_frames;
+    // carried by v2 headers only: when the frame was captured (sender's
+    // SteadyClock) and its geometry; zero / UNKNOWN_FORMAT over v1. a
+    // DISPLAY_NOW or clock message carries when its header was written instead
+    SteadyClock::time_point capture_time;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint32_t stride = 0;
+    PixelFormat pixel_format = UNKNOWN_FORMAT;
+    // received IMAGE: its link stages frames, so it waits for a DISPLAY_NOW
+    bool staged = false;
+    // received DISPLAY_NOW: its payload on this side's clock, zero for the
+    // next frame boundary (or if the clocks can't be related yet)
+    SteadyClock::time_point present_at;
     
     MessageData(MessageType message_type);
     MessageData(MessageType message_type, const string & image_name);
-    MessageData(MessageType message_type, const string & image_name, const string & image_data);
-    MessageData(MessageType message_type, int name_length, long image_length, string & buffer);
-    string serialize_header() const;
-    static MessageData * deserialize(string & buffer, MessageState message_state);
+    MessageData(MessageType message_type, const string & image_name, const FrameBuffer & image_data);
+    // v1 truncates names to 255 bytes and drops the v2 fields
+    string serialize_header(int version = 1) const;
+    // the length of a header, v1 or v2, from its first byte
+    static int header_size_for(char first_byte);
+    // sizes image_name and image_data from a received header (either
+    // version) so the remainder of the message can be read straight into
+    // them; without allocate_payload image_data is left for the caller to fill
+    static MessageData * from_header(const char * header, bool allocate_payload = true);
+};
+
+// the remote's SteadyClock relative to this one's: the least (arrival -
+// remote send time) over the last two windows of samples, which is the
+// offset plus the quickest transit seen, and follows the clocks drifting.
+// a fallback for clients that don't answer clock pings
+struct ClockOffsetEstimate {
+    static constexpr int window = 64;
+
+    void add(int64_t sample_ns);
+    bool known() const;
+    // add this to a remote time to get the local one
+    int64_t offset_ns() const;
+    void reset();
+
+private:
+    int64_t current_min = INT64_MAX;
+    int64_t previous_min = INT64_MAX;
+    int samples = 0;
 };
 
-struct Connection {
-    SOCKET sock_fd = 0;
-    bool keep_going_flag = true;
+class Comm; // forward reference
+
+// one socket of a Comm: the client's link, the server's listening socket,
+// or a client accepted by the server; its events arrive on the Reactor thread
+struct Connection : public ReactorHandler {
+    SOCKET sock_fd = -1;
+    // set for a "shm:name" link; messages then go through its rings and
+    // sock_fd (a unix socket) only reports the remote hanging up
+    shared_ptr<ShmChannel> shm;
+    // the largest payload the link carries (a slot of its rings), 0 for any;
+    // a larger frame is dropped before it's queued, so the remote's
+    // reference stays the last frame it got
+    atomic<size_t> max_payload{0};
+    atomic<long> images_too_large{0};
+    atomic<bool> keep_going_flag{true};
     bool local = true;
-    thread* send_thread = nullptr;
-    thread* receive_thread = nullptr;
+    Comm * comm = nullptr;
     string id;
-    mutex send_values_mutex;
-    // keeps the list of pending key/values to send
-    deque<MessageData *> send_values;
-    string received_so_far;
+    // negotiated with HELLO; set on the reactor thread, read by senders
+    atomic<bool> compression{false};
+    atomic<bool> delta{false};
+    atomic<bool> multicast{false};
+    // frames are staged by the server and shown on DISPLAY_NOW
+    atomic<bool> staged{false};
+    // estimated from DISPLAY_NOW headers, on the reactor thread
+    ClockOffsetEstimate clock_offset;
+    // server: the client answers clock pings, which measure its clock
+    atomic<bool> clock{false};
+    ClockSync clock_sync;
+    // when to ping next (reactor thread)
+    SteadyClock::time_point next_clock_ping;
+    // the remote ACKs every IMAGE; a client holds its next frame back while
+    // more than its window is unacknowledged (reactor thread, but for the
+    // counters, which stats() reads)
+    atomic<bool> ack{false};
+    struct InFlight {
+        uint32_t sequence;
+        size_t bytes;
+        SteadyClock::time_point sent;
+    };
+    deque<InFlight> in_flight;
+    atomic<long long> in_flight_bytes{0};
+    // smoothed as TCP does, 1/8 of each new sample
+    atomic<int64_t> round_trip_ns{0};
+    atomic<long> window_waits{0};
+    bool window_blocked = false;
+    // the header version sent; v2 once the remote said it reads it, while
+    // either version is always accepted
+    atomic<int> protocol_version{1};
+
+    // what the remote holds: the last IMAGE queued to it, as raw pixels,
+    // and how many IMAGE messages it has been sent (guarded by delta_mutex)
+    mutex delta_mutex;
+    FrameBuffer delta_reference;
+    uint32_t delta_reference_index = 0;
+    uint32_t images_sent = 0;
+    // the multicast frame id of the last IMAGE queued, 0 if it went over TCP
+    uint32_t last_frame_id = 0;
+    // at most one IMAGE waits to be written; a newer one replaces it.
+    // sent_reference is the last IMAGE taken for writing, which is what the
+    // remote holds if the waiting one is replaced (guarded by image_mutex)
+    mutex image_mutex;
+    MessageData * pending_image = nullptr;
+    FrameBuffer sent_reference;
+    uint32_t sent_reference_index = 0;
+    atomic<long> images_superseded{0};
+    int frames_since_key = 0;
+    long delta_frames = 0;
+    long full_frames = 0;
+    long multicast_frames = 0;
+    long long image_bytes_saved = 0;
+    // counts IMAGE messages received, on the reactor thread
+    uint32_t images_received = 0;
+    shared_ptr<ReceivedFrames> received_frames = make_shared<ReceivedFrames>();
+    // keeps the list of pending key/values to send; filled by application
+    // threads, drained by the reactor thread without locking. control
+    // messages are never dropped: once the ring is full they wait in
+    // send_overflow until it has room again
+    RingQueue<MessageData *> send_values{256};
+    mutex overflow_mutex;
+    deque<MessageData *> send_overflow;
+    atomic<bool> overflowing{false};
+    // popped from the queue, waiting for an older pending_image to go first
+    MessageData * next_control = nullptr;
+    atomic<uint64_t> next_sequence{0};
+    long control_overflows = 0;
+    size_t max_queue_depth = 0;
+
+    // incoming message being assembled; the header is read first, then
+    // the name and payload are read in place into 'receiving'
+    char header_buffer[MessageData::max_header_size];
+    size_t header_received = 0;
+    MessageData * receiving = nullptr;
+    size_t name_received = 0;
+    size_t data_received = 0;
+
+    // outgoing batch being written; survives short writes until the
+    // socket is writable again (only touched on the reactor thread)
+    vector<MessageData *> sending;
+    vector<string> sending_headers;
+    vector<iovec> sending_iov;
+    size_t sending_iov_index = 0;
+    size_t sending_bytes = 0;
+    long send_syscalls_in_batch = 0;
+    SteadyClock::time_point batch_begin;
+    bool want_writable = false;
+    // set while a wake is pending so repeated sends signal the reactor once
+    atomic<bool> wake_pending{false};
 
+    // send statistics, used to confirm small messages are being batched
+    long send_syscalls = 0;
+    long messages_sent = 0;
+    long long bytes_sent = 0;
+    ~Connection();
     void stop();
+    // the oldest queued message, control or IMAGE; nullptr while the next
+    // is an IMAGE the window holds back
     MessageData* next_send();
-    void send(MessageData * message_data);
+    // whether an IMAGE of 'bytes' may go out now
+    bool window_open(size_t bytes);
+    // pops queued messages to go out in one write; small messages are
+    // coalesced until their payloads reach max_payload_bytes
+    void next_send_batch(vector<MessageData *> & batch, size_t max_messages, size_t max_payload_bytes);
+    // queues a control message; returns false once the link is down
+    bool send(MessageData * message_data);
+    // makes 'image' the IMAGE waiting to be written (call with delta_mutex held)
+    void send_image(MessageData * image);
+    // takes back the IMAGE still waiting to be written, if any (with delta_mutex held)
+    MessageData * withdraw_image();
+    // messages queued and not yet taken for writing (approximate)
+    size_t queue_depth();
+    // reactor thread: the next control message, from the ring or its overflow
+    bool pop_control(MessageData *& message_data);
+    // releases everything queued or half written, e.g. once the link is lost
+    void release_pending();
+    // forgets the last link's queues, half read message and negotiated
+    // state, so a client can connect it again (off the reactor)
+    void reset();
+
+    void handle_events(uint32_t events) override;
+    void handle_wake() override;
 };
 
+// notifications are counted, so a notify that lands before wait() is not lost
 struct Waiter {
     mutex cv_mtx;
     condition_variable cv;
+    long pending = 0;
     
     void wait();
     cv_status wait_for(const Seconds& rel_time);
     void notify();
 };
 
-class Comm; // forward reference
+// ticks on the reactor thread while a server listens, to ping the
+// clients whose clocks it measures
+struct ClockTimer : public ReactorHandler {
+    Comm * comm = nullptr;
+    int timer_fd = -1;
+
+    void handle_events(uint32_t events) override;
+    void handle_wake() override {}
+};
+
+// server: a shared-memory client until it has asked for its slot size,
+// read as it arrives; its rings are made then, and it's dropped if it
+// takes longer than the timer gives it
+struct ShmHandshake : public ReactorHandler {
+    Comm * comm = nullptr;
+    SOCKET sock_fd = -1;
+    int timer_fd = -1;
+    ShmRequest request;
+    sockaddr_storage client_addr;
+    socklen_t sin_size = 0;
+
+    void handle_events(uint32_t events) override;
+    void handle_wake() override {}
+};
+
 typedef Comm * (*CommFactory)();
 
+// totals over the connections of a Comm, e.g. for LiveStats
+struct CommStats {
+    long long bytes_in = 0;
+    long long bytes_out = 0;
+    long messages_in = 0;
+    long messages_out = 0;
+    long connections = 0;
+    // received and waiting for next_received, and queued to send
+    long received_queue = 0;
+    long send_queue = 0;
+    long received_drops = 0;
+    long sends_dropped = 0;
+    long images_superseded = 0;
+    // with flow control: unacknowledged, the most of any connection's
+    // smoothed round trip, and frames held back for the window
+    long long in_flight_bytes = 0;
+    double round_trip = 0;
+    long window_waits = 0;
+};
+
 class Comm {
 public:
     Comm();
@@ -134,22 +424,77 @@ public:
         NON_BLOCKING
     };
     
-    // returns false if instance is already connected or connecting
+    // returns false if instance is already connected or connecting. a
+    // client keeps trying in the background, and connects again with
+    // backoff after losing its server, until disconnect()
     bool connect(Role role, const string & ip_address, const string & port);
     void set_waiter(Waiter * waiter);
     ConnectError connect_result();
+    // waits until connected or the deadline passes; true if connected
+    bool wait_connected(const SteadyClock::time_point & deadline);
     //  caller must dispose of the pointer
     MessageData * next_received();
+    // like next_received, but blocks until a message arrives or the deadline
+    // passes (then returns nullptr); meant for a render loop's frame deadline
+    MessageData * next_received_wait(const SteadyClock::time_point & deadline);
     void disconnect();
+    // while a client's link is down messages are dropped right away
+    // (SERVER_DISCONNECTED); the last frame is kept and sent on reconnect
     ConnectError send(MessageData * message_data, BlockType block=NON_BLOCKING);
-    void send_display_now(const string & image_name = "");
+    // commits the frames sent (and staged) so far, to be shown at the first
+    // frame boundary at or after present_at (the default: the next one);
+    // nothing is sent unless the server stages frames
+    void send_display_now(const string & image_name = "",
+                          const SteadyClock::time_point & present_at = SteadyClock::time_point());
+    // capture_time defaults to now
+    void send_image(const string & image_name, const FrameBuffer & image_data,
+                    const SteadyClock::time_point & capture_time = SteadyClock::time_point());
+    // copies image_data once into a FrameBuffer
     void send_image(const string & image_name, const string & image_data);
     void send_start_timer();
     void send_ack(const string & image_name);
+    // a client offers compression to its server (right away if already
+    // connected); a server accepts it from clients unless disabled.
+    // frame_width is the row length of the images passed to send_image
+    void set_compression(bool enable, int frame_width = 0);
+    // likewise for sending only the tile_size x tile_size tiles of a frame
+    // that changed since the last frame sent to the same remote
+    void set_delta(bool enable, int frame_width = 0, int tile_size = 16);
+    // a client has its server ACK every frame, and holds the next frame
+    // back while more than window_bytes are unacknowledged (newer frames
+    // replace it meanwhile), so a slow link never queues more than that
+    void set_flow_control(bool enable, size_t window_bytes = 1024 * 1024);
+    // a client asks its server to stage frames until send_display_now
+    // commits them, instead of showing each as it arrives
+    void set_staged(bool enable);
+    // the geometry v2 headers carry for images sent without their own
+    void set_frame_format(int width, int height, MessageData::PixelFormat pixel_format = MessageData::GRAY8);
+    // client: frames go out once through 'sender' (which may be shared by
+    // every Comm and must outlive them) to servers that joined its group,
+    // and only a reference to them goes over TCP; nullptr stops that
+    void set_multicast(MulticastSender * sender);
+    // server: receive frames sent to a multicast group; interface_address
+    // picks the interface to join on (127.0.0.1 to test on one box)
+    bool join_multicast(const string & group, const string & port, const string & interface_address = "");
     const string & ip() const;
     const string & port() const;
+    // safe to call from any thread, e.g. once a frame
+    CommStats stats();
+    const LatencyHistogram & display_now_histogram() const;
+    // from a frame being taken for writing to its ACK
+    const LatencyHistogram & round_trip_histogram() const;
+    // server: the clock of the (first) client measured by clock pings;
+    // not synchronized until a few have been answered
+    ClockSync::Estimate clock_estimate();
+    // server: the first multiple of 'period' on that client's clock after
+    // 'after', so every server of the client switches frames together;
+    // false while its clock isn't known
+    bool next_frame_boundary(const SteadyClock::time_point & after, const SteadyClock::duration & period,
+                             SteadyClock::time_point & boundary);
     
     static Comm * start_server(Waiter * waiter, int argc, char* argv[], CommFactory = nullptr);
+    // connects to every server at once and returns after a short grace
+    // period, whether or not they all answered; the rest keep retrying
     static list<Comm *> start_clients(Waiter * waiter, int argc, char* argv[], CommFactory = nullptr);
     static const string default_port;
 
@@ -160,10 +505,39 @@ protected:
     virtual void got_new_connection(const  sockaddr_storage& sin_addr, socklen_t sin_size);
 
 private:
+    friend struct Connection;
+    friend struct ClockTimer;
+    friend struct ShmHandshake;
+
     void execute_connect(Role pending_role, const string & ip_address, const string & port);
-    void execute_send(Connection * remote_connection);
-    void execute_receive(Connection * remote_connection);
+    // client: connects, waits for the link to drop, and connects again
+    void maintain_link(const string & ip_address, const string & port);
+    // logs how long after start (and after connecting) the first frame of
+    // a link went out or came in
+    void report_first_frame(const char * direction);
+    // reactor callbacks
+    void handle_events(Connection * connection, uint32_t events);
+    void accept_connections();
+    // queues what init_remote_connection made of an accepted socket; false
+    // if the server stops accepting
+    bool accept_remote_connection(Connection * remote_connection, SOCKET candidate_fd,
+                                  const sockaddr_storage & client_addr, socklen_t sin_size);
+    // a shared-memory client's slot size request, then its rings
+    void start_shm_handshake(SOCKET candidate_fd, const sockaddr_storage & client_addr, socklen_t sin_size);
+    void shm_handshake_ready(ShmHandshake * handshake);
+    void close_shm_handshakes();
+    void receive_ready(Connection * remote_connection);
+    void send_ready(Connection * remote_connection);
+    // reads what is available into the message being assembled; returns the recv result
+    long receive_some(Connection * remote_connection, MessageData *& completed);
+    // hands a complete incoming message to the application (or handles it here)
+    void message_received(Connection * remote_connection, MessageData * message_data);
+    // the same for a shared-memory link: reads its ring, then writes what's queued
+    void shm_ready(Connection * remote_connection, uint32_t events);
+    void shm_send_ready(Connection * remote_connection);
+    void connection_lost(Connection * remote_connection);
     void set_connect_error(ConnectError connect_error);
+    // hands a connected socket to the reactor
     void sendAndReceive(Connection * remote_connection);
     // returns false if failed; if true sock_fd = new socket
     bool create_socket(const string & ip_address, const string & port, SOCKET & sock_fd);
@@ -172,7 +546,40 @@ private:
     void close_one(Connection* remote_connection);
     void add_connection(Connection * remote_connection);
     RemoteConnectionResult init_remote_connection(Connection* remote_connection, SOCKET candidate_fd);
-    ConnectError send_one(Connection * remote_connection, MessageData * message_data);
+    // fills the connection's outgoing batch from its queue, building the
+    // header/payload iovecs for sendmsg
+    bool start_batch(Connection * remote_connection);
+    // writes as much of the batch as the socket takes; SEND_TIMEOUT means
+    // the socket is full and the rest goes out when it is writable again
+    ConnectError write_batch(Connection * remote_connection);
+    void finish_batch(Connection * remote_connection);
+    void release_sent(MessageData * message_data);
+    // picks delta, compressed or raw for one remote and queues the frame;
+    // 'encoded' holds the compressed frame once one connection needed it
+    // a resend is always a full frame over TCP, and never replaces or
+    // follows a newer frame: it's dropped (false) if one is waiting, or if
+    // 'resend_of' (a multicast frame id) isn't the last frame given the link.
+    // a frame larger than the link carries is dropped (false) too
+    bool queue_image(Connection * connection, MessageData * message_data, FrameBuffer & encoded, bool & encode_tried,
+                     bool resend = false, uint32_t resend_of = 0);
+    // replaces a multicast reference with the frame it names; false if that
+    // frame hasn't arrived, and a RESEND has been sent for it
+    bool resolve_reference(Connection * remote_connection, MessageData * message_data);
+    // a server missed a multicast frame: the link thread sends it again
+    void handle_resend(Connection * remote_connection, MessageData * message_data);
+    // on the link thread, as the reactor asked: the last frame again for a
+    // server that came back, and a multicast frame a server missed (0 none)
+    void send_again(Connection * connection, bool latest, uint32_t frame_id, const string & name);
+    void send_hello();
+    void handle_hello(Connection * remote_connection, MessageData * message_data);
+    // server: pings each client whose clock is due to be measured again
+    void send_clock_pings();
+    // a ping answered by a client, or a pong received by a server
+    void handle_clock(Connection * remote_connection, MessageData * message_data);
+    // server: acknowledges an IMAGE that arrived on an "ack" link
+    void send_image_ack(Connection * remote_connection, uint64_t sequence);
+    // client: frees the window up to 'message_data's sequence
+    void handle_image_ack(Connection * remote_connection, MessageData * message_data);
 
 private:
     string ip_address;
@@ -180,60 +587,144 @@ private:
     ConnectError connect_error = ConnectError::PENDING;
     thread * connect_thread = nullptr;
     mutex connect_result_mutex;
-    mutex received_values_mutex;
+    // signalled with connect_result_mutex whenever connect_error changes
+    condition_variable connect_cv;
+    atomic<bool> stopping{false};
+    long connect_attempts = 0;
+    long reconnects = 0;
+    SteadyClock::time_point connected_at;
+    atomic<bool> frame_since_connect{false};
+    // a client's last frame, sent again once a lost link is back
+    mutex latest_image_mutex;
+    unique_ptr<MessageData> latest_image;
+    atomic<bool> resend_latest{false};
+    // frames the reactor wants sent again; a client's link thread encodes
+    // and queues them, not the reactor (guarded by connect_result_mutex)
+    bool latest_wanted = false;
+    uint32_t resend_wanted = 0;
+    string resend_wanted_name;
+    atomic<long> sends_dropped{0};
     mutex remote_connections_mutex;
     Role role = Comm::Role::CLIENT;
     Connection local_connection;
+    // the name in a "shm:name" address, empty for TCP
+    string shm_name;
     Waiter * waiter = nullptr;
     MessageState message_state = MessageState::WAITING;
     SteadyClock::time_point receive_begin;
+    // between DISPLAY_NOW messages
+    LatencyHistogram display_now_intervals;
+    ClockTimer clock_timer;
+    // shared-memory clients still to ask for their slot size
+    mutex shm_handshakes_mutex;
+    list<ShmHandshake *> shm_handshakes;
+
+    // keeps the list of incoming values; pushed by the reactor, popped by
+    // the application, and each push is signalled on received_fd (an eventfd)
+    RingQueue<MessageData *> received_values{1024};
+    int received_fd = -1;
+    atomic<long> received_drops{0};
+
+    // for stats(); added to by the reactor thread
+    atomic<long long> total_bytes_in{0};
+    atomic<long long> total_bytes_out{0};
+    atomic<long> total_messages_in{0};
+    atomic<long> total_messages_out{0};
 
-    // keeps the list of incoming values
-    deque<MessageData *> received_values;
+    atomic<bool> compression_offered{false};
+    atomic<bool> compression_accepted{true};
+    atomic<bool> delta_offered{false};
+    atomic<bool> delta_accepted{true};
+    atomic<bool> staged_offered{false};
+    atomic<bool> ack_offered{false};
+    atomic<bool> ack_accepted{true};
+    atomic<size_t> ack_window{1024 * 1024};
+    LatencyHistogram ack_round_trips;
+    atomic<int> delta_tile_size{16};
+    atomic<int> frame_width{0};
+    atomic<int> frame_height{0};
+    atomic<int> frame_format{MessageData::UNKNOWN_FORMAT};
+
+    atomic<MulticastSender *> multicast_sender{nullptr};
+    atomic<MulticastReceiver *> multicast_receiver{nullptr};
+    long multicast_misses = 0;
 
     list<Connection *> remote_connections;
     list<Connection*> deleted_remote_connections;
 };
 
-struct SD {
-    static const long warm_up = 300;
-    
-    long count = 0;
-    SteadyClock::time_point last;
-    double mean = 0;
-    double sum_squares = 0;
-    mutex sd_mutex;
-    deque<double> sd_q;
-    
-    double increment(const SteadyClock::time_point & current);
-    double increment(const SteadyClock::time_point & current, const SteadyClock::time_point & previous);
-    double increment(const Seconds & seconds);
-    void dump(ofstream & out, const string & label);
-};
+typedef void (*DisplayFunction)(const FrameBuffer & image_data);
 
-typedef void (*DisplayFunction)(const string & image_data);
+// a committed frame, handed out at the frame boundary it is due
+struct Presentation {
+    MessageData * image = nullptr;
+    // zero: the first frame boundary after the commit
+    SteadyClock::time_point present_at;
+    SteadyClock::time_point committed_at;
+};
 
+// staged presentation on the server: frames are sent ahead and wait here
+// until a DISPLAY_NOW commits the newest of them, to be shown at the first
+// frame boundary at or after the time it names. the transfer is then off
+// the critical path, and every display given the same time switches
+// together. the render loop takes commits with take_due(); execute_display
+// is the same for a thread showing frames through display_function
 struct Display {
-    map<string, MessageData *> pending_images;
-    deque<string> images_to_display;
+    // frames staged and not committed yet; the oldest goes past this
+    static constexpr size_t max_staged = 4;
+
+    Display() = default;
+    Display(const Display &) = delete;
+    Display & operator=(const Display &) = delete;
+    ~Display();
+
+    // takes ownership
+    void stage(MessageData * image);
+    // commits the newest staged frame, dropping older ones; false (a miss)
+    // if nothing was staged since the last commit
+    bool commit(const SteadyClock::time_point & present_at, const string & image_name = "");
+    // the newest commit due by 'boundary', which the caller then owns; any
+    // older ones due as well are skipped
+    bool take_due(const SteadyClock::time_point & boundary, Presentation & presentation);
+    // the frame taken reached the screen at 'shown'
+    void presented(const Presentation & presentation, const SteadyClock::time_point & shown);
+    // how late a frame may be shown before it counts as late
+    void set_frame_period(Seconds frame_period);
+    size_t staged_count();
+
+    void dump(ostream & out);
+    void execute_display();
+    void stop();
+    void set_display_function(DisplayFunction display_function);
+
+    atomic<long> staged_total{0};
+    // staged but never committed, as newer frames were
+    atomic<long> superseded{0};
+    atomic<long> commits{0};
+    // a DISPLAY_NOW with nothing staged
+    atomic<long> commit_misses{0};
+    // committed but replaced at the boundary by a newer commit also due
+    atomic<long> skipped{0};
+    atomic<long> presented_count{0};
+    // shown more than a frame period after present_at
+    atomic<long> late{0};
+    // from the DISPLAY_NOW arriving to the frame on the screen
+    LatencyHistogram commit_to_photon;
+    // how far after present_at frames were shown
+    LatencyHistogram present_error;
+    // between frames handed to display_function, and how long it took
+    LatencyHistogram fwrite_intervals;
+    LatencyHistogram display_times;
+
+private:
     mutex queues_mutex;
+    // signalled with queues_mutex on commit and stop
+    condition_variable commit_cv;
+    deque<MessageData *> staged;
+    deque<Presentation> committed;
     bool keep_going = true;
-    
-    long video_buffer_size;
-    thread * display_thread = nullptr;
-    long display_q_count = 0;
-    long display_count = 0;
-    long pending_q_count = 0;
-    long name_not_found_count = 0;
+    Seconds frame_period{1.0 / 30};
     DisplayFunction display_function = nullptr;
-    SD fwrite_sd;
-    SD display_sd;
-    
-    void queue_image_for_display(MessageData * message_data);
-    void dump(ofstream & out);
-    void image_should_be_displayed(string image_name);
-    void execute_display();
-    void set_display_function(DisplayFunction display_function);
 };
 
 
@@ -0,0 +1,209 @@
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <new>
+
+#include "frame_buffer.h"
+#include "logger.h"
+
+// frames the pool couldn't hold
+static atomic<long> heap_frame_allocations{0};
+
+// heap frames keep the header and the bytes in one allocation
+static void release_heap_storage(FrameStorage * storage) {
+    storage->~FrameStorage();
+    ::operator delete(storage);
+}
+
+FrameBuffer FrameBuffer::allocate(size_t size) {
+    FrameStorage * pooled = FramePool::instance().take(size);
+    if (pooled) {
+        return adopt(pooled, size);
+    }
+    if (size >= FramePool::min_frame) {
+        heap_frame_allocations.fetch_add(1, memory_order_relaxed);
+    }
+
+    void * block = ::operator new(sizeof(FrameStorage) + size);
+    FrameStorage * storage = new (block) FrameStorage;
+    storage->capacity = size;
+    storage->data = static_cast<char *>(block) + sizeof(FrameStorage);
+    storage->release = release_heap_storage;
+    return adopt(storage, size);
+}
+
+FrameBuffer FrameBuffer::copy_of(const void * data, size_t size) {
+    FrameBuffer frame = allocate(size);
+    if (size > 0) {
+        memcpy(frame.writable_data(), data, size);
+    }
+    return frame;
+}
+
+FrameBuffer FrameBuffer::copy_of(const string & data) {
+    return copy_of(data.data(), data.size());
+}
+
+FrameBuffer FrameBuffer::adopt(FrameStorage * storage, size_t size) {
+    FrameBuffer frame;
+    frame.storage = storage;
+    frame.length = size;
+    return frame;
+}
+
+FrameBuffer::FrameBuffer(const FrameBuffer & other) : storage(other.storage), length(other.length) {
+    if (storage) {
+        storage->references.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+FrameBuffer::FrameBuffer(FrameBuffer && other) noexcept : storage(other.storage), length(other.length) {
+    other.storage = nullptr;
+    other.length = 0;
+}
+
+FrameBuffer & FrameBuffer::operator=(const FrameBuffer & other) {
+    if (this != &other) {
+        if (other.storage) {
+            other.storage->references.fetch_add(1, memory_order_relaxed);
+        }
+        reset();
+        storage = other.storage;
+        length = other.length;
+    }
+    return *this;
+}
+
+FrameBuffer & FrameBuffer::operator=(FrameBuffer && other) noexcept {
+    if (this != &other) {
+        reset();
+        storage = other.storage;
+        length = other.length;
+        other.storage = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+FrameBuffer::~FrameBuffer() {
+    reset();
+}
+
+void FrameBuffer::reset() {
+    if (storage && storage->references.fetch_sub(1, memory_order_acq_rel) == 1) {
+        storage->release(storage);
+    }
+    storage = nullptr;
+    length = 0;
+}
+
+const char * FrameBuffer::data() const {
+    return storage ? storage->data : nullptr;
+}
+
+size_t FrameBuffer::size() const {
+    return length;
+}
+
+bool FrameBuffer::empty() const {
+    return length == 0;
+}
+
+int FrameBuffer::use_count() const {
+    return storage ? storage->references.load(memory_order_relaxed) : 0;
+}
+
+char * FrameBuffer::writable_data() {
+    return storage ? storage->data : nullptr;
+}
+
+FramePool & FramePool::instance() {
+    // lives until the process exits, as the frames taken from it may
+    static FramePool * pool = new FramePool;
+    return *pool;
+}
+
+bool FramePool::configure(size_t block_size, int blocks, bool huge_pages) {
+    lock_guard<mutex> guard(free_mutex);
+    if (block_count > 0) {
+        LOG_WARN("frame pool already configured with {} blocks of {}", block_count, block_bytes.load());
+        return false;
+    }
+    if (blocks <= 0 || block_size < min_frame) {
+        return false;
+    }
+
+    // blocks start on a page, and the mapping fills whole (huge) pages
+    const size_t page = 4096;
+    const size_t huge_page = 2 << 20;
+    size_t stride = (block_size + page - 1) / page * page;
+    size_t mapping_size = stride * blocks;
+    void * mapping = MAP_FAILED;
+    if (huge_pages) {
+        mapping_size = (mapping_size + huge_page - 1) / huge_page * huge_page;
+        mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        reserved_huge_pages = mapping != MAP_FAILED;
+        if (!reserved_huge_pages) {
+            LOG_INFO("no huge pages reserved for the frame pool ({}), asking for transparent ones", strerror(errno));
+        }
+    }
+    if (mapping == MAP_FAILED) {
+        // faulted in now, so the first frames through don't pay for it
+        mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            LOG_ERROR("frame pool of {} bytes couldn't be mapped {}", mapping_size, strerror(errno));
+            return false;
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge_pages) {
+            madvise(mapping, mapping_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    storages.reset(new FrameStorage[blocks]);
+    free_blocks.reserve(blocks);
+    for (int i = blocks - 1; i >= 0; i--) {
+        FrameStorage & storage = storages[i];
+        storage.capacity = block_size;
+        storage.data = static_cast<char *>(mapping) + stride * i;
+        storage.release = release;
+        storage.owner = this;
+        free_blocks.push_back(&storage);
+    }
+    block_bytes = block_size;
+    block_count = blocks;
+    LOG_INFO("frame pool of {} blocks of {} bytes huge_pages:{}", blocks, block_size, reserved_huge_pages);
+    return true;
+}
+
+FrameStorage * FramePool::take(size_t size) {
+    if (size < min_frame || size > block_bytes) {
+        return nullptr;
+    }
+    FrameStorage * storage;
+    {
+        lock_guard<mutex> guard(free_mutex);
+        if (free_blocks.empty()) {
+            exhausted_count += 1;
+            return nullptr;
+        }
+        storage = free_blocks.back();
+        free_blocks.pop_back();
+    }
+    used += 1;
+    storage->references.store(1, memory_order_relaxed);
+    return storage;
+}
+
+void FramePool::release(FrameStorage * storage) {
+    FramePool * pool = static_cast<FramePool *>(storage->owner);
+    pool->used -= 1;
+    lock_guard<mutex> guard(pool->free_mutex);
+    pool->free_blocks.push_back(storage);
+}
+
+long FramePool::frame_allocations() {
+    return heap_frame_allocations.load(memory_order_relaxed);
+}
@@ -0,0 +1,106 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// header in front of the bytes of one frame, shared by all of its
+// FrameBuffer handles; 'release' hands it back to whoever provided it
+// once the last handle is gone
+struct FrameStorage {
+    atomic<int> references{1};
+    size_t capacity = 0;
+    char * data = nullptr;
+    void (*release)(FrameStorage * storage) = nullptr;
+    void * owner = nullptr;
+};
+
+// immutable, reference-counted frame payload; copying a FrameBuffer
+// copies the handle, not the pixels, so one capture can be queued to
+// any number of connections
+class FrameBuffer {
+public:
+    FrameBuffer() = default;
+    FrameBuffer(const FrameBuffer & other);
+    FrameBuffer(FrameBuffer && other) noexcept;
+    FrameBuffer & operator=(const FrameBuffer & other);
+    FrameBuffer & operator=(FrameBuffer && other) noexcept;
+    ~FrameBuffer();
+
+    // uninitialized bytes, to be filled through writable_data(): from the
+    // FramePool when it has a block for them, otherwise on the heap
+    static FrameBuffer allocate(size_t size);
+    static FrameBuffer copy_of(const void * data, size_t size);
+    static FrameBuffer copy_of(const string & data);
+    // takes over storage that already holds one reference
+    static FrameBuffer adopt(FrameStorage * storage, size_t size);
+
+    const char * data() const;
+    size_t size() const;
+    bool empty() const;
+    int use_count() const;
+    // only for the producer while it holds the sole handle, e.g. while the
+    // frame is being received; the contents must not change once shared
+    char * writable_data();
+
+private:
+    void reset();
+
+    FrameStorage * storage = nullptr;
+    size_t length = 0;
+};
+
+// blocks of one size (a frame's) mapped once and reused, so a steady
+// stream of frames allocates nothing: FrameBuffer::allocate takes a block
+// when one is free and big enough, and the last handle gives it back. the
+// mapping can be in huge pages, so walking a frame touches one TLB entry
+// rather than hundreds. frames the pool can't hold come from the heap as
+// before and are counted, so a frame_allocations that stops growing shows
+// the steady state allocates nothing.
+class FramePool {
+public:
+    // smaller payloads are control messages: left to the heap, not counted
+    static const size_t min_frame = 4096;
+
+    static FramePool & instance();
+
+    // maps 'blocks' blocks of 'block_size' bytes, once, before frames are
+    // allocated; in huge pages when asked for, reserved ones if there are
+    // any, else transparent ones. false if the memory couldn't be mapped
+    bool configure(size_t block_size, int blocks, bool huge_pages);
+    // a block for 'size' bytes holding one reference, or nullptr if it
+    // doesn't fit or every block is in use
+    FrameStorage * take(size_t size);
+
+    size_t block_size() const { return block_bytes.load(); }
+    int blocks() const { return static_cast<int>(block_count); }
+    int in_use() const { return used.load(); }
+    // whether the blocks are in reserved huge pages
+    bool huge_pages() const { return reserved_huge_pages; }
+    // frames turned away because every block was in use
+    long exhausted() const { return exhausted_count.load(); }
+    // frames of min_frame bytes or more allocated on the heap
+    static long frame_allocations();
+
+private:
+    FramePool() = default;
+    static void release(FrameStorage * storage);
+
+    mutex free_mutex;
+    vector<FrameStorage *> free_blocks;
+    unique_ptr<FrameStorage[]> storages;
+    // 0 until configured
+    atomic<size_t> block_bytes{0};
+    size_t block_count = 0;
+    bool reserved_huge_pages = false;
+    atomic<int> used{0};
+    atomic<long> exhausted_count{0};
+};
+
+#endif //FRAME_BUFFER_H
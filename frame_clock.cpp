@@ -0,0 +1,80 @@
+#include <sys/prctl.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "frame_clock.h"
+#include "logger.h"
+
+// tells the core it's in a spin loop (less power, and on SMT the sibling
+// thread runs faster)
+static inline void spin_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+FrameClock::FrameClock(SteadyClock::duration period, SteadyClock::duration spin)
+    : frame_period(std::max(period, SteadyClock::duration(1))),
+      spin_time(std::max(spin, SteadyClock::duration::zero())) {
+    // a sleeping thread is otherwise woken up to 50us late, to batch wake ups
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) != 0) {
+        LOG_WARN("frame clock: timer slack not reduced: {}", strerror(errno));
+    }
+    start();
+}
+
+void FrameClock::start() {
+    start(SteadyClock::now() + frame_period);
+}
+
+void FrameClock::start(const SteadyClock::time_point & first_deadline) {
+    next_deadline = first_deadline;
+}
+
+FrameClock::SteadyClock::time_point FrameClock::wait_next() {
+    SteadyClock::time_point deadline = next_deadline;
+    next_deadline += frame_period;
+    if (!wait_until(deadline)) {
+        // late: carry on now, and on to the next boundary still ahead
+        auto now = SteadyClock::now();
+        if (now >= next_deadline) {
+            auto behind = (now - next_deadline) / frame_period + 1;
+            next_deadline += behind * frame_period;
+            skipped_count += static_cast<long>(behind);
+        }
+    }
+    return deadline;
+}
+
+bool FrameClock::wait_until(const SteadyClock::time_point & deadline) {
+    auto now = SteadyClock::now();
+    if (now >= deadline) {
+        overrun_count += 1;
+        return false;
+    }
+
+    // the steady clock is CLOCK_MONOTONIC, so its time points are the
+    // absolute times clock_nanosleep takes
+    auto wake = deadline - spin_time;
+    if (wake > now) {
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(wake.time_since_epoch()).count();
+        timespec until;
+        until.tv_sec = nanoseconds / 1000000000;
+        until.tv_nsec = nanoseconds % 1000000000;
+        int result;
+        while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr)) == EINTR) {
+        }
+        if (result != 0) {
+            LOG_ERROR("frame clock: sleep failed {}", strerror(result));
+        }
+    }
+    while ((now = SteadyClock::now()) < deadline) {
+        spin_pause();
+    }
+    jitter.record(now, deadline);
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef FRAME_CLOCK_H
+#define FRAME_CLOCK_H
+
+#include <chrono>
+#include <atomic>
+
+#include "latency_histogram.h"
+
+using namespace std;
+
+// paces a loop on absolute deadlines: the thread sleeps with
+// clock_nanosleep(TIMER_ABSTIME) on the steady clock's CLOCK_MONOTONIC
+// until 'spin' before a deadline, then spins for the rest, so the wake up
+// neither drifts (each deadline is the last plus the period, not "now" plus
+// it) nor pays the scheduler's wake up latency in full. how late each wake
+// up was is kept, and a deadline already past when waited for counts as an
+// overrun; the loop then skips to the next boundary still ahead, keeping
+// its phase. the constructor cuts the calling thread's timer slack to 1ns,
+// which also sharpens other timed waits it makes (ppoll, condition waits)
+class FrameClock {
+public:
+    typedef std::chrono::steady_clock SteadyClock;
+
+    FrameClock(SteadyClock::duration period, SteadyClock::duration spin = SteadyClock::duration::zero());
+
+    SteadyClock::duration period() const { return frame_period; }
+    SteadyClock::duration spin() const { return spin_time; }
+
+    // the first deadline is a period from now
+    void start();
+    void start(const SteadyClock::time_point & first_deadline);
+    // the deadline wait_next() waits for
+    SteadyClock::time_point deadline() const { return next_deadline; }
+
+    // waits for the next deadline and moves on to the one a period after
+    // it; returns the deadline waited for (the boundary skipped to after an
+    // overrun)
+    SteadyClock::time_point wait_next();
+    // waits for 'deadline' (for loops with deadlines of their own); false,
+    // and counted as an overrun, if it had already passed
+    bool wait_until(const SteadyClock::time_point & deadline);
+
+    // how late each wake up was, after the deadline
+    const LatencyHistogram & wake_jitter() const { return jitter; }
+    long overruns() const { return overrun_count.load(); }
+    // deadlines skipped by overruns, as frames
+    long skipped() const { return skipped_count.load(); }
+
+private:
+    SteadyClock::duration frame_period;
+    SteadyClock::duration spin_time;
+    SteadyClock::time_point next_deadline;
+
+    LatencyHistogram jitter;
+    atomic<long> overrun_count{0};
+    atomic<long> skipped_count{0};
+};
+
+#endif //FRAME_CLOCK_H
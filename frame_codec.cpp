@@ -0,0 +1,403 @@
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "frame_codec.h"
+
+using namespace std;
+
+static const int encoded_header_size = 16;  // magic(3) + version(1) + width(4) + height(4) + raw size(4)
+static const uint8_t codec_version = 1;
+static const int block_size = 32;
+static const int zero_block = 15;    // block parameter meaning 'every residual is zero'
+static const int escape_length = 16; // unary prefixes this long are followed by the raw value
+
+static const int delta_header_size = 20;  // magic(3) + version(1) + width(4) + height(4) + tile size(4) + reference index(4)
+static const uint8_t delta_version = 1;
+
+struct BitWriter {
+    uint8_t * out;
+    size_t position = 0;
+    uint64_t accumulator = 0;
+    int bits = 0;
+
+    // count <= 32
+    inline void put(uint32_t value, int count) {
+        accumulator = (accumulator << count) | value;
+        bits += count;
+        while (bits >= 8) {
+            bits -= 8;
+            out[position++] = static_cast<uint8_t>(accumulator >> bits);
+        }
+    }
+
+    void flush() {
+        if (bits > 0) {
+            out[position++] = static_cast<uint8_t>(accumulator << (8 - bits));
+            bits = 0;
+        }
+    }
+};
+
+struct BitReader {
+    const uint8_t * in;
+    size_t size;
+    size_t position = 0;
+    uint64_t window = 0;  // next bits, most significant first
+    int bits = 0;
+
+    inline void refill() {
+        while (bits <= 56) {
+            uint64_t next = position < size ? in[position] : 0;
+            window |= next << (56 - bits);
+            position += 1;
+            bits += 8;
+        }
+    }
+
+    inline uint32_t get(int count) {
+        if (count == 0) {
+            return 0;
+        }
+        refill();
+        uint32_t value = static_cast<uint32_t>(window >> (64 - count));
+        window <<= count;
+        bits -= count;
+        return value;
+    }
+
+    // counts leading one bits and consumes the terminating zero, up to limit
+    inline int unary(int limit) {
+        refill();
+        uint64_t inverted = ~window;
+        int ones = inverted ? __builtin_clzll(inverted) : 64;
+        if (ones >= limit) {
+            window <<= limit;
+            bits -= limit;
+            return limit;
+        }
+        window <<= ones + 1;
+        bits -= ones + 1;
+        return ones;
+    }
+
+    bool overrun() const {
+        // refill reads ahead by up to 8 bytes of padding
+        return position > size + 8;
+    }
+};
+
+static inline void put_u32(uint8_t * out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+static inline uint32_t get_u32(const uint8_t * in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+// LOCO-I median edge detector: a = left, b = up, c = up-left
+static inline int predict(int a, int b, int c) {
+    int low = a < b ? a : b;
+    int high = a < b ? b : a;
+    if (c >= high) {
+        return low;
+    }
+    if (c <= low) {
+        return high;
+    }
+    return a + b - c;
+}
+
+static inline int prediction_at(const uint8_t * row, const uint8_t * previous_row, int x) {
+    if (previous_row == nullptr) {
+        return x == 0 ? 128 : row[x - 1];
+    }
+    if (x == 0) {
+        return previous_row[0];
+    }
+    return predict(row[x - 1], previous_row[x], previous_row[x - 1]);
+}
+
+// maps residuals -128..127 to 0..255 so small magnitudes get short codes
+static inline uint8_t zigzag(uint8_t residual) {
+    uint32_t sign = residual & 0x80 ? 0xff : 0;
+    return static_cast<uint8_t>((static_cast<uint32_t>(residual) << 1) ^ sign);
+}
+
+static inline uint8_t unzigzag(uint32_t value) {
+    return static_cast<uint8_t>((value >> 1) ^ (0 - (value & 1)));
+}
+
+static void encode_block(BitWriter & writer, const uint8_t * values, int count) {
+    uint32_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    if (sum == 0) {
+        writer.put(zero_block, 4);
+        return;
+    }
+
+    // Rice parameter close to log2 of the mean residual
+    int k = 0;
+    while (k < 7 && (static_cast<uint32_t>(count) << (k + 1)) <= sum) {
+        k += 1;
+    }
+    writer.put(k, 4);
+
+    for (int i = 0; i < count; i++) {
+        uint32_t value = values[i];
+        uint32_t quotient = value >> k;
+        if (quotient < static_cast<uint32_t>(escape_length)) {
+            writer.put(((1u << quotient) - 1) << 1, quotient + 1);
+            if (k > 0) {
+                writer.put(value & ((1u << k) - 1), k);
+            }
+        }
+        else {
+            writer.put((1u << escape_length) - 1, escape_length);
+            writer.put(value, 8);
+        }
+    }
+}
+
+static void decode_block(BitReader & reader, uint8_t * values, int count) {
+    int k = reader.get(4);
+    if (k == zero_block) {
+        memset(values, 0, count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        int quotient = reader.unary(escape_length);
+        if (quotient == escape_length) {
+            values[i] = static_cast<uint8_t>(reader.get(8));
+        }
+        else {
+            values[i] = static_cast<uint8_t>((quotient << k) | reader.get(k));
+        }
+    }
+}
+
+bool encode_frame(const char * data, size_t size, int width, FrameBuffer & encoded) {
+    encoded = FrameBuffer();
+    if (size == 0 || size > UINT32_MAX) {
+        return false;
+    }
+    if (width <= 0 || size % width != 0) {
+        // unknown geometry: code it as one long row
+        width = static_cast<int>(size);
+    }
+    int height = static_cast<int>(size / width);
+
+    // give up as soon as the output stops being smaller than the input;
+    // the scratch space is kept per thread so steady state doesn't allocate
+    thread_local vector<uint8_t> scratch;
+    size_t limit = size;
+    scratch.resize(size + block_size * 3 + 64);
+
+    BitWriter writer;
+    writer.out = scratch.data();
+    writer.position = encoded_header_size;
+
+    const uint8_t * pixels = reinterpret_cast<const uint8_t *>(data);
+    uint8_t block[block_size];
+    int filled = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t * row = pixels + static_cast<size_t>(y) * width;
+        const uint8_t * previous_row = y > 0 ? row - width : nullptr;
+        for (int x = 0; x < width; x++) {
+            block[filled++] = zigzag(static_cast<uint8_t>(row[x] - prediction_at(row, previous_row, x)));
+            if (filled == block_size) {
+                encode_block(writer, block, filled);
+                filled = 0;
+                if (writer.position >= limit) {
+                    return false;
+                }
+            }
+        }
+    }
+    if (filled > 0) {
+        encode_block(writer, block, filled);
+    }
+    writer.flush();
+    if (writer.position >= limit) {
+        return false;
+    }
+
+    uint8_t * header = scratch.data();
+    header[0] = 'M';
+    header[1] = 'R';
+    header[2] = 'C';
+    header[3] = codec_version;
+    put_u32(header + 4, static_cast<uint32_t>(width));
+    put_u32(header + 8, static_cast<uint32_t>(height));
+    put_u32(header + 12, static_cast<uint32_t>(size));
+
+    encoded = FrameBuffer::copy_of(scratch.data(), writer.position);
+    return true;
+}
+
+bool decode_frame(const char * data, size_t size, size_t max_size, FrameBuffer & decoded) {
+    decoded = FrameBuffer();
+    const uint8_t * in = reinterpret_cast<const uint8_t *>(data);
+    if (size < static_cast<size_t>(encoded_header_size) || in[0] != 'M' || in[1] != 'R' || in[2] != 'C' || in[3] != codec_version) {
+        return false;
+    }
+    uint32_t width = get_u32(in + 4);
+    uint32_t height = get_u32(in + 8);
+    uint32_t raw_size = get_u32(in + 12);
+    // the sizes come from the peer; nothing is allocated for more than the
+    // caller expects
+    if (width == 0 || static_cast<uint64_t>(width) * height != raw_size || raw_size > max_size) {
+        return false;
+    }
+
+    FrameBuffer frame = FrameBuffer::allocate(raw_size);
+    uint8_t * pixels = reinterpret_cast<uint8_t *>(frame.writable_data());
+
+    BitReader reader;
+    reader.in = in + encoded_header_size;
+    reader.size = size - encoded_header_size;
+
+    uint8_t block[block_size];
+    int available = 0;
+    int next = 0;
+    size_t remaining = raw_size;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t * row = pixels + static_cast<size_t>(y) * width;
+        const uint8_t * previous_row = y > 0 ? row - width : nullptr;
+        for (uint32_t x = 0; x < width; x++) {
+            if (next == available) {
+                available = remaining < static_cast<size_t>(block_size) ? static_cast<int>(remaining) : block_size;
+                decode_block(reader, block, available);
+                remaining -= available;
+                next = 0;
+                if (reader.overrun()) {
+                    return false;
+                }
+            }
+            row[x] = static_cast<uint8_t>(prediction_at(row, previous_row, x) + unzigzag(block[next++]));
+        }
+    }
+
+    decoded = frame;
+    return true;
+}
+
+bool encode_delta(const char * data, const char * reference, size_t size, int width, int tile_size,
+                  uint32_t reference_index, FrameBuffer & delta) {
+    delta = FrameBuffer();
+    if (size == 0 || size > UINT32_MAX || tile_size <= 0 || width <= 0 || size % width != 0) {
+        return false;
+    }
+    int height = static_cast<int>(size / width);
+    int tiles_across = (width + tile_size - 1) / tile_size;
+    int tiles_down = (height + tile_size - 1) / tile_size;
+    size_t bitmap_size = (static_cast<size_t>(tiles_across) * tiles_down + 7) / 8;
+
+    thread_local vector<uint8_t> scratch;
+    size_t limit = size;
+    scratch.assign(delta_header_size + bitmap_size, 0);
+    scratch.reserve(size + delta_header_size + bitmap_size);
+
+    int tile = 0;
+    for (int tile_y = 0; tile_y < height; tile_y += tile_size) {
+        int rows = min(tile_size, height - tile_y);
+        for (int tile_x = 0; tile_x < width; tile_x += tile_size, tile++) {
+            int columns = min(tile_size, width - tile_x);
+            size_t first = static_cast<size_t>(tile_y) * width + tile_x;
+
+            bool changed = false;
+            for (int row = 0; row < rows && !changed; row++) {
+                size_t offset = first + static_cast<size_t>(row) * width;
+                changed = memcmp(data + offset, reference + offset, columns) != 0;
+            }
+            if (!changed) {
+                continue;
+            }
+
+            if (scratch.size() + static_cast<size_t>(rows) * columns >= limit) {
+                return false;
+            }
+            scratch[delta_header_size + tile / 8] |= static_cast<uint8_t>(1 << (tile % 8));
+            for (int row = 0; row < rows; row++) {
+                const uint8_t * source = reinterpret_cast<const uint8_t *>(data) + first + static_cast<size_t>(row) * width;
+                scratch.insert(scratch.end(), source, source + columns);
+            }
+        }
+    }
+
+    uint8_t * header = scratch.data();
+    header[0] = 'M';
+    header[1] = 'R';
+    header[2] = 'D';
+    header[3] = delta_version;
+    put_u32(header + 4, static_cast<uint32_t>(width));
+    put_u32(header + 8, static_cast<uint32_t>(height));
+    put_u32(header + 12, static_cast<uint32_t>(tile_size));
+    put_u32(header + 16, reference_index);
+
+    delta = FrameBuffer::copy_of(scratch.data(), scratch.size());
+    return true;
+}
+
+bool apply_delta(const char * data, size_t size, const FrameBuffer & reference, uint32_t reference_index,
+                 FrameBuffer & frame) {
+    frame = FrameBuffer();
+    const uint8_t * in = reinterpret_cast<const uint8_t *>(data);
+    if (size < static_cast<size_t>(delta_header_size) || in[0] != 'M' || in[1] != 'R' || in[2] != 'D' || in[3] != delta_version) {
+        return false;
+    }
+    uint32_t width = get_u32(in + 4);
+    uint32_t height = get_u32(in + 8);
+    uint32_t tile_size = get_u32(in + 12);
+    if (get_u32(in + 16) != reference_index) {
+        return false;
+    }
+    if (width == 0 || tile_size == 0 || static_cast<uint64_t>(width) * height != reference.size()) {
+        return false;
+    }
+    // the sizes come from the peer, and a tile may be larger than the frame:
+    // the tile math is done in 64 bits so it can't wrap
+    uint64_t tiles_across = (static_cast<uint64_t>(width) + tile_size - 1) / tile_size;
+    uint64_t tiles_down = (static_cast<uint64_t>(height) + tile_size - 1) / tile_size;
+    size_t bitmap_size = static_cast<size_t>((tiles_across * tiles_down + 7) / 8);
+    if (size < delta_header_size + bitmap_size) {
+        return false;
+    }
+    const uint8_t * bitmap = in + delta_header_size;
+    const uint8_t * tiles = bitmap + bitmap_size;
+    const uint8_t * end = in + size;
+
+    // start from the reference, which may still be shared, and overwrite
+    // the tiles that changed
+    FrameBuffer rebuilt = FrameBuffer::copy_of(reference.data(), reference.size());
+    uint8_t * pixels = reinterpret_cast<uint8_t *>(rebuilt.writable_data());
+
+    uint64_t tile = 0;
+    for (uint64_t tile_y = 0; tile_y < height; tile_y += tile_size) {
+        uint32_t rows = static_cast<uint32_t>(min<uint64_t>(tile_size, height - tile_y));
+        for (uint64_t tile_x = 0; tile_x < width; tile_x += tile_size, tile++) {
+            if ((bitmap[tile / 8] & (1 << (tile % 8))) == 0) {
+                continue;
+            }
+            uint32_t columns = static_cast<uint32_t>(min<uint64_t>(tile_size, width - tile_x));
+            if (static_cast<size_t>(end - tiles) < static_cast<size_t>(rows) * columns) {
+                return false;
+            }
+            for (uint32_t row = 0; row < rows; row++) {
+                memcpy(pixels + static_cast<size_t>(tile_y + row) * width + tile_x, tiles, columns);
+                tiles += columns;
+            }
+        }
+    }
+    if (tiles != end) {
+        return false;
+    }
+
+    frame = rebuilt;
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "frame_buffer.h"
+
+// lossless codec for 8-bit grayscale frames: every pixel is predicted
+// from its left, upper and upper-left neighbours (the LOCO-I median
+// predictor) and the residuals are written with Golomb-Rice codes whose
+// parameter adapts per block of 32 pixels; flat areas cost 4 bits a block
+
+// returns false (and leaves 'encoded' empty) if the frame doesn't shrink
+bool encode_frame(const char * data, size_t size, int width, FrameBuffer & encoded);
+
+// returns false if 'data' isn't a valid encoded frame, or would decode to
+// more than max_size bytes
+bool decode_frame(const char * data, size_t size, size_t max_size, FrameBuffer & decoded);
+
+// tile delta against a frame the receiver already holds: a bitmap of the
+// tile_size x tile_size tiles that differ from 'reference', followed by
+// their pixels. reference_index names that frame so the receiver can tell
+// whether it has it. returns false (and leaves 'delta' empty) if the delta
+// wouldn't be smaller than the frame itself
+bool encode_delta(const char * data, const char * reference, size_t size, int width, int tile_size,
+                  uint32_t reference_index, FrameBuffer & delta);
+
+// rebuilds a frame from a delta and the frame it was made against; returns
+// false if the delta is invalid or was made against another frame
+bool apply_delta(const char * data, size_t size, const FrameBuffer & reference, uint32_t reference_index,
+                 FrameBuffer & frame);
+
+#endif //FRAME_CODEC_H
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "latency_histogram.h"
+
+constexpr int LatencyHistogram::exact_bits;
+constexpr int LatencyHistogram::max_bits;
+constexpr int LatencyHistogram::bucket_count;
+
+// buckets per power of two above the exact ones
+static const int sub_buckets = 1 << (LatencyHistogram::exact_bits - 1);
+
+static void store_min(atomic<uint64_t> & target, uint64_t value) {
+    uint64_t current = target.load(memory_order_relaxed);
+    while (value < current && !target.compare_exchange_weak(current, value, memory_order_relaxed)) {
+    }
+}
+
+static void store_max(atomic<uint64_t> & target, uint64_t value) {
+    uint64_t current = target.load(memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, memory_order_relaxed)) {
+    }
+}
+
+int LatencyHistogram::bucket_of(uint64_t nanoseconds) {
+    if (nanoseconds < (1u << exact_bits)) {
+        return static_cast<int>(nanoseconds);
+    }
+    int top_bit = 63 - __builtin_clzll(nanoseconds);
+    if (top_bit >= max_bits) {
+        return bucket_count - 1;
+    }
+    // keeps the top exact_bits - 1 bits below the leading one
+    int shift = top_bit - (exact_bits - 1);
+    int sub_bucket = static_cast<int>(nanoseconds >> shift) - sub_buckets;
+    return (1 << exact_bits) + (shift - 1) * sub_buckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_top(int bucket) {
+    if (bucket < (1 << exact_bits)) {
+        return static_cast<uint64_t>(bucket);
+    }
+    int index = bucket - (1 << exact_bits);
+    int shift = index / sub_buckets + 1;
+    uint64_t leading = static_cast<uint64_t>(index % sub_buckets + sub_buckets);
+    return ((leading + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(const std::chrono::duration<double> & seconds) {
+    double nanoseconds = seconds.count() * 1e9;
+    record_nanoseconds(nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0);
+}
+
+void LatencyHistogram::record(const TimePoint & current, const TimePoint & previous) {
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(current - previous).count();
+    record_nanoseconds(nanoseconds > 0 ? static_cast<uint64_t>(nanoseconds) : 0);
+}
+
+void LatencyHistogram::record_nanoseconds(uint64_t nanoseconds) {
+    buckets[bucket_of(nanoseconds)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum_nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+    store_min(min_nanoseconds, nanoseconds);
+    store_max(max_nanoseconds, nanoseconds);
+}
+
+double LatencyHistogram::record_interval(const TimePoint & current) {
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(current.time_since_epoch()).count();
+    int64_t last = last_nanoseconds.exchange(now, memory_order_relaxed);
+    if (last == 0) {
+        return 0;
+    }
+    uint64_t interval = now > last ? static_cast<uint64_t>(now - last) : 0;
+    record_nanoseconds(interval);
+    return interval / 1e9;
+}
+
+void LatencyHistogram::mark(const TimePoint & current) {
+    last_nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(current.time_since_epoch()).count();
+}
+
+void LatencyHistogram::merge(const LatencyHistogram & other) {
+    for (int i = 0; i < bucket_count; i++) {
+        uint64_t samples = other.buckets[i].load(memory_order_relaxed);
+        if (samples > 0) {
+            buckets[i].fetch_add(samples, memory_order_relaxed);
+        }
+    }
+    total.fetch_add(other.total.load(memory_order_relaxed), memory_order_relaxed);
+    sum_nanoseconds.fetch_add(other.sum_nanoseconds.load(memory_order_relaxed), memory_order_relaxed);
+    store_min(min_nanoseconds, other.min_nanoseconds.load(memory_order_relaxed));
+    store_max(max_nanoseconds, other.max_nanoseconds.load(memory_order_relaxed));
+}
+
+void LatencyHistogram::reset() {
+    // samples recorded while this runs may be partly kept
+    for (int i = 0; i < bucket_count; i++) {
+        buckets[i].store(0, memory_order_relaxed);
+    }
+    total = 0;
+    sum_nanoseconds = 0;
+    min_nanoseconds = UINT64_MAX;
+    max_nanoseconds = 0;
+}
+
+uint64_t LatencyHistogram::count() const {
+    return total.load(memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t samples = count();
+    return samples == 0 ? 0 : sum_nanoseconds.load(memory_order_relaxed) / 1e9 / samples;
+}
+
+double LatencyHistogram::min() const {
+    return count() == 0 ? 0 : min_nanoseconds.load(memory_order_relaxed) / 1e9;
+}
+
+double LatencyHistogram::max() const {
+    return max_nanoseconds.load(memory_order_relaxed) / 1e9;
+}
+
+double LatencyHistogram::percentile(double percent) const {
+    // counted from the buckets themselves, which a concurrent record()
+    // may not have reached yet
+    uint64_t samples = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        samples += buckets[i].load(memory_order_relaxed);
+    }
+    if (samples == 0) {
+        return 0;
+    }
+
+    double fraction = std::min(std::max(percent, 0.0), 100.0) / 100.0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * samples)));
+    uint64_t seen = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+        if (seen >= rank) {
+            // the top of a bucket may lie past the largest sample in it, and
+            // the last bucket also holds everything longer
+            uint64_t largest = max_nanoseconds.load(memory_order_relaxed);
+            return (i == bucket_count - 1 ? largest : std::min(bucket_top(i), largest)) / 1e9;
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::dump(ostream & out, const string & label) const {
+    out << summary(label) << endl;
+}
+
+string LatencyHistogram::summary(const string & label) const {
+    ostringstream out;
+    out << label << " n:" << count() << " mean:" << mean() * 1e3 << " min:" << min() * 1e3
+        << " p50:" << percentile(50) * 1e3 << " p90:" << percentile(90) * 1e3
+        << " p99:" << percentile(99) * 1e3 << " p99.9:" << percentile(99.9) * 1e3
+        << " max:" << max() * 1e3 << " ms";
+    return out.str();
+}
@@ -0,0 +1,69 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+// durations counted into fixed log-linear buckets (as HDR histograms do):
+// exact below 32ns, then 16 buckets per power of two, so a percentile is
+// within 1/16 of the true value, up to about 18 minutes (longer ones land
+// in the last bucket). recording is a few relaxed atomic operations, from
+// any number of threads, and the memory used never grows.
+class LatencyHistogram {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    static constexpr int exact_bits = 5;
+    static constexpr int max_bits = 40;
+    static constexpr int bucket_count = (1 << exact_bits) + (max_bits - exact_bits) * (1 << (exact_bits - 1));
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram & operator=(const LatencyHistogram &) = delete;
+
+    void record(const std::chrono::duration<double> & seconds);
+    void record(const TimePoint & current, const TimePoint & previous);
+    void record_nanoseconds(uint64_t nanoseconds);
+    // records the time since the previous call (or mark()) and returns it
+    // in seconds; the first call only remembers 'current' and returns 0.
+    // meant for one thread, e.g. a loop timing its own iterations
+    double record_interval(const TimePoint & current);
+    // starts the next interval at 'current' without recording
+    void mark(const TimePoint & current);
+
+    // adds the samples of 'other' to this one
+    void merge(const LatencyHistogram & other);
+    void reset();
+
+    uint64_t count() const;
+    // in seconds; 0 while empty
+    double mean() const;
+    double min() const;
+    double max() const;
+    // the value 'percent' of the samples are at or below, e.g. 99.0
+    double percentile(double percent) const;
+    // one line: count, mean, min, p50, p90, p99, p99.9 and max in ms
+    void dump(ostream & out, const string & label) const;
+    // the same line, without the newline
+    string summary(const string & label) const;
+
+private:
+    static int bucket_of(uint64_t nanoseconds);
+    // the largest value counted into 'bucket'
+    static uint64_t bucket_top(int bucket);
+
+    atomic<uint64_t> buckets[bucket_count] = {};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sum_nanoseconds{0};
+    atomic<uint64_t> min_nanoseconds{UINT64_MAX};
+    atomic<uint64_t> max_nanoseconds{0};
+    // of the steady clock; 0 until the first interval starts
+    atomic<int64_t> last_nanoseconds{0};
+};
+
+#endif //LATENCY_HISTOGRAM_H
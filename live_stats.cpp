@@ -0,0 +1,243 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "live_stats.h"
+
+const int LiveStats::max_values;
+const size_t LiveStats::max_name;
+
+static const char stats_magic[4] = {'M', 'R', 'R', 'T'};
+static const uint32_t stats_version = 2;
+static const char stats_directory[] = "/dev/shm";
+static const char stats_prefix[] = "mrr_stats_";
+// a reader gives up after this many publishes overlapped its copy
+static const int read_attempts = 1000;
+
+struct StatsEntry {
+    char name[LiveStats::max_name + 1];
+    uint32_t kind;
+    uint32_t reserved;
+    atomic<int64_t> value;
+};
+
+struct StatsPage {
+    char magic[4];
+    uint32_t version;
+    // odd while a publish (or add) is writing the page
+    atomic<uint32_t> sequence;
+    atomic<uint32_t> value_count;
+    atomic<int64_t> published_ns;
+    atomic<uint64_t> publishes;
+    int32_t pid;
+    char reserved[20];
+    StatsEntry entries[LiveStats::max_values];
+};
+
+static_assert(atomic<int64_t>::is_always_lock_free, "shared memory needs address-free atomics");
+static_assert(sizeof(StatsEntry) == 64, "one entry per cache line");
+
+static string page_path(const string & name) {
+    return string(stats_directory) + "/" + stats_prefix + name;
+}
+
+// the writer's side of the seqlock: readers see an odd sequence, or a
+// different one after their copy, and try again
+static uint32_t begin_write(StatsPage * page) {
+    uint32_t sequence = page->sequence.load(memory_order_relaxed);
+    page->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return sequence;
+}
+
+static void end_write(StatsPage * page, uint32_t sequence) {
+    page->sequence.store(sequence + 2, memory_order_release);
+}
+
+LiveStats::~LiveStats() {
+    if (page) {
+        munmap(page, sizeof(StatsPage));
+        unlink(path.c_str());
+    }
+}
+
+bool LiveStats::open(const string & name) {
+    if (page || name.empty() || name.find('/') != string::npos) {
+        return false;
+    }
+
+    path = page_path(name);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "stats: can't create " << path << " " << strerror(errno) << endl;
+        return false;
+    }
+    if (ftruncate(fd, sizeof(StatsPage)) == -1) {
+        cerr << "stats: can't size " << path << " " << strerror(errno) << endl;
+        ::close(fd);
+        return false;
+    }
+    void * memory = mmap(nullptr, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        cerr << "stats: can't map " << path << " " << strerror(errno) << endl;
+        return false;
+    }
+
+    page = static_cast<StatsPage *>(memory);
+    // an earlier run may have left the page in the middle of a write
+    page->sequence.store(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(page->magic, stats_magic, sizeof(stats_magic));
+    page->version = stats_version;
+    page->pid = getpid();
+    page->published_ns.store(0, memory_order_relaxed);
+    page->publishes.store(0, memory_order_relaxed);
+    // values added before the page was opened
+    for (size_t i = 0; i < values.size(); i++) {
+        write_entry(static_cast<int>(i));
+    }
+    page->value_count.store(static_cast<uint32_t>(values.size()), memory_order_relaxed);
+    page->sequence.store(2, memory_order_release);
+    return true;
+}
+
+void LiveStats::write_entry(int index) {
+    StatsEntry & entry = page->entries[index];
+    memset(entry.name, 0, sizeof(entry.name));
+    memcpy(entry.name, names[index].data(), min(names[index].size(), max_name));
+    entry.kind = kinds[index];
+    entry.value.store(values[index], memory_order_relaxed);
+}
+
+int LiveStats::add(const string & name, StatKind kind) {
+    if (values.size() >= static_cast<size_t>(max_values)) {
+        cerr << "stats: no room for " << name << endl;
+        return -1;
+    }
+
+    int index = static_cast<int>(values.size());
+    names.push_back(name);
+    kinds.push_back(kind);
+    values.push_back(0);
+    if (page) {
+        uint32_t sequence = begin_write(page);
+        write_entry(index);
+        page->value_count.store(static_cast<uint32_t>(values.size()), memory_order_relaxed);
+        end_write(page, sequence);
+    }
+    return index;
+}
+
+void LiveStats::set(int index, int64_t value) {
+    if (index >= 0 && static_cast<size_t>(index) < values.size()) {
+        values[index] = value;
+    }
+}
+
+void LiveStats::publish() {
+    if (!page) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    uint32_t sequence = begin_write(page);
+    for (size_t i = 0; i < values.size(); i++) {
+        page->entries[i].value.store(values[i], memory_order_relaxed);
+    }
+    page->published_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), memory_order_relaxed);
+    page->publishes.fetch_add(1, memory_order_relaxed);
+    end_write(page, sequence);
+}
+
+LiveStatsReader::~LiveStatsReader() {
+    if (page) {
+        munmap(const_cast<StatsPage *>(page), sizeof(StatsPage));
+    }
+}
+
+vector<string> LiveStatsReader::list() {
+    vector<string> names;
+    DIR * directory = opendir(stats_directory);
+    if (!directory) {
+        return names;
+    }
+    size_t prefix_length = strlen(stats_prefix);
+    while (dirent * entry = readdir(directory)) {
+        if (strncmp(entry->d_name, stats_prefix, prefix_length) == 0) {
+            names.push_back(entry->d_name + prefix_length);
+        }
+    }
+    closedir(directory);
+    return names;
+}
+
+bool LiveStatsReader::open(const string & name) {
+    if (page) {
+        return false;
+    }
+
+    string path = page_path(name);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) == -1 || status.st_size < static_cast<off_t>(sizeof(StatsPage))) {
+        ::close(fd);
+        return false;
+    }
+    void * memory = mmap(nullptr, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    page = static_cast<const StatsPage *>(memory);
+    return true;
+}
+
+bool LiveStatsReader::read(StatsSnapshot & snapshot) const {
+    if (!page) {
+        return false;
+    }
+
+    for (int attempt = 0; attempt < read_attempts; attempt++) {
+        uint32_t sequence = page->sequence.load(memory_order_acquire);
+        if (sequence & 1) {
+            this_thread::yield();
+            continue;
+        }
+
+        if (memcmp(page->magic, stats_magic, sizeof(stats_magic)) != 0 || page->version != stats_version) {
+            return false;
+        }
+        uint32_t count = min<uint32_t>(page->value_count.load(memory_order_relaxed), LiveStats::max_values);
+        snapshot.pid = page->pid;
+        snapshot.published_ns = page->published_ns.load(memory_order_relaxed);
+        snapshot.publishes = page->publishes.load(memory_order_relaxed);
+        snapshot.names.resize(count);
+        snapshot.kinds.resize(count);
+        snapshot.values.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            const StatsEntry & entry = page->entries[i];
+            snapshot.names[i].assign(entry.name, strnlen(entry.name, sizeof(entry.name)));
+            snapshot.kinds[i] = static_cast<StatKind>(entry.kind);
+            snapshot.values[i] = entry.value.load(memory_order_relaxed);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (page->sequence.load(memory_order_relaxed) == sequence) {
+            return true;
+        }
+    }
+    return false;
+}
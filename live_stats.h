@@ -0,0 +1,89 @@
+#ifndef LIVE_STATS_H
+#define LIVE_STATS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// counters and gauges of one process, published in a page of shared
+// memory (/dev/shm/mrr_stats_<name>) that mrr_stat samples at whatever
+// rate it likes. the page is guarded by a seqlock: the one thread that
+// calls publish() writes it without waiting, and a reader copies it and
+// tries again if a publish overlapped the copy, so reading costs the
+// publishing loop nothing.
+
+enum StatKind : uint32_t {
+    // only grows; mrr_stat also shows its rate
+    STAT_COUNTER,
+    // a current level, e.g. a queue depth
+    STAT_GAUGE
+};
+
+struct StatsPage;
+
+class LiveStats {
+public:
+    // room for the server's own values and a gauge per render band, up to
+    // RenderPool::max_bands of them (8KB of page)
+    static const int max_values = 128;
+    static const size_t max_name = 47;
+
+    LiveStats() = default;
+    LiveStats(const LiveStats &) = delete;
+    LiveStats & operator=(const LiveStats &) = delete;
+    ~LiveStats();
+
+    // creates the page for 'name' (replacing one left by an earlier run);
+    // false if it can't, and the values are then only kept here
+    bool open(const string & name);
+    // a value to publish, named at most max_name characters; its index,
+    // or -1 once there are max_values
+    int add(const string & name, StatKind kind = STAT_COUNTER);
+    void set(int index, int64_t value);
+    // copies every value into the page as one consistent snapshot
+    void publish();
+
+private:
+    // with its sequence odd
+    void write_entry(int index);
+
+    StatsPage * page = nullptr;
+    string path;
+    vector<string> names;
+    vector<StatKind> kinds;
+    vector<int64_t> values;
+};
+
+// what a reader gets from the page
+struct StatsSnapshot {
+    int32_t pid = 0;
+    // steady clock, in nanoseconds, of the last publish
+    int64_t published_ns = 0;
+    uint64_t publishes = 0;
+    vector<string> names;
+    vector<StatKind> kinds;
+    vector<int64_t> values;
+};
+
+class LiveStatsReader {
+public:
+    LiveStatsReader() = default;
+    LiveStatsReader(const LiveStatsReader &) = delete;
+    LiveStatsReader & operator=(const LiveStatsReader &) = delete;
+    ~LiveStatsReader();
+
+    // the names of the pages in /dev/shm
+    static vector<string> list();
+    // maps the page of 'name' read-only; false if there is none
+    bool open(const string & name);
+    // false if no consistent copy could be made (the writer kept
+    // publishing throughout) or the page isn't open
+    bool read(StatsSnapshot & snapshot) const;
+
+private:
+    const StatsPage * page = nullptr;
+};
+
+#endif //LIVE_STATS_H
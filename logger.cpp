@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+typedef std::chrono::steady_clock SteadyClock;
+
+const size_t LogRecord::payload_size;
+
+// records per thread, a power of two
+static const size_t ring_capacity = 512;
+// how long records may wait before they are written, unless an error or
+// warning wakes the writer sooner
+static const std::chrono::milliseconds write_interval(20);
+static const char level_letters[] = "EWID";
+
+static int initial_level() {
+    const char * setting = getenv("MRR_LOG");
+    if (setting != nullptr) {
+        string level = setting;
+        if (level == "error") return LOG_LEVEL_ERROR;
+        if (level == "warn") return LOG_LEVEL_WARN;
+        if (level == "info") return LOG_LEVEL_INFO;
+        if (level == "debug") return LOG_LEVEL_DEBUG;
+    }
+    return MRR_LOG_LEVEL;
+}
+
+atomic<int> log_runtime_level{initial_level()};
+
+void log_set_level(int level) {
+    log_runtime_level = level;
+}
+
+// one thread's records, passed to the writer without locking: only that
+// thread moves head, and only the writer moves tail
+struct LogRing {
+    LogRecord records[ring_capacity];
+    alignas(64) atomic<uint64_t> head{0};
+    alignas(64) atomic<uint64_t> tail{0};
+    atomic<uint64_t> dropped{0};
+    // read by the writer alone
+    uint64_t dropped_reported = 0;
+    // the thread exited; the ring goes to the next new thread once drained
+    atomic<bool> retired{false};
+    uint32_t thread_number = 0;
+};
+
+class Logger {
+public:
+    Logger();
+
+    LogRing * register_thread();
+    void wake();
+    void flush();
+    void shutdown();
+    // for records written directly: once shut down, and on threads exiting
+    void write_now(const LogRecord & record);
+
+    atomic<bool> closed{false};
+    const SteadyClock::time_point start = SteadyClock::now();
+
+private:
+    void run();
+    void drain();
+    void format(const LogRecord & record, string & out) const;
+    void write_out(FILE * stream, string & buffer);
+
+    // rings are never freed, so the writer and flush() can hold them
+    // without a lock
+    mutex rings_mutex;
+    vector<LogRing *> rings;
+    uint32_t thread_count = 0;
+
+    mutex wake_mutex;
+    condition_variable wake_cv;
+    bool wake_pending = false;
+    bool stopping = false;
+    thread writer;
+
+    mutex output_mutex;
+};
+
+static void shutdown_logger();
+
+static Logger & logger() {
+    // never destroyed: threads may still log while the process exits
+    static Logger * instance = new Logger();
+    return *instance;
+}
+
+Logger::Logger() {
+    writer = thread(&Logger::run, this);
+    atexit(shutdown_logger);
+}
+
+LogRing * Logger::register_thread() {
+    lock_guard<mutex> guard(rings_mutex);
+    LogRing * ring = nullptr;
+    for (LogRing * candidate : rings) {
+        if (candidate->retired.load(memory_order_acquire) &&
+            candidate->tail.load(memory_order_acquire) == candidate->head.load(memory_order_relaxed)) {
+            ring = candidate;
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        ring = new LogRing();
+        rings.push_back(ring);
+    }
+    ring->thread_number = ++thread_count;
+    ring->retired.store(false, memory_order_relaxed);
+    return ring;
+}
+
+void Logger::wake() {
+    lock_guard<mutex> guard(wake_mutex);
+    wake_pending = true;
+    wake_cv.notify_one();
+}
+
+void Logger::flush() {
+    if (closed) {
+        return;
+    }
+    vector<pair<LogRing *, uint64_t>> targets;
+    {
+        lock_guard<mutex> guard(rings_mutex);
+        for (LogRing * ring : rings) {
+            targets.emplace_back(ring, ring->head.load(memory_order_acquire));
+        }
+    }
+    wake();
+    for (auto & target : targets) {
+        while (target.first->tail.load(memory_order_acquire) < target.second && !closed) {
+            this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void Logger::shutdown() {
+    if (closed.exchange(true)) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(wake_mutex);
+        stopping = true;
+        wake_cv.notify_one();
+    }
+    writer.join();
+}
+
+void Logger::run() {
+    unique_lock<mutex> lock(wake_mutex);
+    while (!stopping) {
+        wake_cv.wait_for(lock, write_interval, [this] { return wake_pending || stopping; });
+        wake_pending = false;
+        lock.unlock();
+        drain();
+        lock.lock();
+    }
+    lock.unlock();
+    drain();
+}
+
+void Logger::drain() {
+    vector<LogRing *> current;
+    {
+        lock_guard<mutex> guard(rings_mutex);
+        current = rings;
+    }
+    // only what was there at the start, so a busy thread can't keep the
+    // writer here
+    vector<uint64_t> ends(current.size());
+    for (size_t i = 0; i < current.size(); i++) {
+        ends[i] = current[i]->head.load(memory_order_acquire);
+    }
+
+    string buffer;
+    FILE * buffer_stream = stdout;
+    while (true) {
+        // the oldest record of any thread
+        LogRing * next = nullptr;
+        for (size_t i = 0; i < current.size(); i++) {
+            uint64_t tail = current[i]->tail.load(memory_order_relaxed);
+            if (tail < ends[i] && (next == nullptr ||
+                current[i]->records[tail & (ring_capacity - 1)].time_ns < next->records[next->tail.load(memory_order_relaxed) & (ring_capacity - 1)].time_ns)) {
+                next = current[i];
+            }
+        }
+        if (next == nullptr) {
+            break;
+        }
+
+        uint64_t tail = next->tail.load(memory_order_relaxed);
+        const LogRecord & record = next->records[tail & (ring_capacity - 1)];
+        FILE * stream = record.level <= LOG_LEVEL_WARN ? stderr : stdout;
+        if (stream != buffer_stream) {
+            write_out(buffer_stream, buffer);
+            buffer_stream = stream;
+        }
+        format(record, buffer);
+        next->tail.store(tail + 1, memory_order_release);
+    }
+    write_out(buffer_stream, buffer);
+
+    for (LogRing * ring : current) {
+        uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+        if (dropped > ring->dropped_reported) {
+            buffer += "log: thread t" + to_string(ring->thread_number) + " dropped " +
+                      to_string(dropped - ring->dropped_reported) + " records\n";
+            ring->dropped_reported = dropped;
+        }
+    }
+    write_out(stderr, buffer);
+}
+
+void Logger::format(const LogRecord & record, string & out) const {
+    char number[64];
+    snprintf(number, sizeof(number), "%.6f %c t%u ",
+             (record.time_ns - std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()) / 1e9,
+             level_letters[record.level & 3], record.thread_number);
+    out += number;
+
+    const char * payload = record.payload;
+    const char * payload_end = record.payload + record.payload_length;
+    bool truncated = false;
+    for (const char * text = record.format; *text != '\0'; text++) {
+        if (text[0] != '{' || text[1] != '}') {
+            out += *text;
+            continue;
+        }
+        text++;
+        if (truncated || payload >= payload_end) {
+            continue;
+        }
+
+        LogArgument type = static_cast<LogArgument>(*payload++);
+        switch (type) {
+        case LOG_SIGNED: {
+            int64_t value;
+            memcpy(&value, payload, sizeof(value));
+            payload += sizeof(value);
+            out += to_string(value);
+            break;
+        }
+        case LOG_UNSIGNED: {
+            uint64_t value;
+            memcpy(&value, payload, sizeof(value));
+            payload += sizeof(value);
+            out += to_string(value);
+            break;
+        }
+        case LOG_DOUBLE: {
+            double value;
+            memcpy(&value, payload, sizeof(value));
+            payload += sizeof(value);
+            // as an ostream shows it
+            snprintf(number, sizeof(number), "%g", value);
+            out += number;
+            break;
+        }
+        case LOG_BOOL:
+            out += *payload++ ? '1' : '0';
+            break;
+        case LOG_CHAR:
+            out += *payload++;
+            break;
+        case LOG_STRING: {
+            uint16_t length;
+            memcpy(&length, payload, sizeof(length));
+            payload += sizeof(length);
+            out.append(payload, length);
+            payload += length;
+            if (payload < payload_end && *payload == LOG_TRUNCATED) {
+                out += "...";
+                truncated = true;
+            }
+            break;
+        }
+        case LOG_POINTER: {
+            uint64_t value;
+            memcpy(&value, payload, sizeof(value));
+            payload += sizeof(value);
+            snprintf(number, sizeof(number), "0x%llx", static_cast<unsigned long long>(value));
+            out += number;
+            break;
+        }
+        default:
+            out += "...";
+            truncated = true;
+            break;
+        }
+    }
+    out += '\n';
+}
+
+void Logger::write_out(FILE * stream, string & buffer) {
+    if (buffer.empty()) {
+        return;
+    }
+    lock_guard<mutex> guard(output_mutex);
+    fwrite(buffer.data(), 1, buffer.size(), stream);
+    fflush(stream);
+    buffer.clear();
+}
+
+void Logger::write_now(const LogRecord & record) {
+    string line;
+    format(record, line);
+    write_out(record.level <= LOG_LEVEL_WARN ? stderr : stdout, line);
+}
+
+static void shutdown_logger() {
+    logger().shutdown();
+}
+
+// set once the thread's ring is given back, after which the thread (e.g.
+// the destructor of another thread_local) writes directly
+static thread_local bool thread_exiting = false;
+// the record of a write that bypasses the rings
+static thread_local LogRecord direct_record;
+
+// gives the ring back when its thread exits
+struct LogRingOwner {
+    LogRing * ring = nullptr;
+
+    ~LogRingOwner() {
+        thread_exiting = true;
+        if (ring != nullptr) {
+            ring->retired.store(true, memory_order_release);
+        }
+    }
+};
+
+static thread_local LogRingOwner ring_owner;
+
+LogRecord * log_claim(int level, const char * format) {
+    Logger & log = logger();
+    LogRecord * record = &direct_record;
+    if (!thread_exiting && !log.closed.load(memory_order_relaxed)) {
+        if (ring_owner.ring == nullptr) {
+            ring_owner.ring = log.register_thread();
+        }
+        LogRing * ring = ring_owner.ring;
+        uint64_t head = ring->head.load(memory_order_relaxed);
+        if (head - ring->tail.load(memory_order_acquire) >= ring_capacity) {
+            ring->dropped.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        record = &ring->records[head & (ring_capacity - 1)];
+        record->thread_number = ring->thread_number;
+    }
+    else {
+        record->thread_number = 0;
+    }
+
+    record->time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now().time_since_epoch()).count();
+    record->format = format;
+    record->level = static_cast<uint8_t>(level);
+    record->argument_count = 0;
+    record->payload_length = 0;
+    return record;
+}
+
+void log_commit(LogRecord * record) {
+    if (record == &direct_record) {
+        logger().write_now(*record);
+        return;
+    }
+    LogRing * ring = ring_owner.ring;
+    ring->head.store(ring->head.load(memory_order_relaxed) + 1, memory_order_release);
+    if (record->level <= LOG_LEVEL_WARN) {
+        logger().wake();
+    }
+}
+
+void log_flush() {
+    logger().flush();
+}
+
+LogEncoder::LogEncoder(LogRecord & record) : record(record) {
+}
+
+void LogEncoder::put(LogArgument type, const void * value, size_t length) {
+    // one byte is always kept for the truncation mark
+    size_t room = LogRecord::payload_size - record.payload_length;
+    if (full) {
+        return;
+    }
+    if (1 + length + 1 > room) {
+        record.payload[record.payload_length++] = LOG_TRUNCATED;
+        full = true;
+        return;
+    }
+    record.payload[record.payload_length++] = type;
+    memcpy(record.payload + record.payload_length, value, length);
+    record.payload_length += static_cast<uint16_t>(length);
+    record.argument_count++;
+}
+
+void LogEncoder::add_string(const char * text, size_t length) {
+    size_t room = LogRecord::payload_size - record.payload_length;
+    if (full) {
+        return;
+    }
+    // the tag, the length and the truncation mark
+    if (room < 1 + sizeof(uint16_t) + 1 + 1) {
+        record.payload[record.payload_length++] = LOG_TRUNCATED;
+        full = true;
+        return;
+    }
+    size_t kept = min(length, room - (1 + sizeof(uint16_t) + 1));
+    uint16_t kept_length = static_cast<uint16_t>(kept);
+    record.payload[record.payload_length++] = LOG_STRING;
+    memcpy(record.payload + record.payload_length, &kept_length, sizeof(kept_length));
+    record.payload_length += sizeof(kept_length);
+    memcpy(record.payload + record.payload_length, text, kept);
+    record.payload_length += kept_length;
+    record.argument_count++;
+    if (kept < length) {
+        record.payload[record.payload_length++] = LOG_TRUNCATED;
+        full = true;
+    }
+}
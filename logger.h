@@ -0,0 +1,183 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+using namespace std;
+
+// leveled logging that never blocks the thread logging. a LOG_* call
+// copies the address of its format and its arguments into a fixed-size
+// binary record in a ring belonging to the calling thread, with no lock
+// and no formatting; a background thread merges the rings in time order,
+// formats the records and writes them (errors and warnings to stderr, the
+// rest to stdout). when a ring is full the record is dropped, and the
+// count of dropped records is logged later.
+//
+//   LOG_INFO("connected to {}:{} after {}s", ip_address, port, seconds);
+//
+// the format must be a string literal, each {} in it taking the next
+// argument: integers, enums, floating point, bool, char, strings and
+// pointers. strings are copied, and cut short if the record is full.
+//
+// levels past MRR_LOG_LEVEL compile to nothing: their arguments are still
+// checked, but never evaluated. the ones compiled in can be cut further at
+// run time with log_set_level() or the MRR_LOG environment variable (error,
+// warn, info or debug).
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef MRR_LOG_LEVEL
+#define MRR_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, ...)                                                      \
+    do {                                                                        \
+        if ((level) <= log_runtime_level.load(std::memory_order_relaxed)) {    \
+            log_write((level), __VA_ARGS__);                                    \
+        }                                                                       \
+    } while (0)
+
+#define LOG_NEVER(level, ...)                                                   \
+    do {                                                                        \
+        if (false) {                                                            \
+            log_write((level), __VA_ARGS__);                                    \
+        }                                                                       \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#if MRR_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_NEVER(LOG_LEVEL_WARN, __VA_ARGS__)
+#endif
+
+#if MRR_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_NEVER(LOG_LEVEL_INFO, __VA_ARGS__)
+#endif
+
+#if MRR_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_NEVER(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+
+// the most verbose level written
+extern atomic<int> log_runtime_level;
+void log_set_level(int level);
+// waits until everything logged so far has been written
+void log_flush();
+
+struct LogRecord {
+    static const size_t payload_size = 232;
+
+    // steady clock
+    int64_t time_ns;
+    const char * format;
+    uint32_t thread_number;
+    uint8_t level;
+    uint8_t argument_count;
+    uint16_t payload_length;
+    // each argument: a type tag and its value (see LogEncoder)
+    char payload[payload_size];
+};
+
+static_assert(sizeof(LogRecord) == 256, "records are a fixed size");
+
+// the argument types a record holds
+enum LogArgument : char {
+    LOG_SIGNED = 'i',
+    LOG_UNSIGNED = 'u',
+    LOG_DOUBLE = 'd',
+    LOG_BOOL = 'b',
+    LOG_CHAR = 'c',
+    LOG_STRING = 's',
+    LOG_POINTER = 'p',
+    // an argument that didn't fit, and nothing after it
+    LOG_TRUNCATED = 't'
+};
+
+class LogEncoder {
+public:
+    explicit LogEncoder(LogRecord & record);
+
+    template <typename T>
+    void add(const T & value) {
+        typedef typename decay<T>::type Value;
+        if constexpr (is_same<Value, bool>::value) {
+            uint8_t flag = value ? 1 : 0;
+            put(LOG_BOOL, &flag, sizeof(flag));
+        }
+        else if constexpr (is_same<Value, char>::value) {
+            put(LOG_CHAR, &value, sizeof(value));
+        }
+        else if constexpr (is_enum<Value>::value) {
+            int64_t number = static_cast<int64_t>(value);
+            put(LOG_SIGNED, &number, sizeof(number));
+        }
+        else if constexpr (is_integral<Value>::value && is_signed<Value>::value) {
+            int64_t number = value;
+            put(LOG_SIGNED, &number, sizeof(number));
+        }
+        else if constexpr (is_integral<Value>::value) {
+            uint64_t number = value;
+            put(LOG_UNSIGNED, &number, sizeof(number));
+        }
+        else if constexpr (is_floating_point<Value>::value) {
+            double number = value;
+            put(LOG_DOUBLE, &number, sizeof(number));
+        }
+        else if constexpr (is_same<Value, const char *>::value || is_same<Value, char *>::value) {
+            add_string(value ? value : "(null)", value ? strlen(value) : 6);
+        }
+        else if constexpr (is_same<Value, string>::value) {
+            add_string(value.data(), value.size());
+        }
+        else if constexpr (is_pointer<Value>::value) {
+            uint64_t address = reinterpret_cast<uintptr_t>(value);
+            put(LOG_POINTER, &address, sizeof(address));
+        }
+        else {
+            static_assert(is_pointer<Value>::value, "no way to log this type");
+        }
+    }
+
+    template <size_t length>
+    void add(const char (&value)[length]) {
+        add_string(value, strlen(value));
+    }
+
+private:
+    void put(LogArgument type, const void * value, size_t length);
+    void add_string(const char * text, size_t length);
+
+    LogRecord & record;
+    bool full = false;
+};
+
+// a record to fill for 'format', or nullptr if it is to be dropped
+LogRecord * log_claim(int level, const char * format);
+// hands a claimed record to the writer
+void log_commit(LogRecord * record);
+
+template <typename... Arguments>
+void log_write(int level, const char * format, const Arguments &... arguments) {
+    LogRecord * record = log_claim(level, format);
+    if (record == nullptr) {
+        return;
+    }
+    LogEncoder encoder(*record);
+    (encoder.add(arguments), ...);
+    log_commit(record);
+}
+
+#endif //LOGGER_H
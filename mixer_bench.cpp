@@ -0,0 +1,221 @@
+// checks blendImagesAndNoise (the blend tables) against the OpenCV passes
+// they replaced, and times both:
+//   ./MRR_Pi_mixer_bench [directory (default ../tif/)] [repetitions (default 10)]
+// crossfades the first two .tif files there (random frames if there are none)
+// through a fade sweep for each set of weights, which also takes it through
+// each kernel variant. fails if a pixel is further from the reference than
+// the fixed-point crossfade's rounding can explain. then renders mid-fade in
+// 1 band, 2 and so on up to one per core, to see how the render scales.
+// last, the noise: what a bank of the server's 30 frames takes to make and
+// keeps, against procedural noise made as each frame renders, which must
+// render the same frames
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "mixer_processor.h"
+#include "render_pool.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock SteadyClock;
+typedef std::chrono::duration<double> Seconds;
+
+struct Weights
+{
+    float imageWeight;
+    float noiseWeight;
+    float gamma;
+    float gain;
+};
+
+// each stage rounds once, so may be a level off, and scales what earlier
+// stages were off by its weights (the LUT by its steepest step)
+static double error_bound(const Weights &weights, const cv::Mat &lut)
+{
+    int lut_step = 0;
+    for (int i = 1; i < 256; i++)
+    {
+        lut_step = max(lut_step, abs(lut.at<uchar>(i) - lut.at<uchar>(i - 1)));
+    }
+    double faded = 1;
+    double mixed = max(fabs(weights.imageWeight), 1.0f) * faded + 1;
+    double looked = lut_step * mixed;
+    double gamma_blended = fabs(weights.gamma) * looked + fabs(1 - weights.gamma) * mixed + 1;
+    return fabs(weights.gain) * gamma_blended + 1;
+}
+
+int main(int argc, char *argv[])
+{
+    string directory = argc > 1 ? argv[1] : "../tif/";
+    int repetitions = argc > 2 ? stoi(argv[2]) : 10;
+
+    vector<cv::String> file_names;
+    cv::glob(directory + "*.tif", file_names, false);
+    cv::Mat image1, image2;
+    if (file_names.size() >= 2)
+    {
+        image1 = loadImage(file_names[0]);
+        image2 = loadImage(file_names[1]);
+        cout << "crossfading " << file_names[0] << " and " << file_names[1] << endl;
+    }
+    if (image1.empty() || image1.size() != image2.size())
+    {
+        image1.create(768, 1024, CV_8UC1);
+        image2.create(768, 1024, CV_8UC1);
+        cv::randu(image1, 0, 256);
+        cv::randu(image2, 0, 256);
+        cout << "crossfading random frames" << endl;
+    }
+
+    // one noise frame, so both versions use the same one each call
+    std::vector<cv::Mat> noiseFrames = generateNoiseFrames(image1.cols, image1.rows, 1, true);
+    cv::Mat lut = createParabolicLUT();
+
+    // the server's defaults first
+    vector<Weights> weight_sets = {
+        {0.75f, 0.6f, 1.0f, 1.8f},
+        {0.9f, 0.5f, 0.0f, 1.0f},
+        {1.0f, 0.2f, 1.0f, 1.0f},
+        {0.5f, 0.5f, 0.3f, 0.7f},
+        {2.0f, 1.5f, 1.5f, 2.5f},
+        // no noise, and a transfer that changes nothing
+        {0.9f, 0.0f, 0.0f, 1.0f},
+        {1.0f, 0.5f, 0.0f, 1.0f},
+        {1.0f, 0.0f, 0.0f, 1.0f},
+    };
+    const int fade_steps = 20;
+
+    bool passed = true;
+    cv::Mat reference, blended;
+    for (const auto &weights : weight_sets)
+    {
+        double bound = error_bound(weights, lut);
+        int worst = 0;
+        double exact = 0;
+        double reference_seconds = 0;
+        double table_seconds = 0;
+        for (int step = 0; step <= fade_steps; step++)
+        {
+            float fade = static_cast<float>(step) / fade_steps;
+
+            auto begin = SteadyClock::now();
+            for (int i = 0; i < repetitions; i++)
+            {
+                blendImagesAndNoiseReference(image1, image2, noiseFrames, reference, lut,
+                                             fade, weights.imageWeight, weights.noiseWeight, weights.gamma, weights.gain);
+            }
+            reference_seconds += Seconds(SteadyClock::now() - begin).count();
+
+            begin = SteadyClock::now();
+            for (int i = 0; i < repetitions; i++)
+            {
+                blendImagesAndNoise(image1, image2, noiseFrames, blended, lut,
+                                    fade, weights.imageWeight, weights.noiseWeight, weights.gamma, weights.gain);
+            }
+            table_seconds += Seconds(SteadyClock::now() - begin).count();
+
+            cv::Mat difference;
+            cv::absdiff(reference, blended, difference);
+            double max_difference;
+            cv::minMaxLoc(difference, nullptr, &max_difference);
+            worst = max(worst, static_cast<int>(max_difference));
+            exact += 1.0 - static_cast<double>(cv::countNonZero(difference)) / difference.total();
+        }
+
+        double frames = static_cast<double>(repetitions) * (fade_steps + 1);
+        cout << fixed << setprecision(2)
+             << "image:" << weights.imageWeight << " noise:" << weights.noiseWeight
+             << " gamma:" << weights.gamma << " gain:" << weights.gain
+             << " worst:" << worst << " (bound " << bound << ")"
+             << " exact:" << 100.0 * exact / (fade_steps + 1) << "%"
+             << " reference:" << 1e3 * reference_seconds / frames << "ms"
+             << " tables:" << 1e3 * table_seconds / frames << "ms" << endl;
+        if (worst > bound)
+        {
+            cerr << "blend tables are off by " << worst << " levels" << endl;
+            passed = false;
+        }
+    }
+
+    // the server's defaults, mid-fade, in bands on the pool
+    const Weights &defaults = weight_sets[0];
+    cv::Mat single;
+    BlendPipeline unpooled;
+    unpooled.blend(image1, image2, noiseFrames, single, lut,
+                   0.5f, defaults.imageWeight, defaults.noiseWeight, defaults.gamma, defaults.gain);
+    RenderPool pool;
+    double one_band_seconds = 0;
+    for (int bands = 1; bands <= pool.threads(); bands++)
+    {
+        BlendPipeline pipeline;
+        pipeline.setPool(&pool, bands);
+        cv::Mat banded;
+        int frames = repetitions * 10;
+        auto begin = SteadyClock::now();
+        for (int i = 0; i < frames; i++)
+        {
+            pipeline.blend(image1, image2, noiseFrames, banded, lut,
+                           0.5f, defaults.imageWeight, defaults.noiseWeight, defaults.gamma, defaults.gain);
+        }
+        double seconds = Seconds(SteadyClock::now() - begin).count() / frames;
+        if (bands == 1)
+        {
+            one_band_seconds = seconds;
+        }
+        cout << "bands:" << bands << " render:" << 1e3 * seconds << "ms"
+             << " speedup:" << one_band_seconds / seconds << endl;
+        if (cv::countNonZero(banded != single) != 0)
+        {
+            cerr << "rendering in " << bands << " bands changed the frame" << endl;
+            passed = false;
+        }
+    }
+
+    // a bank of frames against the same noise made as each frame renders
+    const int noise_frames = 30;
+    NoiseSource bank(image1.cols, image1.rows, noise_frames, true, NoiseSource::Bank);
+    NoiseSource procedural(image1.cols, image1.rows, noise_frames, true, NoiseSource::Procedural);
+    cout << "noise bank: setup:" << 1e3 * bank.setupSeconds() << "ms"
+         << " memory:" << bank.memoryBytes() / 1024 << "KB" << endl;
+    cout << "noise procedural: setup:" << 1e3 * procedural.setupSeconds() << "ms"
+         << " memory:" << procedural.memoryBytes() / 1024 << "KB a band" << endl;
+    for (int bands : {1, pool.threads()})
+    {
+        BlendPipeline from_bank, made;
+        from_bank.setPool(&pool, bands);
+        made.setPool(&pool, bands);
+        double bank_seconds = 0;
+        double procedural_seconds = 0;
+        bool same = true;
+        for (int i = 0; i < noise_frames; i++)
+        {
+            cv::Mat banked, rendered;
+            auto begin = SteadyClock::now();
+            from_bank.blend(image1, image2, bank, banked, lut,
+                            0.5f, defaults.imageWeight, defaults.noiseWeight, defaults.gamma, defaults.gain);
+            bank_seconds += Seconds(SteadyClock::now() - begin).count();
+            begin = SteadyClock::now();
+            made.blend(image1, image2, procedural, rendered, lut,
+                       0.5f, defaults.imageWeight, defaults.noiseWeight, defaults.gamma, defaults.gain);
+            procedural_seconds += Seconds(SteadyClock::now() - begin).count();
+            same = same && cv::countNonZero(banked != rendered) == 0;
+        }
+        cout << "bands:" << bands << " render with bank:" << 1e3 * bank_seconds / noise_frames << "ms"
+             << " procedural:" << 1e3 * procedural_seconds / noise_frames << "ms" << endl;
+        if (!same)
+        {
+            cerr << "procedural noise rendered different frames to the bank" << endl;
+            passed = false;
+        }
+    }
+
+    return passed ? 0 : -1;
+}
@@ -1,6 +1,9 @@
 #include "mixer_processor.h"
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
 
 cv::Mat loadImage(const std::string& imageFile) {
     cv::Mat img = cv::imread(imageFile, cv::IMREAD_GRAYSCALE);
@@ -13,28 +16,7 @@ cv::Mat loadImage(const std::string& imageFile) {
 
 
 std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter) {
-    std::vector<cv::Mat> noiseFrames;
-    for (int i = 0; i < numFrames; ++i) {
-        cv::Mat noise(height, width, CV_8UC1);
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                float value = static_cast<float>(rand() % 256);
-                noise.at<uchar>(y, x) = static_cast<uchar>(value);
-            }
-        }
-        if (applyFilter) {
-            cv::GaussianBlur(noise, noise, cv::Size(5, 5), 0);
-
-            // Transform the noise
-            noise.convertTo(noise, CV_32F); // Convert to float for transformation
-            noise -= 128; // Subtract 128
-            noise *= 2;   // Multiply by 2
-            noise += 128; // Add 128 back
-            noise.convertTo(noise, CV_8UC1); // Convert back to 8-bit
-        }
-        noiseFrames.push_back(noise);
-    }
-    return noiseFrames;
+    return NoiseSource(width, height, numFrames, applyFilter, NoiseSource::Bank).bank();
 }
 
 cv::Mat createParabolicLUT() {
@@ -46,18 +28,25 @@ cv::Mat createParabolicLUT() {
     return lut;
 }
 
+// Determine the current noise frame, the next one each call
+static const cv::Mat& nextNoiseFrame(const std::vector<cv::Mat>& noiseFrames) {
+    static size_t noiseFrameIndex = 0;
+    noiseFrameIndex = noiseFrameIndex % noiseFrames.size();
+    const cv::Mat& noiseFrame = noiseFrames[noiseFrameIndex];
+    noiseFrameIndex = (noiseFrameIndex + 1) % noiseFrames.size();
+    return noiseFrame;
+}
+
 // 1.0f - noiseWeight
 
-void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
-                         cv::Mat& outputImg, const cv::Mat& lut,
-                         float img1Fade, float imageWeight, float noiseWeight, float gamma,  float gain) {
+void blendImagesAndNoiseReference(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
+                                  cv::Mat& outputImg, const cv::Mat& lut,
+                                  float img1Fade, float imageWeight, float noiseWeight, float gamma,  float gain) {
 
     float img2Fade = 1 - img1Fade;
     
     // Determine the current noise frame
-    static int noiseFrameIndex = 0;
-    cv::Mat noiseFrame = noiseFrames[noiseFrameIndex];
-    noiseFrameIndex = (noiseFrameIndex + 1) % noiseFrames.size();
+    const cv::Mat& noiseFrame = nextNoiseFrame(noiseFrames);
     
     // Blend images
     cv::Mat blendedImage;
@@ -75,4 +64,330 @@ void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::ve
     
     // Apply gain directly
     blendedWithNoise.convertTo(outputImg, -1, gain, 0);
-}
\ No newline at end of file
+}
+
+// The blend through tables: the noise mix is looked up by (blended level,
+// noise level) and the LUT, gamma blend, gain and saturation by the mixed
+// level, both computed the way the OpenCV passes compute them. Only the
+// crossfade, whose weights change every frame, is arithmetic: 12 bit fixed
+// point, a * wa + b * wb with the weights scaled by 4096, rounded back to a
+// level the way cv::addWeighted rounds (half to even). A row goes through in
+// blocks small enough to stay in L1.
+
+static const int blendShift = 12;
+static const int blendBlock = 256;
+
+struct BlendTables {
+    short fade1, fade2;      // img1, img2
+    const uchar* mix;        // 256x256, blended level by noise level
+    const uchar* transfer;   // 256
+};
+
+// false if w doesn't fit (|w| of 8 or more)
+static bool toFixed(double w, short& fixed) {
+    double scaled = std::round(w * (1 << blendShift));
+    if (scaled < -32767 || scaled > 32767) {
+        return false;
+    }
+    fixed = static_cast<short>(scaled);
+    return true;
+}
+
+static inline int weightedLevel(int a, int wa, int b, int wb) {
+    int sum = a * wa + b * wb;
+    int level = (sum + (1 << (blendShift - 1)) - 1 + ((sum >> blendShift) & 1)) >> blendShift;
+    return level < 0 ? 0 : (level > 255 ? 255 : level);
+}
+
+#if CV_SIMD
+// weightedLevel on each lane: a and b interleaved against the weight pair in
+// w, summed by v_dotprod
+static inline cv::v_int16 weightedLevels(const cv::v_int16& a, const cv::v_int16& b, const cv::v_int16& w) {
+    const cv::v_int32 half = cv::vx_setall_s32((1 << (blendShift - 1)) - 1);
+    const cv::v_int32 one = cv::vx_setall_s32(1);
+    cv::v_int16 ab0, ab1;
+    cv::v_zip(a, b, ab0, ab1);
+    cv::v_int32 sum0 = cv::v_dotprod(ab0, w);
+    cv::v_int32 sum1 = cv::v_dotprod(ab1, w);
+    sum0 = cv::v_shr<blendShift>(sum0 + half + (cv::v_shr<blendShift>(sum0) & one));
+    sum1 = cv::v_shr<blendShift>(sum1 + half + (cv::v_shr<blendShift>(sum1) & one));
+    cv::v_int16 levels = cv::v_pack(sum0, sum1);
+    return cv::v_min(cv::v_max(levels, cv::vx_setzero_s16()), cv::vx_setall_s16(255));
+}
+
+static inline cv::v_int16 weightPair(short wa, short wb) {
+    cv::v_int16 pair, unused;
+    cv::v_zip(cv::vx_setall_s16(wa), cv::vx_setall_s16(wb), pair, unused);
+    return pair;
+}
+
+static inline void expandLevels(const uchar* p, cv::v_int16& low, cv::v_int16& high) {
+    cv::v_uint16 u0, u1;
+    cv::v_expand(cv::vx_load(p), u0, u1);
+    low = cv::v_reinterpret_as_s16(u0);
+    high = cv::v_reinterpret_as_s16(u1);
+}
+#endif
+
+// One row, with the stages the weights leave to do compiled in: Crossfade
+// false when the fade is complete (img1 is the image shown), Noise false when
+// the noise weight is 0 (the transfer table then takes the blended level),
+// Transfer false when the transfer table changes nothing.
+template <bool Crossfade, bool Noise, bool Transfer>
+static void blendRow(const uchar* img1, const uchar* img2, const uchar* noise,
+                     uchar* out, int width, const BlendTables& tables) {
+    uchar blended[blendBlock];
+    uchar mixed[blendBlock];
+
+#if CV_SIMD
+    const int lanes = cv::v_uint8::nlanes;
+    const cv::v_int16 fadePair = weightPair(tables.fade1, tables.fade2);
+#endif
+
+    for (int start = 0; start < width; start += blendBlock) {
+        int count = std::min(blendBlock, width - start);
+        uchar* o = out + start;
+
+        const uchar* b = img1 + start;
+        if (Crossfade) {
+            const uchar* a = img1 + start;
+            const uchar* c = img2 + start;
+            uchar* fadeOut = Noise || Transfer ? blended : o;
+            int x = 0;
+#if CV_SIMD
+            for (; x <= count - lanes; x += lanes) {
+                cv::v_int16 a0, a1, c0, c1;
+                expandLevels(a + x, a0, a1);
+                expandLevels(c + x, c0, c1);
+                cv::v_store(fadeOut + x, cv::v_pack_u(weightedLevels(a0, c0, fadePair), weightedLevels(a1, c1, fadePair)));
+            }
+#endif
+            for (; x < count; x++) {
+                fadeOut[x] = static_cast<uchar>(weightedLevel(a[x], tables.fade1, c[x], tables.fade2));
+            }
+            b = fadeOut;
+        }
+
+        const uchar* m = b;
+        if (Noise) {
+            const uchar* n = noise + start;
+            uchar* mixOut = Transfer ? mixed : o;
+            for (int x = 0; x < count; x++) {
+                mixOut[x] = tables.mix[(b[x] << 8) | n[x]];
+            }
+            m = mixOut;
+        }
+
+        if (Transfer) {
+            for (int x = 0; x < count; x++) {
+                o[x] = tables.transfer[m[x]];
+            }
+        }
+        else if (m != o) {
+            std::memcpy(o, m, count);
+        }
+    }
+}
+
+typedef void (*BlendKernel)(const uchar* img1, const uchar* img2, const uchar* noise,
+                            uchar* out, int width, const BlendTables& tables);
+
+// indexed by Crossfade << 2 | Noise << 1 | Transfer
+static const BlendKernel blendKernels[8] = {
+    blendRow<false, false, false>,
+    blendRow<false, false, true>,
+    blendRow<false, true, false>,
+    blendRow<false, true, true>,
+    blendRow<true, false, false>,
+    blendRow<true, false, true>,
+    blendRow<true, true, false>,
+    blendRow<true, true, true>,
+};
+
+BlendPipeline::BlendPipeline()
+    : built(false), imageWeight(0), noiseWeight(0), gamma(0), gain(0),
+      mixNoise(false), transform(false), rebuildCount(0), pool(nullptr), bands(1) {
+    std::memset(lutKey, 0, sizeof(lutKey));
+    std::memset(transferTable, 0, sizeof(transferTable));
+}
+
+void BlendPipeline::setPool(RenderPool* pool, int bands) {
+    this->pool = pool;
+    this->bands = std::max(bands, 1);
+}
+
+bool BlendPipeline::matches(const cv::Mat& lut, float imageWeight, float noiseWeight, float gamma, float gain) const {
+    return built && imageWeight == this->imageWeight && noiseWeight == this->noiseWeight &&
+           gamma == this->gamma && gain == this->gain && std::memcmp(lut.ptr<uchar>(), lutKey, 256) == 0;
+}
+
+void BlendPipeline::rebuild(const cv::Mat& lut, float imageWeight, float noiseWeight, float gamma, float gain) {
+    this->imageWeight = imageWeight;
+    this->noiseWeight = noiseWeight;
+    this->gamma = gamma;
+    this->gain = gain;
+    std::memcpy(lutKey, lut.ptr<uchar>(), 256);
+    built = true;
+    rebuildCount += 1;
+
+    // the arithmetic of the OpenCV passes: addWeighted and convertTo work in
+    // float, and round to the nearest level
+    float lutWeight = gamma;
+    float linearWeight = static_cast<float>(1.0 - gamma);
+    uchar levelTransfer[256];
+    for (int m = 0; m < 256; ++m) {
+        uchar gammaBlended = cv::saturate_cast<uchar>(lutKey[m] * lutWeight + m * linearWeight);
+        levelTransfer[m] = cv::saturate_cast<uchar>(gammaBlended * gain);
+    }
+
+    mixNoise = noiseWeight != 0;
+    if (mixNoise) {
+        mixTable.resize(256 * 256);
+        for (int b = 0; b < 256; ++b) {
+            uchar* row = &mixTable[b << 8];
+            for (int n = 0; n < 256; ++n) {
+                row[n] = cv::saturate_cast<uchar>(b * imageWeight + n * noiseWeight);
+            }
+        }
+        std::memcpy(transferTable, levelTransfer, 256);
+    }
+    else {
+        // the image weight alone, folded into the transfer
+        for (int b = 0; b < 256; ++b) {
+            transferTable[b] = levelTransfer[cv::saturate_cast<uchar>(b * imageWeight)];
+        }
+    }
+
+    transform = false;
+    for (int i = 0; i < 256; ++i) {
+        transform = transform || transferTable[i] != i;
+    }
+}
+
+bool BlendPipeline::prepare(const cv::Mat& img1, const cv::Mat& img2, int noiseType, cv::Size noiseSize, const cv::Mat& lut,
+                            float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain,
+                            BlendTables& tables) {
+    bool fits = toFixed(img1Fade, tables.fade1) && toFixed(1 - img1Fade, tables.fade2);
+    bool gray = img1.type() == CV_8UC1 && img2.type() == CV_8UC1 && noiseType == CV_8UC1 &&
+                img2.size() == img1.size() && noiseSize == img1.size() &&
+                lut.type() == CV_8UC1 && lut.total() == 256 && lut.isContinuous();
+    if (!fits || !gray) {
+        return false;
+    }
+
+    if (!matches(lut, imageWeight, noiseWeight, gamma, gain)) {
+        rebuild(lut, imageWeight, noiseWeight, gamma, gain);
+    }
+    tables.mix = mixTable.data();
+    tables.transfer = transferTable;
+    return true;
+}
+
+void BlendPipeline::blend(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
+                          cv::Mat& outputImg, const cv::Mat& lut,
+                          float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain) {
+
+    BlendTables tables;
+    if (!prepare(img1, img2, noiseFrames[0].type(), noiseFrames[0].size(), lut,
+                 img1Fade, imageWeight, noiseWeight, gamma, gain, tables)) {
+        blendImagesAndNoiseReference(img1, img2, noiseFrames, outputImg, lut,
+                                     img1Fade, imageWeight, noiseWeight, gamma, gain);
+        return;
+    }
+    const cv::Mat& noise = nextNoiseFrame(noiseFrames);
+    render(img1, img2, &noise, nullptr, 0, outputImg, img1Fade, tables);
+}
+
+void BlendPipeline::blend(const cv::Mat& img1, const cv::Mat& img2, NoiseSource& noise,
+                          cv::Mat& outputImg, const cv::Mat& lut,
+                          float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain) {
+
+    uint32_t noiseFrame = noise.next();
+    BlendTables tables;
+    if (!prepare(img1, img2, CV_8UC1, cv::Size(noise.width(), noise.height()), lut,
+                 img1Fade, imageWeight, noiseWeight, gamma, gain, tables)) {
+        cv::Mat made;
+        std::vector<cv::Mat> noiseFrames(1, noise.frame(noiseFrame, made));
+        blendImagesAndNoiseReference(img1, img2, noiseFrames, outputImg, lut,
+                                     img1Fade, imageWeight, noiseWeight, gamma, gain);
+        return;
+    }
+    if (!mixNoise) {
+        // the kernel doesn't read the noise
+        render(img1, img2, &img1, nullptr, 0, outputImg, img1Fade, tables);
+    }
+    else if (noise.mode() == NoiseSource::Bank) {
+        render(img1, img2, &noise.bank()[noiseFrame], nullptr, 0, outputImg, img1Fade, tables);
+    }
+    else {
+        render(img1, img2, nullptr, &noise, noiseFrame, outputImg, img1Fade, tables);
+    }
+}
+
+void BlendPipeline::render(const cv::Mat& img1, const cv::Mat& img2, const cv::Mat* noise,
+                           const NoiseSource* procedural, uint32_t noiseFrame, cv::Mat& outputImg,
+                           float img1Fade, const BlendTables& tables) {
+    outputImg.create(img1.size(), CV_8UC1);
+
+    // a complete fade shows one image as it is
+    const cv::Mat* shown = &img1;
+    bool crossfade = img1Fade != 1 && img1Fade != 0;
+    if (img1Fade == 0) {
+        shown = &img2;
+    }
+    BlendKernel kernel = blendKernels[(crossfade ? 4 : 0) | (mixNoise ? 2 : 0) | (transform ? 1 : 0)];
+
+    // a band is a run of whole rows; when every image is continuous it goes
+    // through the kernel as one long row. procedural noise is made a row at
+    // a time, just before the row is blended
+    struct Band {
+        BlendKernel kernel;
+        const cv::Mat* img1;
+        const cv::Mat* img2;
+        const cv::Mat* noise;
+        const NoiseSource* procedural;
+        uint32_t noiseFrame;
+        cv::Mat* out;
+        const BlendTables* tables;
+        bool continuous;
+
+        void render(int band, int bands) const {
+            int first = img1->rows * band / bands;
+            int last = img1->rows * (band + 1) / bands;
+            if (procedural != nullptr) {
+                NoiseRows noiseRows(*procedural, noiseFrame, first);
+                for (int y = first; y < last; ++y) {
+                    kernel(img1->ptr<uchar>(y), img2->ptr<uchar>(y), noiseRows.next(), out->ptr<uchar>(y),
+                           img1->cols, *tables);
+                }
+                return;
+            }
+            if (continuous) {
+                kernel(img1->ptr<uchar>(first), img2->ptr<uchar>(first), noise->ptr<uchar>(first),
+                       out->ptr<uchar>(first), (last - first) * img1->cols, *tables);
+                return;
+            }
+            for (int y = first; y < last; ++y) {
+                kernel(img1->ptr<uchar>(y), img2->ptr<uchar>(y), noise->ptr<uchar>(y), out->ptr<uchar>(y),
+                       img1->cols, *tables);
+            }
+        }
+    };
+    Band band = {kernel, shown, &img2, noise, procedural, noiseFrame, &outputImg, &tables,
+                 img1.isContinuous() && img2.isContinuous() && outputImg.isContinuous() &&
+                 (noise == nullptr || noise->isContinuous())};
+
+    if (pool == nullptr || img1.rows < 2) {
+        band.render(0, 1);
+        return;
+    }
+    // captures one reference, so the std::function holds it without allocating
+    pool->run(std::min(bands, img1.rows), [&band](int index, int count) { band.render(index, count); });
+}
+
+void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
+                         cv::Mat& outputImg, const cv::Mat& lut,
+                         float img1Fade, float imageWeight, float noiseWeight, float gamma,  float gain) {
+    static BlendPipeline pipeline;
+    pipeline.blend(img1, img2, noiseFrames, outputImg, lut, img1Fade, imageWeight, noiseWeight, gamma, gain);
+}
@@ -4,22 +4,94 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <string>
+#include <atomic>
+
+#include "render_pool.h"
+#include "noise_source.h"
 
 
 // Load a grayscale image
 cv::Mat loadImage(const std::string& imageFile);
 
-// Generate grayscale noise frames
+// Generate grayscale noise frames: the frames of a NoiseSource Bank
 std::vector<cv::Mat> generateNoiseFrames(int width, int height, int numFrames, bool applyFilter);
 
 // Create a parabolic lookup table
 cv::Mat createParabolicLUT();
 
-// Function to blend images and noise, and apply LUT
+// Function to blend images and noise, and apply LUT, through a BlendPipeline
+// of its own; outputImg is only allocated when its size or type changes.
+// Differs from blendImagesAndNoiseReference by a few levels at most (see
+// mixer_bench.cpp)
 void blendImagesAndNoise(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
                          cv::Mat& outputImg, const cv::Mat& lut,
                          float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain) ;
 
+// The same blend as five OpenCV passes in float, kept to check the tables
+// against and used for inputs they don't take (not 8 bit gray of one size)
+void blendImagesAndNoiseReference(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
+                                  cv::Mat& outputImg, const cv::Mat& lut,
+                                  float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain) ;
+
+struct BlendTables;
+
+// Blends as blendImagesAndNoise does, from tables built from the weights and
+// LUT: the noise mix as a 256x256 table, and the LUT, gamma blend, gain and
+// saturation folded into one 256 entry table. They are rebuilt only when the
+// weights or LUT change (a new parameter string); each frame a kernel is
+// picked that leaves out what they make unnecessary (no noise, a transfer
+// that changes nothing, a fade that is complete). With a RenderPool the frame
+// is split into bands of rows rendered in parallel. The noise is a frame of
+// its own, or from a NoiseSource, which when Procedural makes each band's
+// noise as it renders it
+class BlendPipeline {
+public:
+    BlendPipeline();
+
+    // Renders on 'pool' in 'bands' bands from now on; nullptr renders on the
+    // calling thread
+    void setPool(RenderPool* pool, int bands);
+
+    void blend(const cv::Mat& img1, const cv::Mat& img2, const std::vector<cv::Mat>& noiseFrames,
+               cv::Mat& outputImg, const cv::Mat& lut,
+               float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain);
+    void blend(const cv::Mat& img1, const cv::Mat& img2, NoiseSource& noise,
+               cv::Mat& outputImg, const cv::Mat& lut,
+               float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain);
+
+    // Times the tables have been built (read from any thread)
+    long rebuilds() const { return rebuildCount; }
+
+private:
+    bool matches(const cv::Mat& lut, float imageWeight, float noiseWeight, float gamma, float gain) const;
+    void rebuild(const cv::Mat& lut, float imageWeight, float noiseWeight, float gamma, float gain);
+    // Checks the inputs suit the tables and brings them up to date; false
+    // when the blend is left to blendImagesAndNoiseReference
+    bool prepare(const cv::Mat& img1, const cv::Mat& img2, int noiseType, cv::Size noiseSize, const cv::Mat& lut,
+                 float img1Fade, float imageWeight, float noiseWeight, float gamma, float gain,
+                 BlendTables& tables);
+    // The noise from 'noise', or when nullptr made by 'procedural'
+    void render(const cv::Mat& img1, const cv::Mat& img2, const cv::Mat* noise,
+                const NoiseSource* procedural, uint32_t noiseFrame, cv::Mat& outputImg,
+                float img1Fade, const BlendTables& tables);
+
+    // The weights and LUT the tables were built for
+    bool built;
+    float imageWeight, noiseWeight, gamma, gain;
+    uchar lutKey[256];
+
+    // Whether there's noise to mix, and whether the transfer changes anything
+    bool mixNoise;
+    bool transform;
+    // Mixed level for a blended level (row) and a noise level (column)
+    std::vector<uchar> mixTable;
+    // Output level for a mixed level, or for a blended one when there's no noise
+    uchar transferTable[256];
+    std::atomic<long> rebuildCount;
+
+    RenderPool* pool;
+    int bands;
+};
 
 #endif // MIXER_PROCESSOR_H
 
@@ -0,0 +1,102 @@
+// prints the live statistics a server or client publishes (see live_stats.h):
+//   ./mrr_stat                lists the pages
+//   ./mrr_stat server_5000 [interval ms (default 1000)] [samples (default forever)]
+// counters are shown with their rate since the previous sample
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <signal.h>
+#include <errno.h>
+
+#include "live_stats.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock SteadyClock;
+typedef std::chrono::duration<double> Seconds;
+
+static void print_snapshot(const StatsSnapshot &snapshot, const StatsSnapshot &previous, double interval)
+{
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now().time_since_epoch()).count();
+    cout << "pid:" << snapshot.pid << " publishes:" << snapshot.publishes;
+    if (snapshot.published_ns > 0)
+    {
+        cout << " age:" << fixed << setprecision(3) << (now - snapshot.published_ns) / 1e9 << "s";
+    }
+    else
+    {
+        cout << " not published yet";
+    }
+    if (kill(snapshot.pid, 0) == -1 && errno == ESRCH)
+    {
+        cout << " (exited)";
+    }
+    cout << endl;
+
+    for (size_t i = 0; i < snapshot.values.size(); i++)
+    {
+        cout << "  " << left << setw(24) << snapshot.names[i] << right << setw(16) << snapshot.values[i];
+        // the same value in the previous sample, if it was there
+        if (snapshot.kinds[i] == STAT_COUNTER && interval > 0 && i < previous.values.size() && previous.names[i] == snapshot.names[i])
+        {
+            cout << setw(14) << setprecision(1) << (snapshot.values[i] - previous.values[i]) / interval << "/s";
+        }
+        cout << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        vector<string> names = LiveStatsReader::list();
+        if (names.empty())
+        {
+            cout << "no statistics pages" << endl;
+        }
+        for (auto &name : names)
+        {
+            cout << name << endl;
+        }
+        return 0;
+    }
+
+    string name = argv[1];
+    int interval_ms = argc > 2 ? stoi(argv[2]) : 1000;
+    long samples = argc > 3 ? stol(argv[3]) : -1;
+
+    LiveStatsReader reader;
+    if (!reader.open(name))
+    {
+        cerr << "no statistics page '" << name << "'" << endl;
+        return -1;
+    }
+
+    StatsSnapshot previous;
+    auto previous_time = SteadyClock::now();
+    for (long sample = 0; samples < 0 || sample < samples; sample++)
+    {
+        if (sample > 0)
+        {
+            this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+
+        StatsSnapshot snapshot;
+        if (!reader.read(snapshot))
+        {
+            cerr << "couldn't read '" << name << "'" << endl;
+            return -1;
+        }
+        auto now = SteadyClock::now();
+        double interval = sample > 0 ? Seconds(now - previous_time).count() : 0;
+        print_snapshot(snapshot, previous, interval);
+        previous = snapshot;
+        previous_time = now;
+    }
+
+    return 0;
+}
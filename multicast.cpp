@@ -0,0 +1,490 @@
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <random>
+
+#include "multicast.h"
+#include "logger.h"
+
+// every datagram: magic(3) + version(1) + sender id(4) + frame id(4) +
+// fragment index(2) + data fragment count(2) + group size(1) + flags(1) +
+// reserved(2) + payload size(4), then up to fragment_payload bytes
+static const int multicast_header_size = 24;
+static const uint8_t multicast_version = 1;
+// keeps header + payload + IP/UDP headers inside a 1500 byte MTU
+static const size_t fragment_payload = 1400;
+// one parity datagram follows every this many data datagrams
+static const size_t parity_group_size = 8;
+static const uint8_t compressed_bit = 0x01;
+// frames kept for references and resend requests
+static const size_t recent_frames = 8;
+static const size_t datagrams_per_call = 32;
+// a full interface queue is waited on this many times, 200us each, before
+// the rest of the frame is dropped; a server that misses it asks again
+static const int max_send_waits = 10;
+static const int socket_buffer_size = 4 * 1024 * 1024;
+
+static inline void put_u16(char * out, uint16_t value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+static inline void put_u32(char * out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+static inline uint16_t get_u16(const char * in) {
+    uint16_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static inline uint32_t get_u32(const char * in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+// the bytes of data fragment 'index' within a payload of 'total' bytes
+static inline size_t fragment_length(size_t total, size_t index) {
+    size_t offset = index * fragment_payload;
+    return offset >= total ? 0 : min(fragment_payload, total - offset);
+}
+
+static bool resolve_address(const string & address, in_addr & result) {
+    if (address.empty()) {
+        result.s_addr = htonl(INADDR_ANY);
+        return true;
+    }
+    return inet_pton(AF_INET, address.c_str(), &result) == 1;
+}
+
+MulticastSender::MulticastSender() {
+    memset(&destination, 0, sizeof(destination));
+    // tells receivers apart from a restarted sender reusing frame ids
+    random_device random;
+    id = random();
+}
+
+MulticastSender::~MulticastSender() {
+    if (sock_fd >= 0) {
+        ::close(sock_fd);
+    }
+}
+
+bool MulticastSender::open(const string & group, const string & port, const string & interface_address) {
+    destination.sin_family = AF_INET;
+    destination.sin_port = htons(stoi(port));
+    in_addr interface;
+    if (!resolve_address(group, destination.sin_addr) || !resolve_address(interface_address, interface)) {
+        LOG_WARN("multicast: bad address {} / {}", group, interface_address);
+        return false;
+    }
+
+    sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        LOG_ERROR("multicast: socket failed {}", strerror(errno));
+        return false;
+    }
+
+    unsigned char ttl = 1;  // stay on the local network
+    unsigned char loop = 1;  // servers on this host get the frames too
+    setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &socket_buffer_size, sizeof(socket_buffer_size));
+    if (!interface_address.empty() && setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0) {
+        LOG_ERROR("multicast: interface {} failed {}", interface_address, strerror(errno));
+        return false;
+    }
+
+    LOG_INFO("multicast: sending to {}:{}", group, port);
+    return true;
+}
+
+uint32_t MulticastSender::sender_id() const {
+    return id;
+}
+
+bool MulticastSender::find(const FrameBuffer & frame, uint32_t & frame_id) const {
+    lock_guard<mutex> guard(this->send_mutex);
+    for (const Published & published : recent) {
+        // 'recent' holds a handle, so the storage can't have been reused
+        if (published.frame.data() == frame.data() && published.frame.size() == frame.size()) {
+            frame_id = published.frame_id;
+            return true;
+        }
+    }
+    return false;
+}
+
+FrameBuffer MulticastSender::published(uint32_t frame_id) const {
+    lock_guard<mutex> guard(this->send_mutex);
+    for (const Published & published : recent) {
+        if (published.frame_id == frame_id) {
+            return published.frame;
+        }
+    }
+    return FrameBuffer();
+}
+
+uint32_t MulticastSender::publish(const FrameBuffer & frame, const FrameBuffer & payload, bool compressed) {
+    if (sock_fd < 0) {
+        return 0;
+    }
+
+    lock_guard<mutex> guard(this->send_mutex);
+    size_t total = payload.size();
+    size_t data_fragments = max<size_t>(1, (total + fragment_payload - 1) / fragment_payload);
+    if (data_fragments > UINT16_MAX || total > UINT32_MAX) {
+        LOG_WARN("multicast: frame too large {}", total);
+        return 0;
+    }
+    size_t groups = (data_fragments + parity_group_size - 1) / parity_group_size;
+    size_t datagrams = data_fragments + groups;
+    uint32_t frame_id = next_frame_id++;
+    if (next_frame_id == 0) {
+        next_frame_id = 1;
+    }
+
+    // kept from frame to frame, so they only grow with the first large one
+    headers.resize(datagrams * multicast_header_size);
+    parity.assign(groups * fragment_payload, 0);
+    iov.resize(datagrams * 2);
+    messages.resize(datagrams);
+
+    // data datagrams of each group, then its parity, so a burst of loss at
+    // the end of a frame costs one group rather than all the parity
+    const char * data = payload.data();
+    size_t datagram = 0;
+    for (size_t group = 0; group < groups; group++) {
+        size_t first = group * parity_group_size;
+        size_t last = min(first + parity_group_size, data_fragments);
+        char * group_parity = &parity[group * fragment_payload];
+        for (size_t index = first; index <= last; index++) {
+            bool is_parity = index == last;
+            size_t fragment_index = is_parity ? data_fragments + group : index;
+            size_t length = is_parity ? fragment_length(total, first) : fragment_length(total, index);
+            const char * bytes = is_parity ? group_parity : data + index * fragment_payload;
+            if (!is_parity) {
+                for (size_t i = 0; i < length; i++) {
+                    group_parity[i] ^= bytes[i];
+                }
+            }
+
+            char * header = &headers[datagram * multicast_header_size];
+            header[0] = 'M';
+            header[1] = 'R';
+            header[2] = 'M';
+            header[3] = static_cast<char>(multicast_version);
+            put_u32(header + 4, id);
+            put_u32(header + 8, frame_id);
+            put_u16(header + 12, static_cast<uint16_t>(fragment_index));
+            put_u16(header + 14, static_cast<uint16_t>(data_fragments));
+            header[16] = static_cast<char>(parity_group_size);
+            header[17] = static_cast<char>(compressed ? compressed_bit : 0);
+            put_u16(header + 18, 0);
+            put_u32(header + 20, static_cast<uint32_t>(total));
+
+            iov[datagram * 2] = {header, static_cast<size_t>(multicast_header_size)};
+            iov[datagram * 2 + 1] = {const_cast<char *>(bytes), length};
+            memset(&messages[datagram], 0, sizeof(mmsghdr));
+            messages[datagram].msg_hdr.msg_name = &destination;
+            messages[datagram].msg_hdr.msg_namelen = sizeof(destination);
+            messages[datagram].msg_hdr.msg_iov = &iov[datagram * 2];
+            messages[datagram].msg_hdr.msg_iovlen = length > 0 ? 2 : 1;
+            datagram += 1;
+        }
+    }
+
+    size_t sent = 0;
+    int waits = 0;
+    while (sent < datagrams) {
+        unsigned int count = static_cast<unsigned int>(min(datagrams - sent, datagrams_per_call));
+        int result = sendmmsg(sock_fd, &messages[sent], count, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == ENOBUFS || errno == EAGAIN) && waits < max_send_waits) {
+                // the interface queue is full; give it a moment to drain
+                waits += 1;
+                this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            datagrams_dropped += static_cast<long>(datagrams - sent);
+            LOG_WARN("multicast: frame {} cut short, {} of {} datagrams sent {} dropped:{}", frame_id, sent, datagrams,
+                     strerror(errno), datagrams_dropped);
+            break;
+        }
+        for (int i = 0; i < result; i++) {
+            bytes_sent += messages[sent + i].msg_len;
+        }
+        sent += result;
+    }
+    datagrams_sent += sent;
+    frames_sent += 1;
+
+    recent.push_back({frame_id, frame});
+    if (recent.size() > recent_frames) {
+        recent.pop_front();
+    }
+    return frame_id;
+}
+
+MulticastReceiver::~MulticastReceiver() {
+    if (sock_fd >= 0) {
+        ::close(sock_fd);
+    }
+}
+
+int MulticastReceiver::fd() const {
+    return sock_fd;
+}
+
+bool MulticastReceiver::open(const string & group, const string & port, const string & interface_address) {
+    ip_mreq membership;
+    memset(&membership, 0, sizeof(membership));
+    if (!resolve_address(group, membership.imr_multiaddr) || !resolve_address(interface_address, membership.imr_interface)) {
+        LOG_WARN("multicast: bad address {} / {}", group, interface_address);
+        return false;
+    }
+
+    sock_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        LOG_ERROR("multicast: socket failed {}", strerror(errno));
+        return false;
+    }
+
+    // several servers on one host each get every datagram
+    int reuse = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // a frame arrives as a burst of datagrams
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &socket_buffer_size, sizeof(socket_buffer_size));
+
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(stoi(port));
+    if (::bind(sock_fd, (sockaddr *) &local, sizeof(local)) < 0) {
+        LOG_ERROR("multicast: bind to {} failed {}", port, strerror(errno));
+        ::close(sock_fd);
+        sock_fd = -1;
+        return false;
+    }
+    if (setsockopt(sock_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        LOG_ERROR("multicast: join {} failed {}", group, strerror(errno));
+        ::close(sock_fd);
+        sock_fd = -1;
+        return false;
+    }
+
+    LOG_INFO("multicast: joined {}:{}", group, port);
+    return true;
+}
+
+bool MulticastReceiver::find(uint32_t sender_id, uint32_t frame_id, FrameBuffer & payload, bool & compressed) const {
+    for (const Completed & frame : completed) {
+        if (frame.sender_id == sender_id && frame.frame_id == frame_id) {
+            payload = frame.payload;
+            compressed = frame.compressed;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MulticastReceiver::handle_wake() {
+}
+
+void MulticastReceiver::handle_events(uint32_t events) {
+    static const size_t datagram_size = multicast_header_size + fragment_payload;
+    thread_local vector<char> buffers(datagrams_per_call * datagram_size);
+    iovec iov[datagrams_per_call];
+    mmsghdr messages[datagrams_per_call];
+
+    while (true) {
+        for (size_t i = 0; i < datagrams_per_call; i++) {
+            iov[i] = {&buffers[i * datagram_size], datagram_size};
+            memset(&messages[i], 0, sizeof(mmsghdr));
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(sock_fd, messages, datagrams_per_call, MSG_DONTWAIT, nullptr);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            receive_datagram(&buffers[i * datagram_size], messages[i].msg_len);
+        }
+    }
+}
+
+FrameBuffer MulticastReceiver::take_buffer(size_t size) {
+    for (size_t i = 0; i < spare_buffers.size(); i++) {
+        if (spare_buffers[i].size() == size && spare_buffers[i].use_count() == 1) {
+            FrameBuffer buffer = std::move(spare_buffers[i]);
+            spare_buffers.erase(spare_buffers.begin() + i);
+            return buffer;
+        }
+    }
+    return FrameBuffer::allocate(size);
+}
+
+MulticastReceiver::Reassembly * MulticastReceiver::reassembly_for(uint32_t sender_id, uint32_t frame_id, const char * header) {
+    Reassembly * oldest = nullptr;
+    for (Reassembly & reassembly : reassemblies) {
+        if (reassembly.active && reassembly.sender_id == sender_id && reassembly.frame_id == frame_id) {
+            return &reassembly;
+        }
+        if (oldest == nullptr || !reassembly.active || (oldest->active && reassembly.started < oldest->started)) {
+            oldest = &reassembly;
+        }
+    }
+
+    size_t data_fragments = get_u16(header + 14);
+    size_t group_size = static_cast<uint8_t>(header[16]);
+    size_t total = get_u32(header + 20);
+    if (data_fragments == 0 || group_size == 0 || data_fragments != max<size_t>(1, (total + fragment_payload - 1) / fragment_payload)) {
+        return nullptr;
+    }
+    size_t groups = (data_fragments + group_size - 1) / group_size;
+
+    // every slot busy: the oldest frame isn't going to complete any more
+    if (oldest->active) {
+        frames_lost += 1;
+        LOG_WARN("multicast: lost frame {} {}/{}", oldest->frame_id, oldest->received_count, oldest->data_fragments);
+    }
+
+    Reassembly & reassembly = *oldest;
+    reassembly.active = true;
+    reassembly.sender_id = sender_id;
+    reassembly.frame_id = frame_id;
+    reassembly.compressed = (header[17] & compressed_bit) != 0;
+    reassembly.started = frames_started++;
+    reassembly.data_fragments = data_fragments;
+    reassembly.group_size = group_size;
+    reassembly.received_count = 0;
+    reassembly.buffer = take_buffer(total);
+    reassembly.received.assign(data_fragments, 0);
+    reassembly.parity_received.assign(groups, 0);
+    reassembly.parity.resize(groups * fragment_payload);
+    return &reassembly;
+}
+
+void MulticastReceiver::receive_datagram(const char * datagram, size_t size) {
+    if (size < static_cast<size_t>(multicast_header_size) || datagram[0] != 'M' || datagram[1] != 'R' || datagram[2] != 'M' ||
+        static_cast<uint8_t>(datagram[3]) != multicast_version) {
+        return;
+    }
+    datagrams_received += 1;
+
+    uint32_t sender_id = get_u32(datagram + 4);
+    uint32_t frame_id = get_u32(datagram + 8);
+    for (const Completed & frame : completed) {
+        if (frame.sender_id == sender_id && frame.frame_id == frame_id) {
+            // parity for a frame that arrived whole
+            return;
+        }
+    }
+
+    Reassembly * reassembly = reassembly_for(sender_id, frame_id, datagram);
+    if (reassembly == nullptr || get_u16(datagram + 14) != reassembly->data_fragments) {
+        return;
+    }
+
+    size_t fragment_index = get_u16(datagram + 12);
+    size_t total = reassembly->buffer.size();
+    const char * bytes = datagram + multicast_header_size;
+    size_t length = size - multicast_header_size;
+    size_t group;
+    if (fragment_index < reassembly->data_fragments) {
+        if (reassembly->received[fragment_index] || length != fragment_length(total, fragment_index)) {
+            return;
+        }
+        memcpy(reassembly->buffer.writable_data() + fragment_index * fragment_payload, bytes, length);
+        reassembly->received[fragment_index] = 1;
+        reassembly->received_count += 1;
+        group = fragment_index / reassembly->group_size;
+    }
+    else {
+        group = fragment_index - reassembly->data_fragments;
+        if (group >= reassembly->parity_received.size() || reassembly->parity_received[group] ||
+            length != fragment_length(total, group * reassembly->group_size)) {
+            return;
+        }
+        memcpy(&reassembly->parity[group * fragment_payload], bytes, length);
+        reassembly->parity_received[group] = 1;
+    }
+
+    recover_group(*reassembly, group);
+    if (reassembly->received_count == reassembly->data_fragments) {
+        complete(*reassembly);
+    }
+}
+
+void MulticastReceiver::recover_group(Reassembly & reassembly, size_t group) {
+    if (!reassembly.parity_received[group]) {
+        return;
+    }
+    size_t first = group * reassembly.group_size;
+    size_t last = min(first + reassembly.group_size, reassembly.data_fragments);
+    size_t missing = last;
+    for (size_t index = first; index < last; index++) {
+        if (!reassembly.received[index]) {
+            if (missing != last) {
+                // more than one gone; parity can't help
+                return;
+            }
+            missing = index;
+        }
+    }
+    if (missing == last) {
+        return;
+    }
+
+    // the missing fragment is the parity with every other fragment xored out
+    size_t total = reassembly.buffer.size();
+    char * pixels = reassembly.buffer.writable_data();
+    char * destination = pixels + missing * fragment_payload;
+    size_t length = fragment_length(total, missing);
+    memcpy(destination, &reassembly.parity[group * fragment_payload], length);
+    for (size_t index = first; index < last; index++) {
+        if (index == missing) {
+            continue;
+        }
+        const char * other = pixels + index * fragment_payload;
+        size_t other_length = min(length, fragment_length(total, index));
+        for (size_t i = 0; i < other_length; i++) {
+            destination[i] ^= other[i];
+        }
+    }
+    reassembly.received[missing] = 1;
+    reassembly.received_count += 1;
+    datagrams_recovered += 1;
+}
+
+void MulticastReceiver::complete(Reassembly & reassembly) {
+    completed.push_back({reassembly.sender_id, reassembly.frame_id, reassembly.compressed, std::move(reassembly.buffer)});
+    reassembly.active = false;
+    frames_received += 1;
+
+    if (completed.size() > recent_frames) {
+        // keep the buffer for a later frame if nobody else holds it
+        FrameBuffer oldest = std::move(completed.front().payload);
+        completed.pop_front();
+        if (oldest.use_count() == 1 && spare_buffers.size() < recent_frames) {
+            spare_buffers.push_back(std::move(oldest));
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _WINDOWS
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "reactor.h"
+#include "frame_buffer.h"
+
+using namespace std;
+
+// frames broadcast once over UDP multicast to every server in a group;
+// the TCP connections then carry only a reference to the frame (see
+// Comm::set_multicast and Comm::join_multicast). each frame is split into
+// datagrams with one XOR parity datagram per group of them, so a receiver
+// rebuilds a lost datagram per group on its own; a server that still
+// misses the frame asks for it again over TCP.
+
+class MulticastSender {
+public:
+    MulticastSender();
+    ~MulticastSender();
+
+    // group is an IPv4 multicast address; interface_address picks the
+    // outgoing interface (127.0.0.1 to test on one box), default any
+    bool open(const string & group, const string & port, const string & interface_address = "");
+    // true if 'frame' went out recently, with the id it went out as
+    bool find(const FrameBuffer & frame, uint32_t & frame_id) const;
+    // sends 'payload' (the frame itself, or its encode_frame() stream) and
+    // returns the id it is known by; 0 if it couldn't be sent
+    uint32_t publish(const FrameBuffer & frame, const FrameBuffer & payload, bool compressed);
+    // a recently published frame, empty if it is no longer held
+    FrameBuffer published(uint32_t frame_id) const;
+    uint32_t sender_id() const;
+
+    long frames_sent = 0;
+    long datagrams_sent = 0;
+    // not sent as the interface queue stayed full
+    long datagrams_dropped = 0;
+    long long bytes_sent = 0;
+
+private:
+    struct Published {
+        uint32_t frame_id;
+        FrameBuffer frame;
+    };
+
+    int sock_fd = -1;
+    sockaddr_in destination;
+    uint32_t id = 0;
+    uint32_t next_frame_id = 1;
+    mutable mutex send_mutex;
+    // the last few frames, for find() and resend requests
+    deque<Published> recent;
+    vector<char> headers;
+    vector<char> parity;
+    vector<iovec> iov;
+    vector<mmsghdr> messages;
+};
+
+// reassembles multicast frames on the reactor thread and keeps the last
+// few of them, so references arriving over TCP resolve without a copy
+class MulticastReceiver : public ReactorHandler {
+public:
+    ~MulticastReceiver();
+
+    bool open(const string & group, const string & port, const string & interface_address = "");
+    int fd() const;
+    // reactor thread only; 'payload' may hold an encode_frame() stream
+    bool find(uint32_t sender_id, uint32_t frame_id, FrameBuffer & payload, bool & compressed) const;
+
+    void handle_events(uint32_t events) override;
+    void handle_wake() override;
+
+    long datagrams_received = 0;
+    long frames_received = 0;
+    long datagrams_recovered = 0;
+    long frames_lost = 0;
+
+private:
+    struct Reassembly {
+        bool active = false;
+        uint32_t sender_id = 0;
+        uint32_t frame_id = 0;
+        bool compressed = false;
+        long started = 0;
+        size_t data_fragments = 0;
+        size_t group_size = 0;
+        size_t received_count = 0;
+        FrameBuffer buffer;
+        vector<uint8_t> received;
+        vector<uint8_t> parity_received;
+        vector<char> parity;
+    };
+
+    struct Completed {
+        uint32_t sender_id;
+        uint32_t frame_id;
+        bool compressed;
+        FrameBuffer payload;
+    };
+
+    void receive_datagram(const char * datagram, size_t size);
+    Reassembly * reassembly_for(uint32_t sender_id, uint32_t frame_id, const char * header);
+    void recover_group(Reassembly & reassembly, size_t group);
+    void complete(Reassembly & reassembly);
+    FrameBuffer take_buffer(size_t size);
+
+    int sock_fd = -1;
+    long frames_started = 0;
+    vector<Reassembly> reassemblies = vector<Reassembly>(4);
+    deque<Completed> completed;
+    // payloads nobody holds any more, reused for the next frames
+    vector<FrameBuffer> spare_buffers;
+};
+
+#endif //MULTICAST_H
@@ -0,0 +1,208 @@
+#include "noise_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
+
+// A 32 bit hash (xorshift-multiply rounds, low bias): distinct counters give
+// distinct values, and each bit of the counter reaches the top 8 bits taken
+// as the level.
+static inline uint32_t mixCounter(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// y reflected into 0..n-1 the way GaussianBlur's default border does (the
+// edge itself not repeated)
+static inline int reflect(int y, int n) {
+    if (n == 1) {
+        return 0;
+    }
+    y = y < 0 ? -y : y;
+    y = y >= n ? 2 * n - 2 - y : y;
+    return std::min(std::max(y, 0), n - 1);
+}
+
+// The level after the vertical pass, summed to 256 times it: rounded, then
+// the contrast doubled around 128
+static inline uchar stretchedLevel(int sum) {
+    int level = 2 * ((sum + 128) >> 8) - 128;
+    return static_cast<uchar>(std::min(std::max(level, 0), 255));
+}
+
+#if CV_SIMD
+static const uint32_t laneOffsets[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+static inline cv::v_uint32 counterLevels(cv::v_uint32 x) {
+    x = x ^ cv::v_shr<16>(x);
+    x = x * cv::vx_setall_u32(0x7feb352dU);
+    x = x ^ cv::v_shr<15>(x);
+    x = x * cv::vx_setall_u32(0x846ca68bU);
+    x = x ^ cv::v_shr<16>(x);
+    return cv::v_shr<24>(x);
+}
+
+// a + 4b + 6c + 4d + e
+static inline cv::v_uint16 binomial(const cv::v_uint16& a, const cv::v_uint16& b, const cv::v_uint16& c,
+                                    const cv::v_uint16& d, const cv::v_uint16& e) {
+    return a + e + cv::v_shl<2>(b + d) + cv::v_shl<2>(c) + cv::v_shl<1>(c);
+}
+
+static inline cv::v_uint16 stretchedLevels(const cv::v_uint16& sum) {
+    const cv::v_uint16 mid = cv::vx_setall_u16(128);
+    // subtracting saturates at 0, and packing at 255
+    return cv::v_shl<1>(cv::v_shr<8>(sum + mid)) - mid;
+}
+#endif
+
+NoiseSource::NoiseSource(int width, int height, int frames, bool filter, Mode mode, uint32_t seed)
+    : cols(width), rows(height), frameCount(std::max(frames, 0)), filter(filter), sourceMode(mode),
+      key(mixCounter(seed)), counter(0), setup(0) {
+    auto begin = std::chrono::steady_clock::now();
+    if (sourceMode == Bank) {
+        frameCount = std::max(frameCount, 1);
+        for (int f = 0; f < frameCount; ++f) {
+            cv::Mat noise(rows, cols, CV_8UC1);
+            NoiseRows noiseRows(*this, f, 0);
+            for (int y = 0; y < rows; ++y) {
+                std::memcpy(noise.ptr<uchar>(y), noiseRows.next(), cols);
+            }
+            bankFrames.push_back(noise);
+        }
+    }
+    setup = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+uint32_t NoiseSource::next() {
+    uint32_t frame = counter;
+    counter = frameCount > 0 ? (counter + 1) % frameCount : counter + 1;
+    return frame;
+}
+
+const cv::Mat& NoiseSource::frame(uint32_t frame, cv::Mat& out) const {
+    if (sourceMode == Bank) {
+        return bankFrames[frame % bankFrames.size()];
+    }
+    out.create(rows, cols, CV_8UC1);
+    NoiseRows noiseRows(*this, frame, 0);
+    for (int y = 0; y < rows; ++y) {
+        std::memcpy(out.ptr<uchar>(y), noiseRows.next(), cols);
+    }
+    return out;
+}
+
+size_t NoiseSource::memoryBytes() const {
+    if (sourceMode == Bank) {
+        return static_cast<size_t>(frameCount) * cols * rows;
+    }
+    // what each band's NoiseRows holds while it renders
+    return (cols + 4) + 5 * cols * sizeof(ushort) + cols;
+}
+
+void NoiseSource::rawRow(uint32_t frame, int y, uchar* out) const {
+    // The frame goes into the key and the level's index into the counter, so
+    // no two of the 2^32 frames share their levels
+    const uint32_t frameKey = key ^ mixCounter(frame);
+    const uint32_t start = static_cast<uint32_t>(y * cols);
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_uint32::nlanes;
+    const cv::v_uint32 step = cv::vx_setall_u32(lanes);
+    const cv::v_uint32 keys = cv::vx_setall_u32(frameKey);
+    cv::v_uint32 counters = cv::vx_setall_u32(start) + cv::vx_load(laneOffsets);
+    for (; x <= cols - 4 * lanes; x += 4 * lanes) {
+        cv::v_uint32 c1 = counters + step;
+        cv::v_uint32 c2 = c1 + step;
+        cv::v_uint32 c3 = c2 + step;
+        cv::v_uint16 low = cv::v_pack(counterLevels(counters ^ keys), counterLevels(c1 ^ keys));
+        cv::v_uint16 high = cv::v_pack(counterLevels(c2 ^ keys), counterLevels(c3 ^ keys));
+        cv::v_store(out + x, cv::v_pack(low, high));
+        counters = c3 + step;
+    }
+#endif
+    for (; x < cols; ++x) {
+        out[x] = static_cast<uchar>(mixCounter((start + x) ^ frameKey) >> 24);
+    }
+}
+
+NoiseRows::NoiseRows(const NoiseSource& source, uint32_t frame, int first)
+    : source(source), frame(frame), first(first), y(first), out(source.cols) {
+    if (source.filter) {
+        raw.resize(source.cols + 4);
+        ring.resize(5 * source.cols);
+        for (int k = 0; k < 5; ++k) {
+            window[k] = &ring[k * source.cols];
+            filterRow(first - 2 + k, window[k]);
+        }
+    }
+}
+
+void NoiseRows::filterRow(int row, ushort* h) {
+    const int width = source.cols;
+    uchar* r = raw.data();
+    source.rawRow(frame, reflect(row, source.rows), r + 2);
+    for (int p : {0, 1, width + 2, width + 3}) {
+        r[p] = r[2 + reflect(p - 2, width)];
+    }
+
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_uint8::nlanes;
+    for (; x <= width - lanes; x += lanes) {
+        cv::v_uint16 a0, a1, b0, b1, c0, c1, d0, d1, e0, e1;
+        cv::v_expand(cv::vx_load(r + x), a0, a1);
+        cv::v_expand(cv::vx_load(r + x + 1), b0, b1);
+        cv::v_expand(cv::vx_load(r + x + 2), c0, c1);
+        cv::v_expand(cv::vx_load(r + x + 3), d0, d1);
+        cv::v_expand(cv::vx_load(r + x + 4), e0, e1);
+        cv::v_store(h + x, binomial(a0, b0, c0, d0, e0));
+        cv::v_store(h + x + lanes / 2, binomial(a1, b1, c1, d1, e1));
+    }
+#endif
+    for (; x < width; ++x) {
+        h[x] = static_cast<ushort>(r[x] + 4 * (r[x + 1] + r[x + 3]) + 6 * r[x + 2] + r[x + 4]);
+    }
+}
+
+const uchar* NoiseRows::next() {
+    uchar* o = out.data();
+    if (!source.filter) {
+        source.rawRow(frame, y++, o);
+        return o;
+    }
+    if (y > first) {
+        // the oldest row out, the one two below y in
+        ushort* oldest = window[0];
+        std::copy(window + 1, window + 5, window);
+        window[4] = oldest;
+        filterRow(y + 2, window[4]);
+    }
+    y++;
+
+    const ushort* h0 = window[0];
+    const ushort* h1 = window[1];
+    const ushort* h2 = window[2];
+    const ushort* h3 = window[3];
+    const ushort* h4 = window[4];
+    const int width = source.cols;
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_uint8::nlanes;
+    const int half = lanes / 2;
+    for (; x <= width - lanes; x += lanes) {
+        cv::v_uint16 low = binomial(cv::vx_load(h0 + x), cv::vx_load(h1 + x), cv::vx_load(h2 + x),
+                                    cv::vx_load(h3 + x), cv::vx_load(h4 + x));
+        cv::v_uint16 high = binomial(cv::vx_load(h0 + x + half), cv::vx_load(h1 + x + half), cv::vx_load(h2 + x + half),
+                                     cv::vx_load(h3 + x + half), cv::vx_load(h4 + x + half));
+        cv::v_store(o + x, cv::v_pack(stretchedLevels(low), stretchedLevels(high)));
+    }
+#endif
+    for (; x < width; ++x) {
+        o[x] = stretchedLevel(h0[x] + 4 * (h1[x] + h3[x]) + 6 * h2[x] + h4[x]);
+    }
+    return o;
+}
@@ -0,0 +1,85 @@
+#ifndef NOISE_SOURCE_H
+#define NOISE_SOURCE_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cstdint>
+
+
+// The noise mixed into each frame. Level i of frame f is a hash of i, keyed
+// by the seed and a hash of f, so any frame or row can be made on its own,
+// in any order, the same on every machine: integer math
+// only, and the SIMD and scalar paths give the same bits. Filtered noise goes
+// through the 5x5 binomial kernel GaussianBlur uses for that size, then has
+// its contrast doubled around 128.
+//
+// A Bank makes its frames once and cycles through them; Procedural keeps
+// nothing and makes each row as the render needs it (see NoiseRows), taking
+// a little longer each frame instead of the bank's memory and startup.
+class NoiseSource {
+public:
+    enum Mode { Bank, Procedural };
+
+    // 'frames' frames in turn; 0 (Procedural only) repeats only after 2^32
+    // frames (4.5 years at 30fps)
+    NoiseSource(int width, int height, int frames, bool filter, Mode mode, uint32_t seed = 1);
+
+    int width() const { return cols; }
+    int height() const { return rows; }
+    Mode mode() const { return sourceMode; }
+    bool filtered() const { return filter; }
+
+    // The frame for the next blend, each call the one after
+    uint32_t next();
+
+    // Frame 'frame' in full: the stored one of a Bank, else made into 'out'
+    const cv::Mat& frame(uint32_t frame, cv::Mat& out) const;
+    // The stored frames (empty when Procedural)
+    const std::vector<cv::Mat>& bank() const { return bankFrames; }
+
+    // What making the source took, and what it keeps
+    double setupSeconds() const { return setup; }
+    size_t memoryBytes() const;
+
+private:
+    friend class NoiseRows;
+
+    // Unfiltered levels of one row, into out[0..width)
+    void rawRow(uint32_t frame, int y, uchar* out) const;
+
+    int cols, rows;
+    int frameCount;
+    bool filter;
+    Mode sourceMode;
+    uint32_t key;
+    uint32_t counter;
+    std::vector<cv::Mat> bankFrames;
+    double setup;
+};
+
+// Makes the rows of one frame of a NoiseSource in order from 'first', one
+// row at a time, keeping just the five rows the filter looks at: a band of
+// the render makes its noise this way, a row just before it's mixed
+class NoiseRows {
+public:
+    NoiseRows(const NoiseSource& source, uint32_t frame, int first);
+
+    // Row 'first', then the row after it each call
+    const uchar* next();
+
+private:
+    void filterRow(int y, ushort* out);
+
+    const NoiseSource& source;
+    uint32_t frame;
+    int first;
+    int y;
+    // A raw row with two reflected levels on each side, the five filtered
+    // horizontally (rows y-2..y+2, reflected at the edges) and the output
+    std::vector<uchar> raw;
+    std::vector<ushort> ring;
+    ushort* window[5];
+    std::vector<uchar> out;
+};
+
+#endif // NOISE_SOURCE_H
@@ -0,0 +1,164 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "reactor.h"
+#include "logger.h"
+
+static const int max_events = 64;
+
+Reactor & Reactor::instance() {
+    // created on first use, lives until the process exits
+    static Reactor reactor;
+    return reactor;
+}
+
+Reactor::Reactor() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        LOG_ERROR("reactor setup failed {}", strerror(errno));
+        return;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;  // nullptr marks the wake eventfd
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+    reactor_thread = new thread(&Reactor::execute_reactor, this);
+    reactor_thread_id = reactor_thread->get_id();
+}
+
+Reactor::~Reactor() {
+    keep_going = false;
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) < 0) {
+        LOG_ERROR("reactor wake failed {}", strerror(errno));
+    }
+    if (reactor_thread) {
+        reactor_thread->join();
+        delete reactor_thread;
+        reactor_thread = nullptr;
+    }
+    ::close(wake_fd);
+    ::close(epoll_fd);
+}
+
+bool Reactor::on_reactor_thread() const {
+    return this_thread::get_id() == reactor_thread_id;
+}
+
+bool Reactor::add(int fd, uint32_t events, ReactorHandler * handler) {
+    // a new handler may reuse the address of one removed in this cycle
+    if (on_reactor_thread()) {
+        removed_handlers.erase(handler);
+    }
+    else {
+        lock_guard<mutex> guard(this->dispatch_mutex);
+        removed_handlers.erase(handler);
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOG_ERROR("reactor add failed fd:{} {}", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Reactor::modify(int fd, uint32_t events, ReactorHandler * handler) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        LOG_ERROR("reactor modify failed fd:{} {}", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void Reactor::remove(int fd, ReactorHandler * handler) {
+    if (fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    {
+        lock_guard<mutex> guard(this->wakes_mutex);
+        pending_wakes.erase(std::remove(pending_wakes.begin(), pending_wakes.end(), handler), pending_wakes.end());
+    }
+
+    if (on_reactor_thread()) {
+        // called from a handler; dispatch_mutex is already held
+        removed_handlers.insert(handler);
+        return;
+    }
+
+    // waits for a dispatch in progress to finish
+    lock_guard<mutex> guard(this->dispatch_mutex);
+    removed_handlers.insert(handler);
+}
+
+void Reactor::wake(ReactorHandler * handler) {
+    {
+        lock_guard<mutex> guard(this->wakes_mutex);
+        pending_wakes.push_back(handler);
+    }
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("reactor wake failed {}", strerror(errno));
+    }
+}
+
+void Reactor::dispatch_wakes() {
+    uint64_t count;
+    while (::read(wake_fd, &count, sizeof(count)) > 0) {
+    }
+
+    vector<ReactorHandler *> wakes;
+    {
+        lock_guard<mutex> guard(this->wakes_mutex);
+        wakes.swap(pending_wakes);
+    }
+    for (ReactorHandler * handler : wakes) {
+        if (removed_handlers.count(handler) == 0) {
+            handler->handle_wake();
+        }
+    }
+}
+
+void Reactor::execute_reactor() {
+    epoll_event events[max_events];
+
+    while (keep_going) {
+        int event_count = epoll_wait(epoll_fd, events, max_events, -1);
+        if (event_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("reactor epoll_wait error {}", strerror(errno));
+            break;
+        }
+
+        lock_guard<mutex> guard(this->dispatch_mutex);
+        for (int i = 0; i < event_count; i++) {
+            auto handler = static_cast<ReactorHandler *>(events[i].data.ptr);
+            if (handler == nullptr) {
+                dispatch_wakes();
+            }
+            else if (removed_handlers.count(handler) == 0) {
+                handler->handle_events(events[i].events);
+            }
+        }
+        removed_handlers.clear();
+    }
+
+    LOG_INFO("exited reactor thread");
+}
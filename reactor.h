@@ -0,0 +1,58 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+// receives the events of one registered file descriptor; all calls are
+// made on the reactor thread
+struct ReactorHandler {
+    virtual ~ReactorHandler() = default;
+    // events are the EPOLL* bits reported for the descriptor
+    virtual void handle_events(uint32_t events) = 0;
+    // called after Reactor::wake, e.g. when another thread queued data to send
+    virtual void handle_wake() = 0;
+};
+
+// one thread multiplexing the sockets of every Comm with epoll; other
+// threads hand work to it through wake(), which signals an eventfd
+class Reactor {
+public:
+    static Reactor & instance();
+
+    bool add(int fd, uint32_t events, ReactorHandler * handler);
+    bool modify(int fd, uint32_t events, ReactorHandler * handler);
+    // once remove returns the handler is not called again and may be deleted
+    void remove(int fd, ReactorHandler * handler);
+    // schedules handler->handle_wake() on the reactor thread
+    void wake(ReactorHandler * handler);
+    bool on_reactor_thread() const;
+
+private:
+    Reactor();
+    ~Reactor();
+    void execute_reactor();
+    void dispatch_wakes();
+
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    atomic<bool> keep_going{true};
+    thread * reactor_thread = nullptr;
+    thread::id reactor_thread_id;
+
+    // held while handlers run so remove() can wait for a callback in progress
+    mutex dispatch_mutex;
+    // handlers removed since the last epoll_wait; their stale events are skipped
+    set<ReactorHandler *> removed_handlers;
+
+    mutex wakes_mutex;
+    vector<ReactorHandler *> pending_wakes;
+};
+
+#endif //REACTOR_H
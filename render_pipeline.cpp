@@ -0,0 +1,81 @@
+#include "render_pipeline.h"
+#include "logger.h"
+
+constexpr int TripleBuffer::fresh;
+
+TripleBuffer::TripleBuffer(int rows, int cols, int type) {
+    for (auto & frame : frames) {
+        frame.image.create(rows, cols, type);
+        frame.image.setTo(0);
+    }
+}
+
+void TripleBuffer::publish() {
+    int previous = middle.exchange(back_index | fresh, std::memory_order_acq_rel);
+    if (previous & fresh) {
+        overwritten_count += 1;
+    }
+    back_index = previous & ~fresh;
+}
+
+bool TripleBuffer::take() {
+    if ((middle.load(std::memory_order_acquire) & fresh) == 0) {
+        return false;
+    }
+    // only publish() sets fresh, so the frame swapped out is a fresh one
+    front_index = middle.exchange(front_index, std::memory_order_acq_rel) & ~fresh;
+    return true;
+}
+
+RenderStage::RenderStage(TripleBuffer & buffer, RenderFunction render)
+    : buffer(buffer), render(render) {
+    render_thread = thread(&RenderStage::execute_render, this);
+}
+
+RenderStage::~RenderStage() {
+    {
+        lock_guard<mutex> guard(job_mutex);
+        keep_going = false;
+    }
+    job_condition.notify_one();
+    render_thread.join();
+}
+
+void RenderStage::submit(const RenderJob & job) {
+    {
+        lock_guard<mutex> guard(job_mutex);
+        if (has_pending) {
+            replaced += 1;
+            LOG_DEBUG("render: frame {} replaced by {} before it started", pending.frame, job.frame);
+        }
+        pending = job;
+        has_pending = true;
+    }
+    job_condition.notify_one();
+}
+
+void RenderStage::execute_render() {
+    RenderJob job;
+    while (true) {
+        {
+            unique_lock<mutex> lock(job_mutex);
+            job_condition.wait(lock, [this] { return !keep_going || has_pending; });
+            if (!keep_going) {
+                break;
+            }
+            // the images of the previous job are let go here
+            job = std::move(pending);
+            has_pending = false;
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        RenderedFrame & frame = buffer.back();
+        render(job, frame.image);
+        frame.frame = job.frame;
+        frame.due = job.due;
+        frame.finished = std::chrono::steady_clock::now();
+        render_time.record(frame.finished, begin);
+        buffer.publish();
+    }
+    LOG_DEBUG("render thread exited");
+}
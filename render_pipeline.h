@@ -0,0 +1,111 @@
+#ifndef RENDER_PIPELINE_H
+#define RENDER_PIPELINE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+
+#include "latency_histogram.h"
+#include "frame_buffer.h"
+
+using namespace std;
+
+// a frame for the render thread: what to blend, and the boundary it is for.
+// the images are shared with the loop that made the job, which replaces
+// them with new Mats rather than writing into them; they may point into
+// received frames, which pixels1 and pixels2 keep until the job is done
+struct RenderJob {
+    long frame = -1;
+    std::chrono::steady_clock::time_point due;
+    cv::Mat image1;
+    cv::Mat image2;
+    FrameBuffer pixels1;
+    FrameBuffer pixels2;
+    float fade = 0;
+    float image_weight = 0;
+    float noise_weight = 0;
+    float gamma = 0;
+    float gain = 0;
+};
+
+struct RenderedFrame {
+    cv::Mat image;
+    // of the job rendered; -1 before the first
+    long frame = -1;
+    std::chrono::steady_clock::time_point due;
+    std::chrono::steady_clock::time_point finished;
+};
+
+// three output frames between one thread rendering and one presenting:
+// one being rendered (back), the newest finished (middle) and the one shown
+// (front). finishing swaps back and middle and taking swaps middle and
+// front, each one atomic exchange, so neither side ever waits for the
+// other, and what's taken is always the newest frame finished.
+class TripleBuffer {
+public:
+    TripleBuffer(int rows, int cols, int type);
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer & operator=(const TripleBuffer &) = delete;
+
+    // the render side: the frame to render into, then publish() it
+    RenderedFrame & back() { return frames[back_index]; }
+    void publish();
+    // frames published and replaced by a newer one before they were taken
+    long overwritten() const { return overwritten_count.load(); }
+
+    // the presenting side: makes the newest finished frame front(); false
+    // if none was published since the last take, front() then being the
+    // same as before
+    bool take();
+    RenderedFrame & front() { return frames[front_index]; }
+
+private:
+    // set in 'middle' while the frame there hasn't been taken
+    static constexpr int fresh = 4;
+
+    RenderedFrame frames[3];
+    int back_index = 0;
+    int front_index = 1;
+    atomic<int> middle{2};
+    atomic<long> overwritten_count{0};
+};
+
+// renders jobs on a thread of its own into a TripleBuffer. submit() hands
+// over a job without waiting; one submitted while the thread is busy waits
+// for it, replacing any job still waiting (the newest is the one wanted)
+class RenderStage {
+public:
+    typedef function<void(const RenderJob & job, cv::Mat & output)> RenderFunction;
+
+    RenderStage(TripleBuffer & buffer, RenderFunction render);
+    ~RenderStage();
+    RenderStage(const RenderStage &) = delete;
+    RenderStage & operator=(const RenderStage &) = delete;
+
+    void submit(const RenderJob & job);
+
+    // jobs replaced by a newer one before they were started
+    atomic<long> replaced{0};
+    // from starting a job to publishing its frame
+    LatencyHistogram render_time;
+
+private:
+    void execute_render();
+
+    TripleBuffer & buffer;
+    RenderFunction render;
+
+    mutex job_mutex;
+    condition_variable job_condition;
+    RenderJob pending;
+    bool has_pending = false;
+    bool keep_going = true;
+    thread render_thread;
+};
+
+#endif //RENDER_PIPELINE_H
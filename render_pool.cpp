@@ -0,0 +1,106 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
+
+#include "render_pool.h"
+#include "logger.h"
+
+constexpr int RenderPool::max_bands;
+
+RenderPool::RenderPool(int threads) {
+    int cores = static_cast<int>(thread::hardware_concurrency());
+    if (cores < 1) {
+        cores = 1;
+    }
+    if (threads <= 0) {
+        threads = cores;
+    }
+    band_times.reset(new LatencyHistogram[max_bands]);
+
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&RenderPool::execute_worker, this, i);
+
+        // one core each, so a band isn't moved between cores mid-frame
+        cpu_set_t cores_allowed;
+        CPU_ZERO(&cores_allowed);
+        CPU_SET(i % cores, &cores_allowed);
+        int result = pthread_setaffinity_np(workers.back().native_handle(), sizeof(cores_allowed), &cores_allowed);
+        if (result != 0) {
+            LOG_WARN("render worker {} not pinned to core {}: {}", i, i % cores, strerror(result));
+        }
+    }
+    LOG_INFO("render pool of {} threads on {} cores", threads, cores);
+}
+
+RenderPool::~RenderPool() {
+    {
+        lock_guard<mutex> guard(run_mutex);
+        keep_going = false;
+    }
+    start_condition.notify_all();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
+
+const LatencyHistogram & RenderPool::band_time(int band) const {
+    return band_times[std::min(std::max(band, 0), max_bands - 1)];
+}
+
+void RenderPool::run(int bands, const function<void(int, int)> & band) {
+    bands = std::min(std::max(bands, 1), max_bands);
+    auto begin = std::chrono::steady_clock::now();
+    unique_lock<mutex> lock(run_mutex);
+    // a worker late to the previous run may still be looking for bands
+    done_condition.wait(lock, [this] { return active == 0; });
+    band_function = &band;
+    band_count = bands;
+    remaining = bands;
+    next_band = 0;
+    generation += 1;
+    lock.unlock();
+    start_condition.notify_all();
+
+    lock.lock();
+    done_condition.wait(lock, [this] { return remaining == 0 && active == 0; });
+    band_function = nullptr;
+    lock.unlock();
+    run_times.record(std::chrono::steady_clock::now(), begin);
+}
+
+int RenderPool::take_bands() {
+    int taken = 0;
+    for (int i = next_band.fetch_add(1); i < band_count; i = next_band.fetch_add(1)) {
+        auto begin = std::chrono::steady_clock::now();
+        (*band_function)(i, band_count);
+        band_times[i].record(std::chrono::steady_clock::now(), begin);
+        taken += 1;
+    }
+    return taken;
+}
+
+void RenderPool::execute_worker(int index) {
+    uint64_t seen = 0;
+    unique_lock<mutex> lock(run_mutex);
+    while (true) {
+        start_condition.wait(lock, [this, seen] { return !keep_going || generation != seen; });
+        if (!keep_going) {
+            break;
+        }
+        seen = generation;
+        active += 1;
+        lock.unlock();
+
+        int taken = take_bands();
+
+        lock.lock();
+        active -= 1;
+        remaining -= taken;
+        if (active == 0) {
+            done_condition.notify_all();
+        }
+    }
+    lock.unlock();
+    LOG_DEBUG("render worker {} exited", index);
+}
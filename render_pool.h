@@ -0,0 +1,69 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+#include "latency_histogram.h"
+
+using namespace std;
+
+// worker threads created once, each pinned to its own core, that render a
+// frame split into bands: run() hands out band 0..bands-1 to whichever
+// worker is free, and returns once every band is done (the one barrier of
+// the frame). with more bands than workers the quicker ones take more.
+// how long each band took is kept, to see how the work splits and how the
+// render scales with the number of cores used.
+class RenderPool {
+public:
+    // 0 threads is one per core
+    explicit RenderPool(int threads = 0);
+    ~RenderPool();
+    RenderPool(const RenderPool &) = delete;
+    RenderPool & operator=(const RenderPool &) = delete;
+
+    int threads() const { return static_cast<int>(workers.size()); }
+
+    // calls band(i, bands) for each i on the workers, and waits for them;
+    // from one thread at a time
+    void run(int bands, const function<void(int band, int bands)> & band);
+
+    // the times band 'band' has taken, over every run it was part of
+    const LatencyHistogram & band_time(int band) const;
+    // the time each run took, from handing out the bands to the last finishing
+    const LatencyHistogram & run_time() const { return run_times; }
+    static constexpr int max_bands = 64;
+
+private:
+    void execute_worker(int index);
+    // takes bands of the current run until there are none left, returning
+    // how many it took
+    int take_bands();
+
+    vector<thread> workers;
+    atomic<bool> keep_going{true};
+
+    mutex run_mutex;
+    condition_variable start_condition;
+    condition_variable done_condition;
+    // bumped for each run, so a worker knows there's a new one
+    uint64_t generation = 0;
+    const function<void(int, int)> * band_function = nullptr;
+    int band_count = 0;
+    atomic<int> next_band{0};
+    // bands not finished yet, and workers taking bands: the run is over
+    // when both are 0, and the next waits for that before changing anything
+    int remaining = 0;
+    int active = 0;
+
+    unique_ptr<LatencyHistogram[]> band_times;
+    LatencyHistogram run_times;
+};
+
+#endif //RENDER_POOL_H
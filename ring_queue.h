@@ -0,0 +1,108 @@
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// bounded lock-free queue for any number of producers and consumers
+// (Vyukov's array queue); used single-consumer by Comm, where the
+// reactor thread is one side and the application thread the other.
+// capacity is rounded up to a power of two.
+template <typename T>
+class RingQueue {
+public:
+    explicit RingQueue(size_t requested_capacity) {
+        capacity = 2;
+        while (capacity < requested_capacity) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingQueue(const RingQueue &) = delete;
+    RingQueue & operator=(const RingQueue &) = delete;
+
+    // returns false when the queue is full
+    bool push(const T & value) {
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        Cell * cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // returns false when the queue is empty
+    bool pop(T & value) {
+        size_t position = dequeue_position.load(std::memory_order_relaxed);
+        Cell * cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = dequeue_position.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // approximate while other threads are pushing or popping
+    size_t size() const {
+        size_t enqueued = enqueue_position.load(std::memory_order_acquire);
+        size_t dequeued = dequeue_position.load(std::memory_order_acquire);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static const size_t cache_line = 64;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t capacity;
+    size_t mask;
+    // kept on separate cache lines so producers and consumers don't contend
+    alignas(cache_line) std::atomic<size_t> enqueue_position{0};
+    alignas(cache_line) std::atomic<size_t> dequeue_position{0};
+};
+
+#endif //RING_QUEUE_H
@@ -17,6 +17,10 @@
 // #include <pthread.h>
 
 #include "comms.h"
+#include "live_stats.h"
+#include "logger.h"
+#include "render_pipeline.h"
+#include "frame_clock.h"
 
 #define APPLY_LOW_PASS_FILTER true // low pass filter the noise Set to false to disable low-pass filtering
 
@@ -79,19 +83,94 @@ void parseString(const std::string &input_string, Server_Parameters_Main &params
 
     if (First_Time)
     {
-        std::cout << "Parameter 0: " << params.Screen_H_Size << std::endl;
-        std::cout << "Parameter 1: " << params.Screen_V_Size << std::endl;
-        std::cout << "Parameter 2: " << params.Noise_Gain << std::endl;
-        std::cout << "Parameter 3: " << params.Input_Gain << std::endl;
-        std::cout << "Parameter 4: " << params.Output_Gain << std::endl;
-        std::cout << "Parameter 5: " << params.Gamma_Gain << std::endl;
-        std::cout << "Parameter 6: " << params.Cycle_Time << std::endl;
-        std::cout << "Parameter 7: " << params.Fade_Time << std::endl;
-        std::cout << "Parameter 8: " << params.Full_Screen_Enable << std::endl;
+        LOG_INFO("Parameter 0: {}", params.Screen_H_Size);
+        LOG_INFO("Parameter 1: {}", params.Screen_V_Size);
+        LOG_INFO("Parameter 2: {}", params.Noise_Gain);
+        LOG_INFO("Parameter 3: {}", params.Input_Gain);
+        LOG_INFO("Parameter 4: {}", params.Output_Gain);
+        LOG_INFO("Parameter 5: {}", params.Gamma_Gain);
+        LOG_INFO("Parameter 6: {}", params.Cycle_Time);
+        LOG_INFO("Parameter 7: {}", params.Fade_Time);
+        LOG_INFO("Parameter 8: {}", params.Full_Screen_Enable);
         First_Time = false;
     }
 }
 
+// makes 'image' an 8-bit gray frame of 'size' holding a received frame, and
+// 'pixels' the frame it points into: the received one itself when it's
+// already our size and format, else a pooled one it's converted into.
+// false if it can't be used
+bool frame_to_mat(const MessageData *message_data, cv::Size size, cv::Mat &image, FrameBuffer &pixels)
+{
+    const FrameBuffer &data = message_data->image_data;
+    if (message_data->pixel_format == MessageData::UNKNOWN_FORMAT)
+    {
+        // a v1 header carries no geometry; only a frame of exactly our size will do
+        if (data.size() != static_cast<size_t>(size.area()))
+        {
+            LOG_WARN("dropped frame '{}' of unexpected size {}", message_data->image_name, data.size());
+            return false;
+        }
+        pixels = data;
+        image = cv::Mat(size, CV_8UC1, const_cast<char *>(data.data()));
+        return true;
+    }
+
+    int channels = message_data->pixel_format == MessageData::BGR24 ? 3 : 1;
+    size_t stride = message_data->stride;
+    if (message_data->width == 0 || message_data->height == 0 || stride < (size_t)message_data->width * channels ||
+        data.size() < stride * message_data->height)
+    {
+        LOG_WARN("dropped frame '{}' with bad geometry {}x{} stride {} size {}",
+                 message_data->image_name, message_data->width, message_data->height, stride, data.size());
+        return false;
+    }
+
+    // the common case: already our size and format, used where it was received
+    if (channels == 1 && message_data->width == size.width && message_data->height == size.height && stride == (size_t)size.width)
+    {
+        pixels = data;
+        image = cv::Mat(size, CV_8UC1, const_cast<char *>(data.data()));
+        return true;
+    }
+
+    pixels = FrameBuffer::allocate(static_cast<size_t>(size.area()));
+    image = cv::Mat(size, CV_8UC1, pixels.writable_data());
+    cv::Mat frame(message_data->height, message_data->width, channels == 3 ? CV_8UC3 : CV_8UC1, const_cast<char *>(data.data()), stride);
+    cv::Mat gray = frame;
+    if (channels == 3)
+    {
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    }
+    if (gray.size() != image.size())
+    {
+        cv::resize(gray, image, image.size());
+    }
+    else
+    {
+        gray.copyTo(image);
+    }
+    return true;
+}
+
+// set from the command line before the server starts
+static string multicast_group;
+static string multicast_interface;
+
+// joins the multicast group before any client connects, so the first
+// HELLO already sees it
+Comm *comm_factory()
+{
+    Comm *comm = new Comm();
+    auto colon = multicast_group.find(':');
+    if (colon != string::npos)
+    {
+        // frames then arrive once for every server; TCP still works without it
+        comm->join_multicast(multicast_group.substr(0, colon), multicast_group.substr(colon + 1), multicast_interface);
+    }
+    return comm;
+}
+
 void usage()
 {
     cout << "Sample MRR_Pi server code handling display and image messages." << endl;
@@ -99,10 +178,22 @@ void usage()
     cout << endl;
     cout << "usage: MRR_Pi_server" << endl;
     cout << "  [-p port number, range 1024 to 49151, default = " << Comm::default_port << " ]" << endl;
+    cout << "  [-i shm:name to take frames from a client on this machine through shared memory instead of TCP ]" << endl;
+    cout << "  [-m multicast group:port to receive frames on, e.g. 239.255.42.1:5600 ]" << endl;
+    cout << "  [-mi address of the interface to join the multicast group on, default = any ]" << endl;
+    cout << "  [-b bands of rows to render each frame in parallel, default = one per core ]" << endl;
+    cout << "  [-hp 1 to keep received frames in huge pages, default = 0 ]" << endl;
+    cout << "  [-fs microseconds to spin before each frame boundary rather than sleep, default = 200 ]" << endl;
+    cout << "  [-pn 1 to make the noise as each frame renders instead of keeping " << NUM_OF_NOISE_FRAMES << " frames of it, default = 0 ]" << endl;
     cout << endl;
 
     cout << "sample command line (runs server on the default port): ./MRR_Pi_server" << endl;
     cout << "sample command line (specifies port): ./MRR_Pi_server -p 5577" << endl;
+    cout << "sample command line (client on the same machine): ./MRR_Pi_server -i shm:bench" << endl;
+    cout << "sample command line (multicast on one box): ./MRR_Pi_server -p 5577 -m 239.255.42.1:5600 -mi 127.0.0.1" << endl;
+    cout << "sample command line (renders on one core, to compare): ./MRR_Pi_server -b 1" << endl;
+    cout << "sample command line (received frames in huge pages): ./MRR_Pi_server -hp 1" << endl;
+    cout << "sample command line (procedural noise, less memory): ./MRR_Pi_server -pn 1" << endl;
     cout << endl;
 }
 
@@ -134,8 +225,9 @@ int main(int argc, char *argv[])
     // use memcopy to convert Jonathan's container to an opencv Mat   // had ame offset reults
     cv::Mat image1(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
     cv::Mat image2(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
-
-    cv::Mat transformedImg(height, width, CV_8UC1); // Create an empty cv::Mat with the desired dimensions
+    // the received frames image1 and image2 point into, once there are some
+    FrameBuffer image1_pixels;
+    FrameBuffer image2_pixels;
 
     // for timing various things
     auto start_check = std::chrono::high_resolution_clock::now();
@@ -149,8 +241,45 @@ int main(int argc, char *argv[])
     usage();
 
     double fps = 30;
+    int render_bands = 0;
+    bool huge_pages = false;
+    bool procedural_noise = false;
+    int frame_spin_us = 200;
 
-    Comm *comm = Comm::start_server(nullptr, argc, argv);
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0)
+        {
+            multicast_group = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-mi") == 0)
+        {
+            multicast_interface = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            render_bands = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-hp") == 0)
+        {
+            huge_pages = atoi(argv[i + 1]) != 0;
+        }
+        else if (strcmp(argv[i], "-pn") == 0)
+        {
+            procedural_noise = atoi(argv[i + 1]) != 0;
+        }
+        else if (strcmp(argv[i], "-fs") == 0)
+        {
+            frame_spin_us = atoi(argv[i + 1]);
+        }
+    }
+
+    // before any frame arrives: each is received into a block of the pool,
+    // blended from there and given back once replaced; enough blocks for the
+    // cached messages, the frames being faded and those still arriving
+    FramePool::instance().configure(static_cast<size_t>(width) * height, 24, huge_pages);
+
+    Comm *comm = Comm::start_server(nullptr, argc, argv, comm_factory);
     if (comm == nullptr)
     {
         return -1;
@@ -179,13 +308,108 @@ int main(int argc, char *argv[])
 
     long max_loop = std::numeric_limits<long>::max();
 
-    SD loop_sd;
+    // time between iterations of the render loop
+    LatencyHistogram loop_intervals;
+    long late_frames = 0;
+
+    // read with mrr_stat server_<port>
+    LiveStats live_stats;
+    live_stats.open("server_" + comm->port());
+    int stat_uptime = live_stats.add("uptime_ms", STAT_GAUGE);
+    int stat_frames = live_stats.add("frames");
+    int stat_late = live_stats.add("late_frames");
+    int stat_images = live_stats.add("images_received");
+    int stat_matched = live_stats.add("matched");
+    int stat_mismatched = live_stats.add("mismatched");
+    int stat_loop_p50 = live_stats.add("loop_p50_us", STAT_GAUGE);
+    int stat_loop_p99 = live_stats.add("loop_p99_us", STAT_GAUGE);
+    int stat_loop_max = live_stats.add("loop_max_us", STAT_GAUGE);
+    int stat_display_now_p99 = live_stats.add("display_now_p99_us", STAT_GAUGE);
+    int stat_cached = live_stats.add("cached_messages", STAT_GAUGE);
+    int stat_connections = live_stats.add("connections", STAT_GAUGE);
+    int stat_received_queue = live_stats.add("received_queue", STAT_GAUGE);
+    int stat_send_queue = live_stats.add("send_queue", STAT_GAUGE);
+    int stat_bytes_in = live_stats.add("bytes_in");
+    int stat_bytes_out = live_stats.add("bytes_out");
+    int stat_messages_in = live_stats.add("messages_in");
+    int stat_messages_out = live_stats.add("messages_out");
+    int stat_received_drops = live_stats.add("received_drops");
+    int stat_superseded = live_stats.add("images_superseded");
+    int stat_staged = live_stats.add("staged", STAT_GAUGE);
+    int stat_commits = live_stats.add("commits");
+    int stat_commit_misses = live_stats.add("commit_misses");
+    int stat_skipped = live_stats.add("skipped_commits");
+    int stat_late_presentations = live_stats.add("late_presentations");
+    int stat_commit_to_photon_p99 = live_stats.add("commit_to_photon_p99_us", STAT_GAUGE);
+    int stat_clock_synchronized = live_stats.add("clock_synchronized", STAT_GAUGE);
+    int stat_clock_offset = live_stats.add("clock_offset_us", STAT_GAUGE);
+    int stat_clock_drift = live_stats.add("clock_drift_ppb", STAT_GAUGE);
+    int stat_clock_round_trip = live_stats.add("clock_round_trip_us", STAT_GAUGE);
+    int stat_clock_dispersion = live_stats.add("clock_dispersion_us", STAT_GAUGE);
+    int stat_boundary_late_p99 = live_stats.add("boundary_late_p99_us", STAT_GAUGE);
+    int stat_frame_overruns = live_stats.add("frame_overruns");
+    int stat_blend_rebuilds = live_stats.add("blend_rebuilds");
+    int stat_render_p50 = live_stats.add("render_p50_us", STAT_GAUGE);
+    int stat_render_p99 = live_stats.add("render_p99_us", STAT_GAUGE);
+    int stat_missed_slots = live_stats.add("missed_slots");
+    int stat_renders_replaced = live_stats.add("renders_replaced");
+    int stat_frames_overwritten = live_stats.add("frames_overwritten");
+    int stat_render_stage_p99 = live_stats.add("render_stage_p99_us", STAT_GAUGE);
+    int stat_frame_allocations = live_stats.add("frame_allocations");
+    int stat_pool_in_use = live_stats.add("pool_in_use", STAT_GAUGE);
+    int stat_pool_exhausted = live_stats.add("pool_exhausted");
     deque<MessageData *> cached_messages;
-
-    // generate noise
-    std::vector<cv::Mat> noiseFrames = generateNoiseFrames(image1.cols, image1.rows, NUM_OF_NOISE_FRAMES, APPLY_LOW_PASS_FILTER);
+    deque<MessageData *> received_messages;
+
+    // frames staged by the client, shown when it commits them
+    Display display;
+    display.set_frame_period(Seconds(1.0 / fps));
+
+    // frame boundaries, and how late the loop woke up for them. the frame
+    // rendered in one pass of the loop is shown in the next, so the frame
+    // being rendered is one boundary ahead of the one being shown
+    auto frame_period = std::chrono::duration_cast<SteadyClock::duration>(Seconds(1.0 / fps));
+    SteadyClock::time_point present_deadline = begin + frame_period;
+    SteadyClock::time_point previous_deadline = present_deadline;
+    FrameClock frame_clock(frame_period, std::chrono::microseconds(frame_spin_us));
+
+    // generate noise: a bank of frames made now, or each frame's made as it renders, repeating only after 2^32 frames
+    NoiseSource noise(image1.cols, image1.rows, procedural_noise ? 0 : NUM_OF_NOISE_FRAMES, APPLY_LOW_PASS_FILTER,
+                      procedural_noise ? NoiseSource::Procedural : NoiseSource::Bank);
+    LOG_INFO("{} noise took {}ms to make and keeps {} bytes", procedural_noise ? "procedural" : "bank",
+             noise.setupSeconds() * 1e3, noise.memoryBytes());
+    live_stats.set(live_stats.add("noise_setup_us", STAT_GAUGE), static_cast<int64_t>(noise.setupSeconds() * 1e6));
+    live_stats.set(live_stats.add("noise_bytes", STAT_GAUGE), static_cast<int64_t>(noise.memoryBytes()));
     //  Create the parabolic lookup table for gamma correction
     cv::Mat lut = createParabolicLUT();
+    // blend tables, rebuilt when a parameter string changes the gains, and
+    // rendered in bands on a thread per core
+    RenderPool render_pool;
+    if (render_bands <= 0)
+    {
+        render_bands = render_pool.threads();
+    }
+    render_bands = std::min(render_bands, RenderPool::max_bands);
+    BlendPipeline blend_pipeline;
+    blend_pipeline.setPool(&render_pool, render_bands);
+    LOG_INFO("rendering in {} bands", render_bands);
+    vector<int> stat_bands;
+    for (int band = 0; band < render_bands; band++)
+    {
+        stat_bands.push_back(live_stats.add("band" + to_string(band) + "_p50_us", STAT_GAUGE));
+    }
+
+    // frame N+1 renders on its own thread while frame N is shown, through
+    // three output frames; the loop shows the newest finished, and a frame
+    // not finished by its boundary is counted as a missed slot
+    TripleBuffer output_frames(height, width, CV_8UC1);
+    RenderStage render_stage(output_frames, [&](const RenderJob &job, cv::Mat &output)
+                             { blend_pipeline.blend(job.image1, job.image2, noise, output, lut, job.fade,
+                                                    job.image_weight, job.noise_weight, job.gamma, job.gain); });
+    long missed_slots = 0;
+    // taken for the frame being rendered, reported once that frame is shown
+    Presentation pending_presentation;
+    long pending_presentation_frame = -1;
 
 
 
@@ -200,12 +424,21 @@ int main(int argc, char *argv[])
         {
 
             cv::setWindowProperty("Grayscale Image 3", cv::WND_PROP_FULLSCREEN, cv::WINDOW_FULLSCREEN); // Set window to fullscreen
-            cout << " HERE " ;
+            LOG_DEBUG(" HERE ");
         }
 
-        
+        // the boundary the frame rendered now is shown at: on the client's
+        // clock once it has been measured, so every display switches together
+        SteadyClock::time_point deadline = previous_deadline + frame_period;
+        SteadyClock::time_point locked_deadline;
+        if (comm->next_frame_boundary(previous_deadline + frame_period / 2, frame_period, locked_deadline))
+        {
+            deadline = locked_deadline;
+        }
+        previous_deadline = deadline;
+        long render_frame = loop_count + 1;
+
         deque<MessageData *> to_delete;
-        deque<MessageData *> received_messages;
         while (auto message_data = comm->next_received())
         {
             received_messages.push_back(message_data);
@@ -218,15 +451,25 @@ int main(int argc, char *argv[])
             if (message_data->message_type == MessageData::MessageType::IMAGE)
             {
                 do_delete = false;
-                cached_messages.push_back(message_data);
 
                 // for debugging
-                cout << "got image '" << message_data->image_name << "' sz:" << message_data->image_data.size() << endl;
-                control_params_in = message_data->image_name;
-
-                New_Image = true;
-
-                image_count += 1;
+                // only meaningful when the client's clock is this one's, e.g. over shm
+                Seconds age(0);
+                if (message_data->capture_time != SteadyClock::time_point())
+                {
+                    age = SteadyClock::now() - message_data->capture_time;
+                }
+                LOG_DEBUG("got image '{}' sz:{} {}x{} seq:{} age:{}s staged:{}", message_data->image_name, message_data->image_data.size(),
+                          message_data->width, message_data->height, message_data->sequence, age.count(), message_data->staged);
+
+                // a client that doesn't stage has its frames shown as they arrive
+                bool staged = message_data->staged;
+                string image_name = message_data->image_name;
+                display.stage(message_data);
+                if (!staged)
+                {
+                    display.commit(SteadyClock::time_point(), image_name);
+                }
 
                 // for (auto filename : files)
                 // {
@@ -245,12 +488,30 @@ int main(int argc, char *argv[])
                 // }
                 // end debugging
             }
+            else if (message_data->message_type == MessageData::MessageType::DISPLAY_NOW)
+            {
+                display.commit(message_data->present_at, message_data->image_name);
+            }
 
             if (do_delete)
             {
                 to_delete.push_back(message_data);
             }
         }
+        received_messages.clear();
+
+        // the newest commit due by the boundary becomes the new image
+        Presentation presentation;
+        if (display.take_due(deadline, presentation))
+        {
+            cached_messages.push_back(presentation.image);
+            control_params_in = presentation.image->image_name;
+            New_Image = true;
+            image_count += 1;
+            // one still pending was never shown, and its image may go below
+            pending_presentation = presentation;
+            pending_presentation_frame = render_frame;
+        }
 
         while (cached_messages.size() > 2)
         {
@@ -261,7 +522,7 @@ int main(int argc, char *argv[])
         // delete unwanted messages
         for (auto message_data : to_delete)
         {
-            cout << "deleting ty:" << message_data->message_type << " " << message_data->image_name << endl;
+            LOG_DEBUG("deleting ty:{} {}", message_data->message_type, message_data->image_name);
             delete message_data;
         }
 
@@ -272,16 +533,28 @@ int main(int argc, char *argv[])
 
             parseString(control_params_in, Server_Params);
 
-            cout << "HELLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLL  " << Server_Params.Noise_Gain;
+            LOG_DEBUG("HELLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLL  {}", Server_Params.Noise_Gain);
 
             // exit(0);
 
             Fade_Timer = 0;
             // image2 = image1.clone();
-            memcpy(image2.data, cached_messages[0]->image_data.c_str(), size * sizeof(uchar));
+            // replaced rather than written into: the render thread may still
+            // be reading the old ones, which its job keeps alive
+            cv::Mat next_image;
+            FrameBuffer next_pixels;
+            if (frame_to_mat(cached_messages[0], image2.size(), next_image, next_pixels))
+            {
+                image2 = next_image;
+                image2_pixels = next_pixels;
+            }
             if (cached_messages.size() > 1)
             {
-                memcpy(image1.data, cached_messages[1]->image_data.c_str(), size * sizeof(uchar));
+                if (frame_to_mat(cached_messages[1], image1.size(), next_image, next_pixels))
+                {
+                    image1 = next_image;
+                    image1_pixels = next_pixels;
+                }
             }
             New_Image = false;
             Fade_Val = 0;
@@ -305,11 +578,19 @@ int main(int argc, char *argv[])
 
         // float img2Fade = 1.0f - img1Fade;
 
-        blendImagesAndNoise(image1, image2, noiseFrames, transformedImg, lut, Fade_Val,
-                            (float)Server_Params.Input_Gain / 100,
-                            (float)Server_Params.Noise_Gain / 100,
-                            (float)Server_Params.Gamma_Gain / 100,
-                            (float)Server_Params.Output_Gain / 100);
+        RenderJob job;
+        job.frame = render_frame;
+        job.due = deadline;
+        job.image1 = image1;
+        job.image2 = image2;
+        job.pixels1 = image1_pixels;
+        job.pixels2 = image2_pixels;
+        job.fade = Fade_Val;
+        job.image_weight = (float)Server_Params.Input_Gain / 100;
+        job.noise_weight = (float)Server_Params.Noise_Gain / 100;
+        job.gamma = (float)Server_Params.Gamma_Gain / 100;
+        job.gain = (float)Server_Params.Output_Gain / 100;
+        render_stage.submit(job);
 
         // blendImagesAndNoise(image1, image2, noiseFrames, transformedImg, lut, Server_Params.Fade_Time, (float)Server_Params.Noise_Gain / 100 , 1.8) ; // (float)Server_Params.Output_Gain/100  );
 
@@ -319,7 +600,7 @@ int main(int argc, char *argv[])
         if (average_cnter >= 30)
         {
             // cout << "elapsed_2: " << elapsed_2.count() << endl;
-            cout << "elapsed_2: " << avg_sum / 30 << endl;
+            LOG_DEBUG("elapsed_2: {}", avg_sum / 30);
             avg_sum = elapsed_2.count();
             average_cnter = 0;
         }
@@ -327,18 +608,31 @@ int main(int argc, char *argv[])
             avg_sum += elapsed_2.count();
 
         // Loop Timer to set frame rate
-        double goal = (loop_count + 1) / fps;
-        Seconds elapsed = SteadyClock::now() - begin;
-        if (elapsed.count() < goal)
+        // wait for the boundary of the frame shown now, picking up messages
+        // as they arrive, while the next one renders; the last stretch is
+        // the frame clock's, which sleeps to the boundary itself and spins
+        while (auto message_data = comm->next_received_wait(present_deadline - frame_clock.spin()))
         {
-            this_thread::sleep_for(std::chrono::duration<double>(goal - elapsed.count()));
+            received_messages.push_back(message_data);
         }
+        frame_clock.wait_until(present_deadline);
 
         start_check_2 = std::chrono::high_resolution_clock::now();
+        present_deadline = deadline;
 
         // display images code here
-        // Display the image
-        cv::imshow("Grayscale Image 3", transformedImg);
+        // Display the newest frame finished; the one due now if it made it
+        bool new_frame = output_frames.take();
+        RenderedFrame &shown = output_frames.front();
+        if (loop_count > 0 && shown.frame < loop_count)
+        {
+            missed_slots += 1;
+            LOG_DEBUG("frame {} missed its slot, showing {}", loop_count, shown.frame);
+        }
+        if (new_frame)
+        {
+            cv::imshow("Grayscale Image 3", shown.image);
+        }
         // cv::imshow("Grayscale Image 3", image_mixed);
 
         // needed for opencv loop
@@ -347,27 +641,77 @@ int main(int argc, char *argv[])
         { // ASCII code for the escape key
             break;
         }
+        if (pending_presentation.image && shown.frame >= pending_presentation_frame)
+        {
+            display.presented(pending_presentation, SteadyClock::now());
+            pending_presentation = Presentation();
+        }
 
         // check for long frame times
         end_check = std::chrono::high_resolution_clock::now();
         elapsed = end_check - start_check;
         start_check = std::chrono::high_resolution_clock::now();
         if (elapsed.count() > .04)
-            cout << "XXXXXXXXXXXXXXXXXX  " << elapsed.count() << endl;
+        {
+            late_frames += 1;
+            LOG_WARN("XXXXXXXXXXXXXXXXXX  {}", elapsed.count());
+        }
 
         // for debugging
         auto current = SteadyClock::now();
-        loop_sd.increment(current);
-        // for debugging
+        loop_intervals.record_interval(current);
+        // published into shared memory rather than rewriting a file every frame
         elapsed = current - begin;
-        std::ofstream out("server_counter_2_" + comm->port() + ".txt");
-        out << "t:" << elapsed.count() << "s" << endl;
-        out << "images_rec'd: " << image_count << endl;
-        out << "match: " << matched_count << endl;
-        out << "mismatch: " << mismatched_count << endl;
-        loop_sd.dump(out, "loop");
-        out.close();
-        // end debugging
+        CommStats comm_stats = comm->stats();
+        live_stats.set(stat_uptime, static_cast<int64_t>(elapsed.count() * 1e3));
+        live_stats.set(stat_frames, loop_count + 1);
+        live_stats.set(stat_late, late_frames);
+        live_stats.set(stat_images, image_count);
+        live_stats.set(stat_matched, matched_count);
+        live_stats.set(stat_mismatched, mismatched_count);
+        live_stats.set(stat_loop_p50, static_cast<int64_t>(loop_intervals.percentile(50) * 1e6));
+        live_stats.set(stat_loop_p99, static_cast<int64_t>(loop_intervals.percentile(99) * 1e6));
+        live_stats.set(stat_loop_max, static_cast<int64_t>(loop_intervals.max() * 1e6));
+        live_stats.set(stat_display_now_p99, static_cast<int64_t>(comm->display_now_histogram().percentile(99) * 1e6));
+        live_stats.set(stat_cached, static_cast<int64_t>(cached_messages.size()));
+        live_stats.set(stat_connections, comm_stats.connections);
+        live_stats.set(stat_received_queue, comm_stats.received_queue);
+        live_stats.set(stat_send_queue, comm_stats.send_queue);
+        live_stats.set(stat_bytes_in, comm_stats.bytes_in);
+        live_stats.set(stat_bytes_out, comm_stats.bytes_out);
+        live_stats.set(stat_messages_in, comm_stats.messages_in);
+        live_stats.set(stat_messages_out, comm_stats.messages_out);
+        live_stats.set(stat_received_drops, comm_stats.received_drops);
+        live_stats.set(stat_superseded, comm_stats.images_superseded);
+        live_stats.set(stat_staged, static_cast<int64_t>(display.staged_count()));
+        live_stats.set(stat_commits, display.commits);
+        live_stats.set(stat_commit_misses, display.commit_misses);
+        live_stats.set(stat_skipped, display.skipped);
+        live_stats.set(stat_late_presentations, display.late);
+        live_stats.set(stat_commit_to_photon_p99, static_cast<int64_t>(display.commit_to_photon.percentile(99) * 1e6));
+        ClockSync::Estimate clock = comm->clock_estimate();
+        live_stats.set(stat_clock_synchronized, clock.synchronized ? 1 : 0);
+        live_stats.set(stat_clock_offset, clock.offset_ns / 1000);
+        live_stats.set(stat_clock_drift, static_cast<int64_t>(clock.drift_ppm * 1e3));
+        live_stats.set(stat_clock_round_trip, clock.round_trip_ns / 1000);
+        live_stats.set(stat_clock_dispersion, clock.dispersion_ns / 1000);
+        live_stats.set(stat_boundary_late_p99, static_cast<int64_t>(frame_clock.wake_jitter().percentile(99) * 1e6));
+        live_stats.set(stat_frame_overruns, frame_clock.overruns());
+        live_stats.set(stat_blend_rebuilds, blend_pipeline.rebuilds());
+        live_stats.set(stat_missed_slots, missed_slots);
+        live_stats.set(stat_renders_replaced, render_stage.replaced.load());
+        live_stats.set(stat_frames_overwritten, output_frames.overwritten());
+        live_stats.set(stat_render_stage_p99, static_cast<int64_t>(render_stage.render_time.percentile(99) * 1e6));
+        live_stats.set(stat_frame_allocations, FramePool::frame_allocations());
+        live_stats.set(stat_pool_in_use, FramePool::instance().in_use());
+        live_stats.set(stat_pool_exhausted, FramePool::instance().exhausted());
+        live_stats.set(stat_render_p50, static_cast<int64_t>(render_pool.run_time().percentile(50) * 1e6));
+        live_stats.set(stat_render_p99, static_cast<int64_t>(render_pool.run_time().percentile(99) * 1e6));
+        for (int band = 0; band < render_bands; band++)
+        {
+            live_stats.set(stat_bands[band], static_cast<int64_t>(render_pool.band_time(band).percentile(50) * 1e6));
+        }
+        live_stats.publish();
     }
 
     return 0;
@@ -0,0 +1,421 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include "shm_transport.h"
+#include "logger.h"
+
+// the memfd holds a region header, then the server->client ring, then the
+// client->server ring. a ring is a header line followed by its slots; each
+// slot is a slot header (sequence, lengths, the message header and name)
+// followed by the payload
+static const char shm_magic[4] = {'M', 'R', 'R', 'S'};
+static const uint32_t shm_version = 1;
+static const uint32_t shm_slot_count = 8;
+// the least a slot holds, a raw 1024x768 frame with room to spare; a
+// client with larger frames asks for more, up to the most
+static const size_t shm_slot_payload = 1024 * 1024;
+static const size_t shm_max_slot_payload = 64 * 1024 * 1024;
+static const size_t cache_line = 64;
+static const size_t slot_header_size = 512;
+// payloads this small are copied out so they don't hold a slot
+static const size_t copy_threshold = 4096;
+
+struct ShmRegion {
+    char magic[4];
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_payload;
+};
+
+struct ShmRing {
+    // set by a writer that found its next slot taken; the reader rings the
+    // writer's doorbell when it frees a slot while this is set
+    atomic<uint32_t> writer_waiting;
+};
+
+struct ShmSlot {
+    // slot_count * lap + index while free, one more once written
+    atomic<uint32_t> sequence;
+    uint32_t header_length;
+    uint32_t payload_length;
+    uint32_t reserved;
+    char header[slot_header_size - 4 * sizeof(uint32_t)];
+};
+
+static_assert(atomic<uint32_t>::is_always_lock_free, "shared memory needs address-free atomics");
+static_assert(sizeof(ShmRegion) <= cache_line && sizeof(ShmRing) <= cache_line, "headers fit a cache line");
+static_assert(sizeof(ShmSlot) == slot_header_size, "slot header layout");
+
+// hands a payload left in its slot out as a FrameBuffer
+struct ShmSlotStorage {
+    FrameStorage storage;
+    uint32_t position = 0;
+    // keeps the mapping alive while the payload is held
+    shared_ptr<ShmChannel> channel;
+
+    static void release(FrameStorage * storage) {
+        auto slot = static_cast<ShmSlotStorage *>(storage->owner);
+        shared_ptr<ShmChannel> channel = std::move(slot->channel);
+        channel->release_slot(slot->position);
+    }
+};
+
+static size_t slot_stride(size_t slot_payload) {
+    return slot_header_size + slot_payload;
+}
+
+static size_t ring_size(size_t slot_count, size_t slot_payload) {
+    return cache_line + slot_count * slot_stride(slot_payload);
+}
+
+static ShmSlot * slot_at(ShmRing * ring, uint32_t position, uint32_t slot_count, size_t slot_payload) {
+    char * slots = reinterpret_cast<char *>(ring) + cache_line;
+    return reinterpret_cast<ShmSlot *>(slots + (position % slot_count) * slot_stride(slot_payload));
+}
+
+static bool socket_address(const string & name, sockaddr_un & address, socklen_t & length) {
+    // abstract namespace: nothing is left on disk when the server exits
+    string path = string(1, '\0') + "mrr_shm_" + name;
+    if (name.empty() || path.size() > sizeof(address.sun_path)) {
+        LOG_WARN("shm: bad name '{}'", name);
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.data(), path.size());
+    length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+    return true;
+}
+
+static void ring_doorbell(int doorbell) {
+    uint64_t one = 1;
+    if (::write(doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("shm: doorbell failed {}", strerror(errno));
+    }
+}
+
+bool ShmChannel::parse_address(const string & address, string & name) {
+    static const string scheme = "shm:";
+    if (address.compare(0, scheme.size(), scheme) != 0) {
+        return false;
+    }
+    name = address.substr(scheme.size());
+    return true;
+}
+
+int ShmChannel::listen_socket(const string & name) {
+    sockaddr_un address;
+    socklen_t length;
+    if (!socket_address(name, address, length)) {
+        return -1;
+    }
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        LOG_ERROR("shm: socket failed {}", strerror(errno));
+        return -1;
+    }
+    if (::bind(sock_fd, (sockaddr *) &address, length) < 0) {
+        LOG_ERROR("shm: bind to {} failed (another server may be using it) {}", name, strerror(errno));
+        ::close(sock_fd);
+        return -1;
+    }
+    LOG_INFO("server listening at shm:{}", name);
+    return sock_fd;
+}
+
+int ShmChannel::connect_socket(const string & name) {
+    sockaddr_un address;
+    socklen_t length;
+    if (!socket_address(name, address, length)) {
+        return -1;
+    }
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        LOG_ERROR("shm: socket failed {}", strerror(errno));
+        return -1;
+    }
+    if (::connect(sock_fd, (sockaddr *) &address, length) < 0) {
+        LOG_ERROR("shm: connect to {} failed {}", name, strerror(errno));
+        ::close(sock_fd);
+        return -1;
+    }
+    LOG_INFO("client: connecting to shm:{}", name);
+    return sock_fd;
+}
+
+int ShmRequest::read(int sock_fd) {
+    while (received < sizeof(requested)) {
+        ssize_t count = recv(sock_fd, reinterpret_cast<char *>(&requested) + received, sizeof(requested) - received, 0);
+        if (count > 0) {
+            received += static_cast<size_t>(count);
+        }
+        else if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        else {
+            LOG_WARN("shm: client left before asking for a slot size {}", count < 0 ? strerror(errno) : "");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+shared_ptr<ShmChannel> ShmChannel::offer(int sock_fd, size_t payload) {
+    size_t slot_payload = std::min(std::max(payload, shm_slot_payload), shm_max_slot_payload);
+    // keeps the slots cache line aligned
+    slot_payload = (slot_payload + cache_line - 1) / cache_line * cache_line;
+    size_t size = cache_line + 2 * ring_size(shm_slot_count, slot_payload);
+    int memory_fd = memfd_create("mrr_shm", MFD_CLOEXEC);
+    if (memory_fd < 0 || ftruncate(memory_fd, static_cast<off_t>(size)) < 0) {
+        LOG_ERROR("shm: memfd failed {}", strerror(errno));
+        if (memory_fd >= 0) {
+            ::close(memory_fd);
+        }
+        return nullptr;
+    }
+
+    void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    if (memory == MAP_FAILED) {
+        LOG_ERROR("shm: mmap failed {}", strerror(errno));
+        ::close(memory_fd);
+        return nullptr;
+    }
+    auto region = static_cast<ShmRegion *>(memory);
+    memcpy(region->magic, shm_magic, sizeof(shm_magic));
+    region->version = shm_version;
+    region->slot_count = shm_slot_count;
+    region->slot_payload = static_cast<uint32_t>(slot_payload);
+    for (int r = 0; r < 2; r++) {
+        auto ring = reinterpret_cast<ShmRing *>(static_cast<char *>(memory) + cache_line + r * ring_size(shm_slot_count, slot_payload));
+        new (&ring->writer_waiting) atomic<uint32_t>(0);
+        for (uint32_t i = 0; i < shm_slot_count; i++) {
+            new (&slot_at(ring, i, shm_slot_count, slot_payload)->sequence) atomic<uint32_t>(i);
+        }
+    }
+    munmap(memory, size);
+
+    shared_ptr<ShmChannel> channel(new ShmChannel());
+    channel->own_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->peer_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->own_doorbell < 0 || channel->peer_doorbell < 0 || !channel->map(memory_fd, true)) {
+        LOG_ERROR("shm: channel setup failed {}", strerror(errno));
+        ::close(memory_fd);
+        return nullptr;
+    }
+
+    // the client's doorbells are ours the other way around
+    int fds[3] = {memory_fd, channel->peer_doorbell, channel->own_doorbell};
+    char byte = 'S';
+    iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent = sendmsg(sock_fd, &message, MSG_NOSIGNAL);
+    ::close(memory_fd);
+    if (sent != 1) {
+        LOG_ERROR("shm: handing over the rings failed {}", strerror(errno));
+        return nullptr;
+    }
+    LOG_INFO("shm: slots of {} bytes", slot_payload);
+    return channel;
+}
+
+shared_ptr<ShmChannel> ShmChannel::accept(int sock_fd, size_t payload) {
+    uint32_t requested = static_cast<uint32_t>(std::min(payload, shm_max_slot_payload));
+    if (::send(sock_fd, &requested, sizeof(requested), MSG_NOSIGNAL) != sizeof(requested)) {
+        LOG_WARN("shm: asking for a slot size failed {}", strerror(errno));
+        return nullptr;
+    }
+
+    int fds[3] = {-1, -1, -1};
+    char byte;
+    iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received;
+    do {
+        received = recvmsg(sock_fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    cmsghdr * cmsg = received == 1 ? CMSG_FIRSTHDR(&message) : nullptr;
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        LOG_WARN("shm: server didn't hand over the rings {}", strerror(errno));
+        return nullptr;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    shared_ptr<ShmChannel> channel(new ShmChannel());
+    channel->own_doorbell = fds[1];
+    channel->peer_doorbell = fds[2];
+    bool mapped = channel->map(fds[0], false);
+    ::close(fds[0]);
+    return mapped ? channel : nullptr;
+}
+
+bool ShmChannel::map(int memory_fd, bool server) {
+    struct stat status;
+    if (fstat(memory_fd, &status) < 0 || status.st_size < static_cast<off_t>(cache_line)) {
+        LOG_WARN("shm: bad memory {}", strerror(errno));
+        return false;
+    }
+    memory_size = static_cast<size_t>(status.st_size);
+    void * mapped = mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    if (mapped == MAP_FAILED) {
+        LOG_ERROR("shm: mmap failed {}", strerror(errno));
+        return false;
+    }
+    memory = static_cast<char *>(mapped);
+
+    auto region = reinterpret_cast<ShmRegion *>(memory);
+    slot_count = region->slot_count;
+    payload_capacity = region->slot_payload;
+    if (memcmp(region->magic, shm_magic, sizeof(shm_magic)) != 0 || region->version != shm_version || slot_count == 0 ||
+        memory_size < cache_line + 2 * ring_size(slot_count, payload_capacity)) {
+        LOG_WARN("shm: memory layout not recognized");
+        return false;
+    }
+
+    auto first = reinterpret_cast<ShmRing *>(memory + cache_line);
+    auto second = reinterpret_cast<ShmRing *>(memory + cache_line + ring_size(slot_count, payload_capacity));
+    outgoing = server ? first : second;
+    incoming = server ? second : first;
+
+    slot_storage.reset(new ShmSlotStorage[slot_count]);
+    for (uint32_t i = 0; i < slot_count; i++) {
+        ShmSlotStorage & storage = slot_storage[i];
+        storage.storage.capacity = payload_capacity;
+        storage.storage.data = reinterpret_cast<char *>(slot_at(incoming, i, slot_count, payload_capacity)) + slot_header_size;
+        storage.storage.release = ShmSlotStorage::release;
+        storage.storage.owner = &storage;
+    }
+    return true;
+}
+
+ShmChannel::~ShmChannel() {
+    if (memory) {
+        munmap(memory, memory_size);
+    }
+    if (own_doorbell >= 0) {
+        ::close(own_doorbell);
+    }
+    if (peer_doorbell >= 0) {
+        ::close(peer_doorbell);
+    }
+}
+
+int ShmChannel::doorbell_fd() const {
+    return own_doorbell;
+}
+
+void ShmChannel::clear_doorbell() {
+    uint64_t count;
+    while (::read(own_doorbell, &count, sizeof(count)) > 0) {
+    }
+}
+
+size_t ShmChannel::slot_payload() const {
+    return payload_capacity;
+}
+
+size_t ShmChannel::slot_header() const {
+    return sizeof(ShmSlot::header);
+}
+
+bool ShmChannel::write(const string & header, const FrameBuffer & payload) {
+    ShmSlot * slot = slot_at(outgoing, write_position, slot_count, payload_capacity);
+    if (slot->sequence.load() != write_position) {
+        // announce the wait, then look again in case the slot was freed in between
+        outgoing->writer_waiting.store(1);
+        if (slot->sequence.load() != write_position) {
+            slots_full += 1;
+            return false;
+        }
+    }
+
+    slot->header_length = static_cast<uint32_t>(header.size());
+    slot->payload_length = static_cast<uint32_t>(payload.size());
+    memcpy(slot->header, header.data(), slot->header_length);
+    if (!payload.empty()) {
+        memcpy(reinterpret_cast<char *>(slot) + slot_header_size, payload.data(), payload.size());
+    }
+    slot->sequence.store(write_position + 1, memory_order_release);
+    write_position += 1;
+    slots_written += 1;
+    return true;
+}
+
+void ShmChannel::notify_peer() {
+    ring_doorbell(peer_doorbell);
+}
+
+bool ShmChannel::read(string & header, FrameBuffer & payload) {
+    while (true) {
+        uint32_t position = read_position;
+        ShmSlot * slot = slot_at(incoming, position, slot_count, payload_capacity);
+        if (slot->sequence.load(memory_order_acquire) != position + 1) {
+            return false;
+        }
+        read_position += 1;
+
+        if (slot->header_length > sizeof(slot->header) || slot->payload_length > payload_capacity) {
+            LOG_WARN("shm: dropped malformed slot h:{} p:{}", slot->header_length, slot->payload_length);
+            release_slot(position);
+            continue;
+        }
+
+        header.assign(slot->header, slot->header_length);
+        const char * data = reinterpret_cast<char *>(slot) + slot_header_size;
+        if (slot->payload_length <= copy_threshold) {
+            payload = slot->payload_length > 0 ? FrameBuffer::copy_of(data, slot->payload_length) : FrameBuffer();
+            release_slot(position);
+            return true;
+        }
+
+        // the payload stays where the peer wrote it until it is released
+        ShmSlotStorage & storage = slot_storage[position % slot_count];
+        storage.storage.references.store(1, memory_order_relaxed);
+        storage.position = position;
+        storage.channel = shared_from_this();
+        payload = FrameBuffer::adopt(&storage.storage, slot->payload_length);
+        payloads_in_place += 1;
+        return true;
+    }
+}
+
+void ShmChannel::release_slot(uint32_t position) {
+    ShmSlot * slot = slot_at(incoming, position, slot_count, payload_capacity);
+    slot->sequence.store(position + slot_count);
+    if (incoming->writer_waiting.exchange(0) != 0) {
+        ring_doorbell(peer_doorbell);
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "frame_buffer.h"
+
+using namespace std;
+
+// messages between a client and server on the same host, selected with a
+// "shm:name" address. the server listens on an abstract unix socket named
+// after 'name'; a client asks over it for slots holding its largest
+// payload, and the server creates a memfd holding two rings of frame slots
+// of that size (one per direction) and two eventfd doorbells, and passes
+// them back. after that the socket only reports a hangup: a
+// message is copied once into a slot of the shared memory, and a large
+// payload is handed to the receiver in place, the slot being freed when
+// the last FrameBuffer pointing into it goes away.
+
+struct ShmRing;
+struct ShmSlotStorage;
+
+// server: a client's request for its slot size, read as it arrives on a
+// non-blocking socket
+class ShmRequest {
+public:
+    // 1 once the whole request is in, 0 while more is to come, -1 if the
+    // client hung up first
+    int read(int sock_fd);
+    size_t payload() const { return requested; }
+
+private:
+    uint32_t requested = 0;
+    size_t received = 0;
+};
+
+class ShmChannel : public enable_shared_from_this<ShmChannel> {
+public:
+    ~ShmChannel();
+
+    // true if 'address' is "shm:name", with the name
+    static bool parse_address(const string & address, string & name);
+    // server: a listening socket for clients of 'name', -1 on failure
+    static int listen_socket(const string & name);
+    // client: a socket connected to the server of 'name', -1 on failure
+    static int connect_socket(const string & name);
+    // server: creates the rings, with slots as large as the client asked
+    // for (at least 1MB, at most 64MB), and hands them to it on sock_fd
+    static shared_ptr<ShmChannel> offer(int sock_fd, size_t payload);
+    // client: asks for slots holding 'payload' bytes, then maps the rings
+    // the server handed over sock_fd
+    static shared_ptr<ShmChannel> accept(int sock_fd, size_t payload);
+
+    // readable when the peer wrote a message or freed a slot
+    int doorbell_fd() const;
+    void clear_doorbell();
+    // the largest payload a slot holds
+    size_t slot_payload() const;
+    // the longest serialized header (with its name) a slot holds
+    size_t slot_header() const;
+    // copies one serialized header (with its name, at most slot_header()
+    // bytes) and payload into the next outgoing slot; false if the peer
+    // still holds that slot, and the doorbell rings once it lets go of it
+    bool write(const string & header, const FrameBuffer & payload);
+    // wakes the peer after a run of write()s
+    void notify_peer();
+    // the next incoming message: its serialized header (with the name)
+    // and its payload; false if there is none
+    bool read(string & header, FrameBuffer & payload);
+
+    long slots_written = 0;
+    long slots_full = 0;
+    long payloads_in_place = 0;
+
+private:
+    friend struct ShmSlotStorage;
+
+    ShmChannel() = default;
+    bool map(int memory_fd, bool server);
+    void release_slot(uint32_t position);
+
+    char * memory = nullptr;
+    size_t memory_size = 0;
+    uint32_t slot_count = 0;
+    size_t payload_capacity = 0;
+    ShmRing * incoming = nullptr;
+    ShmRing * outgoing = nullptr;
+    int own_doorbell = -1;
+    int peer_doorbell = -1;
+    // only the reactor thread writes and reads
+    uint32_t write_position = 0;
+    uint32_t read_position = 0;
+    // one per incoming slot, for payloads handed out in place
+    unique_ptr<ShmSlotStorage[]> slot_storage;
+};
+
+#endif //SHM_TRANSPORT_H